@@ -33,7 +33,24 @@
 #define PSIPE_HW_BAR0_DMA_CFG_MOD 0x20
 #define PSIPE_HW_BAR0_DMA_CFG_LEN_AVAIL 0x28
 #define PSIPE_HW_BAR0_DMA_DOORBELL_RING 0x30
-#define PSIPE_HW_BAR0_DMA_HANDLES 0x38
+#define PSIPE_HW_BAR0_IRQ_CAUSE 0x38
+#define PSIPE_HW_BAR0_POOL_BUF_SIZE 0x40
+#define PSIPE_HW_BAR0_POOL_SLOT_ADDR 0x48
+#define PSIPE_HW_BAR0_POOL_SLOT_LEN \
+	(PSIPE_HW_BAR0_POOL_SLOT_ADDR + 8 * PSIPE_HW_POOL_SLOTS)
+#define PSIPE_HW_BAR0_POOL_SLOT(reg, slot) ((reg) + 8 * (slot))
+#define PSIPE_HW_BAR0_DMA_CFG_FLG 0xc8
+#define PSIPE_HW_BAR0_DEV_ID 0xd0
+#define PSIPE_HW_BAR0_DMA_CFG_GRP 0xd8
+#define PSIPE_HW_BAR0_DMA_CFG_RED 0xe0
+#define PSIPE_HW_BAR0_DMA_CFG_SRC 0xe8
+#define PSIPE_HW_BAR0_STATS_CLEAR 0xf0
+#define PSIPE_HW_BAR0_DMA_CFG_TRC 0xf8
+#define PSIPE_HW_BAR0_STATS 0x100
+#define PSIPE_HW_BAR0_STAT(stat) (PSIPE_HW_BAR0_STATS + 8 * (stat))
+#define PSIPE_HW_BAR0_CLOCK 0x170
+#define PSIPE_HW_BAR0_POOL_SLOT_TRC 0x180
+#define PSIPE_HW_BAR0_DMA_HANDLES 0x1000
 /* 512 for a space of 2MB (if PAGE_SIZE is 4KB), or
  * 131072 (1MB) for a space of 512MB (if PAGE_SIZE is 4KB)
  * ... and 1 more if offset exists */
@@ -41,12 +58,86 @@
 
 #define PSIPE_HW_BAR0_START PSIPE_HW_BAR0_IRQ_0_RAISE
 #define PSIPE_HW_BAR0_END \
-	(PSIPE_HW_BAR0_DMA_HANDLES + 64 * PSIPE_HW_BAR0_DMA_HANDLES_CNT)
+	(PSIPE_HW_BAR0_DMA_HANDLES + 4 * PSIPE_HW_BAR0_DMA_HANDLES_CNT)
+#define PSIPE_HW_BAR0_SIZE 0x100000
 
 #define PSIPE_HW_DMA_ADDR_CAPABILITY 32
 #define PSIPE_HW_DMA_AREA_START (PSIPE_HW_BAR0_END + 0x1000)
 #define PSIPE_HW_DMA_AREA_SIZE 0x1000
 
+/* PSIPE_HW_BAR0_DMA_CFG_FLG bits */
+#define PSIPE_HW_DMA_FLG_CONTIG (1 << 0) /* handle 0 covers the whole length */
+
+/* PSIPE_HW_BAR0_DMA_CFG_MOD value for a run inside the machine: the pages
+ * come from PSIPE_HW_BAR0_DMA_CFG_SRC (contiguous) instead of the peer */
+#define PSIPE_HW_DMA_MODE_LOCAL 2
+
+/* PSIPE_HW_BAR0_DMA_CFG_RED values: how received data meets the memory it
+ * lands on. Other than NONE, it is combined elementwise with what is there */
+#define PSIPE_HW_DMA_RED_NONE 0
+#define PSIPE_HW_DMA_RED_SUM_F64 1
+#define PSIPE_HW_DMA_RED_SUM_F32 2
+#define PSIPE_HW_DMA_RED_MAX_F64 3
+
+/* ============================================================================
+ * Statistics
+ * ============================================================================
+ */
+
+/* Read only counters, 8 bytes each at PSIPE_HW_BAR0_STAT(n). A write to
+ * PSIPE_HW_BAR0_STATS_CLEAR zeroes them. Times are in ns of the host: DMA
+ * is spent on guest memory, NET on the link and PEER waiting for the peer
+ * to take or start a transfer. Pool transfers count as received runs. A TX
+ * stall is a run the peers had no room for, an RX stall a transfer the
+ * peer had to hold for lack of an armed receive or a free pool slot. */
+#define PSIPE_HW_STAT_TX_BYTES 0
+#define PSIPE_HW_STAT_RX_BYTES 1
+#define PSIPE_HW_STAT_TX_PAGES 2
+#define PSIPE_HW_STAT_RX_PAGES 3
+#define PSIPE_HW_STAT_TX_RUNS 4
+#define PSIPE_HW_STAT_RX_RUNS 5
+#define PSIPE_HW_STAT_DMA_NS 6
+#define PSIPE_HW_STAT_NET_NS 7
+#define PSIPE_HW_STAT_PEER_NS 8
+#define PSIPE_HW_STAT_RUN_MIN_NS 9
+#define PSIPE_HW_STAT_RUN_MAX_NS 10
+#define PSIPE_HW_STAT_TX_STALLS 11
+#define PSIPE_HW_STAT_RX_STALLS 12
+#define PSIPE_HW_STAT_CNT 13
+
+/* ============================================================================
+ * Tracing
+ * ============================================================================
+ */
+
+/* PSIPE_HW_BAR0_DMA_CFG_TRC names an active run across machines: it goes
+ * to the peer with the SLN, and after a passive run it reads the one the
+ * peer sent. Zero lets the device pick one. A filled pool slot reads the
+ * one of its transfer at PSIPE_HW_BAR0_POOL_SLOT(PSIPE_HW_BAR0_POOL_SLOT_TRC,
+ * slot). PSIPE_HW_BAR0_CLOCK reads the realtime clock of the host in ns, for
+ * guest events to be placed on it. */
+
+/* ============================================================================
+ * Receive pool
+ * ============================================================================
+ */
+
+/* Buffers posted by the driver ahead of time. Inbound transfers that find no
+ * armed receive land in the next free slot, in ring order. A slot reads a
+ * non-zero length once filled and is recycled by writing its address again. */
+#define PSIPE_HW_POOL_SLOTS 8
+
+/* ============================================================================
+ * Device groups
+ * ============================================================================
+ */
+
+/* Each device of a machine reads a distinct PSIPE_HW_BAR0_DEV_ID. A non-zero
+ * PSIPE_HW_BAR0_DMA_CFG_GRP (bit n for id n) makes the next active run a
+ * broadcast: LEN_AVAIL asks the peers of every member and reads the least,
+ * and each page is read once and sent to all of them. */
+#define PSIPE_HW_GROUP_MAX 32
+
 /* ============================================================================
  * IRQs
  * ============================================================================
@@ -60,3 +151,7 @@
 #define PSIPE_HW_IRQ_WORK_ENDED_VECTOR 0
 #define PSIPE_HW_IRQ_WORK_ENDED_ADDR PSIPE_HW_BAR0_IRQ_0_RAISE
 #define PSIPE_HW_IRQ_WORK_ENDED_ACK_ADDR PSIPE_HW_BAR0_IRQ_0_LOWER
+
+/* Bits of PSIPE_HW_BAR0_IRQ_CAUSE, acknowledged by writing them back */
+#define PSIPE_HW_IRQ_CAUSE_WORK_ENDED (1 << 0)
+#define PSIPE_HW_IRQ_CAUSE_POOL_FILLED (1 << 1)
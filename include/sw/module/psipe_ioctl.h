@@ -11,6 +11,39 @@ struct psipe_data {
 	unsigned long len;
 };
 
+/* Range inside a buffer obtained with mmap() on the device */
+struct psipe_buf_data {
+	unsigned long buf; /* address returned by mmap() */
+	unsigned long ofs;
+	unsigned long len;
+};
+
+/* Range inside a dma-buf, e.g. one exported with PSIPE_IOCTL_BUF_EXPORT */
+struct psipe_dmabuf_data {
+	int fd;
+	unsigned long ofs;
+	unsigned long len;
+};
+
+/* Send to the peers of every device in group (bit n for device id n) */
+struct psipe_bcast_data {
+	unsigned long addr;
+	unsigned long len;
+	unsigned long group;
+};
+
+/* Receive folding the data into what addr holds (PSIPE_RED_*). The length
+ * has to be a multiple of the element size */
+struct psipe_red_data {
+	unsigned long addr;
+	unsigned long len;
+	unsigned long op;
+};
+
+#define PSIPE_RED_SUM_F64 1
+#define PSIPE_RED_SUM_F32 2
+#define PSIPE_RED_MAX_F64 3
+
 typedef unsigned long psipe_handle_t;
 
 #define PSIPE_IOCTL_MAGIC 0xe1
@@ -19,3 +52,11 @@ typedef unsigned long psipe_handle_t;
 #define PSIPE_IOCTL_RECV _IOW(PSIPE_IOCTL_MAGIC, 2, struct psipe_data *)
 #define PSIPE_IOCTL_WAIT _IOW(PSIPE_IOCTL_MAGIC, 3, psipe_handle_t)
 #define PSIPE_IOCTL_FLUSH _IO(PSIPE_IOCTL_MAGIC, 4)
+#define PSIPE_IOCTL_SEND_BUF _IOW(PSIPE_IOCTL_MAGIC, 5, struct psipe_buf_data *)
+#define PSIPE_IOCTL_RECV_BUF _IOW(PSIPE_IOCTL_MAGIC, 6, struct psipe_buf_data *)
+#define PSIPE_IOCTL_BUF_EXPORT _IOW(PSIPE_IOCTL_MAGIC, 7, unsigned long)
+#define PSIPE_IOCTL_SEND_DMABUF _IOW(PSIPE_IOCTL_MAGIC, 8, struct psipe_dmabuf_data *)
+#define PSIPE_IOCTL_RECV_DMABUF _IOW(PSIPE_IOCTL_MAGIC, 9, struct psipe_dmabuf_data *)
+#define PSIPE_IOCTL_BCAST _IOW(PSIPE_IOCTL_MAGIC, 10, struct psipe_bcast_data *)
+#define PSIPE_IOCTL_DEV_ID _IO(PSIPE_IOCTL_MAGIC, 11)
+#define PSIPE_IOCTL_RECV_RED _IOW(PSIPE_IOCTL_MAGIC, 12, struct psipe_red_data *)
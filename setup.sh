@@ -10,6 +10,7 @@ PROJECT_NAME="psipe"
 
 echo "source $PROJECT_NAME/Kconfig" >> qemu/hw/misc/Kconfig
 echo "subdir('$PROJECT_NAME')" >> qemu/hw/misc/meson.build
+sed -i "s|^\( *\)'hw/misc',$|&\n\1'hw/misc/$PROJECT_NAME',|" qemu/meson.build
 
 ln -s $REPOSITORY_DIR/src/hw/ $REPOSITORY_DIR/qemu/hw/misc/$PROJECT_NAME
 ln -s $REPOSITORY_DIR/include/hw/psipe_hw.h $REPOSITORY_DIR/src/hw/psipe_hw.h
@@ -26,6 +27,7 @@ cd qemu
 	--enable-slirp \
 	--enable-libssh \
 	--enable-vde \
+	--enable-zstd \
 	--enable-virtfs \
 	--target-list=riscv64-softmmu
 
@@ -0,0 +1,202 @@
+/* codec.c - Compression of the pages sent over the proxy
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "codec.h"
+
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+/* ============================================================================
+ * Private
+ * ============================================================================
+ */
+
+static const char *psipe_codec_names[PSIPE_CODEC_NUM] = {
+	[PSIPE_CODEC_NONE] = "none",
+	[PSIPE_CODEC_XOR] = "xor",
+	[PSIPE_CODEC_ZSTD] = "zstd",
+};
+
+/*
+ * Neighbouring doubles of a matrix share sign, exponent and often the low
+ * bits of the mantissa, so XOR with the one before leaves zero bytes at
+ * both ends. Each word becomes a byte with the count of those (leading in
+ * the high nibble, trailing in the low one) and the bytes in between. A
+ * tail shorter than a word goes as is.
+ */
+static int psipe_codec_xor_enc(const uint8_t *src, int len, uint8_t *dst)
+{
+	uint64_t prev = 0, word, x;
+	int i, b, lz, tz, out = 0;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		word = ldq_le_p(src + i);
+		x = word ^ prev;
+		prev = word;
+
+		if (!x) {
+			dst[out++] = 8 << 4;
+			continue;
+		}
+		lz = clz64(x) / 8;
+		tz = ctz64(x) / 8;
+		dst[out++] = lz << 4 | tz;
+		for (b = tz; b < 8 - lz; ++b)
+			dst[out++] = x >> (8 * b);
+	}
+
+	memcpy(dst + out, src + i, len - i);
+	return out + len - i;
+}
+
+static int psipe_codec_xor_dec(const uint8_t *src, int clen, uint8_t *dst,
+		int len)
+{
+	uint64_t prev = 0, x;
+	int i, b, lz, tz, in = 0;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		if (in >= clen)
+			return -1;
+		lz = src[in] >> 4;
+		tz = src[in++] & 0xf;
+		if (lz + tz > 8 || in + 8 - lz - tz > clen)
+			return -1;
+
+		for (x = 0, b = tz; b < 8 - lz; ++b)
+			x |= (uint64_t)src[in++] << (8 * b);
+		prev ^= x;
+		stq_le_p(dst + i, prev);
+	}
+
+	if (clen - in != len - i)
+		return -1;
+	memcpy(dst + i, src + in, len - i);
+	return len;
+}
+
+/* ============================================================================
+ * Public
+ * ============================================================================
+ */
+
+/*
+ * Codecs this build can decompress, one bit each
+ */
+uint32_t psipe_codec_mask(void)
+{
+	uint32_t mask = BIT(PSIPE_CODEC_NONE) | BIT(PSIPE_CODEC_XOR);
+
+#ifdef CONFIG_ZSTD
+	mask |= BIT(PSIPE_CODEC_ZSTD);
+#endif
+	return mask;
+}
+
+int psipe_codec_parse(const char *name)
+{
+	int i;
+
+	for (i = 0; i < PSIPE_CODEC_NUM; ++i) {
+		if (!strcmp(name, psipe_codec_names[i]))
+			return i;
+	}
+
+	return -1;
+}
+
+const char *psipe_codec_name(int codec)
+{
+	if (codec < 0 || codec >= PSIPE_CODEC_NUM)
+		return NULL;
+	return psipe_codec_names[codec];
+}
+
+/*
+ * Compress len bytes of src into dst, which has room for
+ * PSIPE_CODEC_BOUND. Returns the compressed length, or -1 if it would
+ * not be any shorter and the page should go as is.
+ */
+int psipe_codec_compress(PSIPECodec *ctx, int codec, const uint8_t *src,
+		int len, uint8_t *dst)
+{
+	int clen = -1;
+#ifdef CONFIG_ZSTD
+	size_t zlen;
+#endif
+
+	switch (codec) {
+	case PSIPE_CODEC_XOR:
+		clen = psipe_codec_xor_enc(src, len, dst);
+		break;
+#ifdef CONFIG_ZSTD
+	case PSIPE_CODEC_ZSTD:
+		if (!ctx->zc)
+			break;
+		zlen = ZSTD_compressCCtx(ctx->zc, dst, PSIPE_CODEC_BOUND, src,
+				len, PSIPE_CODEC_ZSTD_LEVEL);
+		if (!ZSTD_isError(zlen))
+			clen = zlen;
+		break;
+#endif
+	default:
+		break;
+	}
+
+	return clen < len ? clen : -1;
+}
+
+/*
+ * Undo psipe_codec_compress() straight into dst. Returns len, or -1 if
+ * src does not hold exactly that many bytes.
+ */
+int psipe_codec_decompress(PSIPECodec *ctx, int codec, const uint8_t *src,
+		int clen, uint8_t *dst, int len)
+{
+#ifdef CONFIG_ZSTD
+	size_t zlen;
+#endif
+
+	switch (codec) {
+	case PSIPE_CODEC_XOR:
+		return psipe_codec_xor_dec(src, clen, dst, len);
+#ifdef CONFIG_ZSTD
+	case PSIPE_CODEC_ZSTD:
+		if (!ctx->zd)
+			return -1;
+		zlen = ZSTD_decompressDCtx(ctx->zd, dst, len, src, clen);
+		if (ZSTD_isError(zlen) || zlen != (size_t)len)
+			return -1;
+		return len;
+#endif
+	default:
+		return -1;
+	}
+}
+
+void psipe_codec_init(PSIPECodec *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+#ifdef CONFIG_ZSTD
+	ctx->zc = ZSTD_createCCtx();
+	ctx->zd = ZSTD_createDCtx();
+#endif
+}
+
+void psipe_codec_fini(PSIPECodec *ctx)
+{
+#ifdef CONFIG_ZSTD
+	ZSTD_freeCCtx(ctx->zc);
+	ZSTD_freeDCtx(ctx->zd);
+#endif
+	memset(ctx, 0, sizeof(*ctx));
+}
@@ -0,0 +1,46 @@
+/* codec.h - Compression of the pages sent over the proxy
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PSIPE_CODEC_H
+#define PSIPE_CODEC_H
+
+#include "qemu/osdep.h"
+#include "psipe_hw.h"
+
+#define PSIPE_CODEC_NONE 0
+#define PSIPE_CODEC_XOR 1 /* doubles, each against the one before */
+#define PSIPE_CODEC_ZSTD 2 /* zstd at a fast level, if built with it */
+#define PSIPE_CODEC_NUM 3
+
+#define PSIPE_CODEC_ZSTD_LEVEL -1
+/* room for a compressed page, whatever the codec */
+#define PSIPE_CODEC_BOUND (2 * PSIPE_HW_DMA_AREA_SIZE)
+
+typedef struct PSIPECodec {
+	void *zc; /* ZSTD_CCtx */
+	void *zd; /* ZSTD_DCtx */
+} PSIPECodec;
+
+/* ============================================================================
+ * Public
+ * ============================================================================
+ */
+
+uint32_t psipe_codec_mask(void);
+int psipe_codec_parse(const char *name);
+const char *psipe_codec_name(int codec);
+
+int psipe_codec_compress(PSIPECodec *ctx, int codec, const uint8_t *src,
+		int len, uint8_t *dst);
+int psipe_codec_decompress(PSIPECodec *ctx, int codec, const uint8_t *src,
+		int clen, uint8_t *dst, int len);
+
+void psipe_codec_init(PSIPECodec *ctx);
+void psipe_codec_fini(PSIPECodec *ctx);
+
+#endif /* PSIPE_CODEC_H */
@@ -0,0 +1,136 @@
+/* dedup.c - Pages the peer already holds
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/crc32c.h"
+#include "dedup.h"
+
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
+
+/* ============================================================================
+ * Private
+ * ============================================================================
+ */
+
+static uint32_t psipe_dedup_crc_sw(const uint8_t *buff, int len)
+{
+	return crc32c(0xffffffff, buff, len);
+}
+
+#ifdef __x86_64__
+/* same CRC32C as the table of QEMU, eight bytes at a time */
+static uint32_t __attribute__((target("sse4.2")))
+psipe_dedup_crc_sse42(const uint8_t *buff, int len)
+{
+	uint64_t crc = 0xffffffff, word;
+
+	for (; len >= 8; buff += 8, len -= 8) {
+		memcpy(&word, buff, sizeof(word));
+		crc = _mm_crc32_u64(crc, word);
+	}
+	for (; len > 0; ++buff, --len)
+		crc = _mm_crc32_u8(crc, *buff);
+
+	return crc ^ 0xffffffff;
+}
+#endif
+
+static uint32_t (*psipe_dedup_crc_fn)(const uint8_t *, int) =
+	psipe_dedup_crc_sw;
+
+static inline uint8_t *psipe_dedup_page(PSIPEDedup *dd, int slot)
+{
+	return dd->data + (size_t)slot * PSIPE_HW_DMA_AREA_SIZE;
+}
+
+/* ============================================================================
+ * Public
+ * ============================================================================
+ */
+
+uint32_t psipe_dedup_crc(const uint8_t *buff, int len)
+{
+	return psipe_dedup_crc_fn(buff, len);
+}
+
+/*
+ * Slot holding exactly these bytes, or -1. Nothing is trusted to the CRC
+ * alone, so a collision only costs a memcmp.
+ */
+int psipe_dedup_find(PSIPEDedup *dd, const uint8_t *buff, int len,
+		uint32_t crc)
+{
+	int i;
+
+	for (i = 0; i < PSIPE_DEDUP_SLOTS; ++i) {
+		if (dd->len[i] == len && dd->crc[i] == crc &&
+				!memcmp(psipe_dedup_page(dd, i), buff, len))
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * The receiving end of a reference: the page in slot, or NULL if it does
+ * not match what the sender had, in which case the caches went apart.
+ * Both ends call this (the sender once the reference is out) to keep the
+ * recency of the slot in step.
+ */
+const uint8_t *psipe_dedup_hit(PSIPEDedup *dd, int slot, int len,
+		uint32_t crc)
+{
+	if (slot < 0 || slot >= PSIPE_DEDUP_SLOTS || dd->len[slot] != len ||
+			dd->crc[slot] != crc)
+		return NULL;
+
+	dd->used[slot] = ++dd->clock;
+	return psipe_dedup_page(dd, slot);
+}
+
+/*
+ * Take the page over the least recently used slot. Ties go to the lowest
+ * slot, so both ends always pick the same one.
+ */
+void psipe_dedup_insert(PSIPEDedup *dd, const uint8_t *buff, int len,
+		uint32_t crc)
+{
+	int i, slot = 0;
+
+	if (len <= 0 || len > PSIPE_HW_DMA_AREA_SIZE)
+		return;
+
+	for (i = 1; i < PSIPE_DEDUP_SLOTS; ++i) {
+		if (dd->used[i] < dd->used[slot])
+			slot = i;
+	}
+
+	memcpy(psipe_dedup_page(dd, slot), buff, len);
+	dd->crc[slot] = crc;
+	dd->len[slot] = len;
+	dd->used[slot] = ++dd->clock;
+}
+
+void psipe_dedup_init(PSIPEDedup *dd)
+{
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("sse4.2"))
+		psipe_dedup_crc_fn = psipe_dedup_crc_sse42;
+#endif
+
+	memset(dd, 0, sizeof(*dd));
+	dd->data = g_malloc((size_t)PSIPE_DEDUP_SLOTS * PSIPE_HW_DMA_AREA_SIZE);
+}
+
+void psipe_dedup_fini(PSIPEDedup *dd)
+{
+	g_free(dd->data);
+	memset(dd, 0, sizeof(*dd));
+}
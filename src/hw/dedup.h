@@ -0,0 +1,47 @@
+/* dedup.h - Pages the peer already holds
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PSIPE_DEDUP_H
+#define PSIPE_DEDUP_H
+
+#include "qemu/osdep.h"
+#include "psipe_hw.h"
+
+#define PSIPE_DEDUP_SLOTS 256
+#define PSIPE_DEDUP_MIN 64 /* shorter pages are not worth a reference */
+
+/*
+ * Each end of a link keeps one of these per direction, updated in the same
+ * order by the sender and the receiver, so a slot names the same page on
+ * both. Pages live in slot order in data, PSIPE_HW_DMA_AREA_SIZE apart.
+ */
+typedef struct PSIPEDedup {
+	uint8_t *data;
+	uint32_t crc[PSIPE_DEDUP_SLOTS];
+	int len[PSIPE_DEDUP_SLOTS]; /* 0 if empty */
+	uint64_t used[PSIPE_DEDUP_SLOTS]; /* last use, least is evicted */
+	uint64_t clock;
+} PSIPEDedup;
+
+/* ============================================================================
+ * Public
+ * ============================================================================
+ */
+
+uint32_t psipe_dedup_crc(const uint8_t *buff, int len);
+int psipe_dedup_find(PSIPEDedup *dd, const uint8_t *buff, int len,
+		uint32_t crc);
+const uint8_t *psipe_dedup_hit(PSIPEDedup *dd, int slot, int len,
+		uint32_t crc);
+void psipe_dedup_insert(PSIPEDedup *dd, const uint8_t *buff, int len,
+		uint32_t crc);
+
+void psipe_dedup_init(PSIPEDedup *dd);
+void psipe_dedup_fini(PSIPEDedup *dd);
+
+#endif /* PSIPE_DEDUP_H */
@@ -12,6 +12,7 @@
 #include "qemu/log.h"
 #include "psipe.h"
 #include "dma.h"
+#include "trace.h"
 
 /* ============================================================================
  * Private
@@ -46,16 +47,38 @@ static inline void psipe_dma_init_current(DMAEngine *dma)
 
 static int psipe_dma_read(PSIPEDevice *dev, dma_addr_t addr, int len, int ofs)
 {
+	trace_psipe_dma_segment(dev->group.id, "read", addr, len);
 	return ofs + len > PSIPE_HW_DMA_AREA_SIZE ? -1 : 
 		pci_dma_read(&dev->pci_dev, addr, dev->dma.buff + ofs, len);
 }
 
 static int psipe_dma_write(PSIPEDevice *dev, dma_addr_t addr, int len, int ofs)
 {
+	trace_psipe_dma_segment(dev->group.id, "write", addr, len);
 	return ofs + len > PSIPE_HW_DMA_AREA_SIZE ? -1 : 
 		pci_dma_write(&dev->pci_dev, addr, dev->dma.buff + ofs, len);
 }
 
+/*
+ * Bytes that can be moved from addr before having to switch handles.
+ */
+static inline size_t psipe_dma_len_have(DMAEngine *dma, dma_addr_t addr,
+		size_t len_want)
+{
+	unsigned long mask = psipe_dma_mask(dma, dma->config.page_size - 1);
+
+	if (dma->config.flags & PSIPE_HW_DMA_FLG_CONTIG)
+		return len_want;
+	return dma->config.page_size - (addr & mask);
+}
+
+static inline dma_addr_t psipe_dma_peek_addr(DMAEngine *dma)
+{
+	int pos = dma->current.hnd_pos + 1;
+
+	return pos < dma->config.npages ? dma->config.handles[pos] : 0;
+}
+
 static inline dma_addr_t psipe_dma_next_addr(DMAEngine *dma)
 {
 	if (dma->current.hnd_pos < dma->config.npages)
@@ -65,6 +88,123 @@ static inline dma_addr_t psipe_dma_next_addr(DMAEngine *dma)
 	return dma->config.handles[dma->current.hnd_pos];
 }
 
+/*
+ * Reductions work a vector at a time, with a scalar tail. Buffers are only
+ * byte aligned, hence the copies in and out.
+ */
+typedef double psipe_f64v __attribute__((vector_size(32)));
+typedef float psipe_f32v __attribute__((vector_size(32)));
+typedef int64_t psipe_i64v __attribute__((vector_size(32)));
+
+static void psipe_dma_sum_f64(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	psipe_f64v a, b;
+	double x, y;
+	size_t i;
+
+	for (i = 0; i + sizeof(a) <= len; i += sizeof(a)) {
+		memcpy(&a, dst + i, sizeof(a));
+		memcpy(&b, src + i, sizeof(b));
+		a += b;
+		memcpy(dst + i, &a, sizeof(a));
+	}
+	for (; i < len; i += sizeof(x)) {
+		memcpy(&x, dst + i, sizeof(x));
+		memcpy(&y, src + i, sizeof(y));
+		x += y;
+		memcpy(dst + i, &x, sizeof(x));
+	}
+}
+
+static void psipe_dma_sum_f32(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	psipe_f32v a, b;
+	float x, y;
+	size_t i;
+
+	for (i = 0; i + sizeof(a) <= len; i += sizeof(a)) {
+		memcpy(&a, dst + i, sizeof(a));
+		memcpy(&b, src + i, sizeof(b));
+		a += b;
+		memcpy(dst + i, &a, sizeof(a));
+	}
+	for (; i < len; i += sizeof(x)) {
+		memcpy(&x, dst + i, sizeof(x));
+		memcpy(&y, src + i, sizeof(y));
+		x += y;
+		memcpy(dst + i, &x, sizeof(x));
+	}
+}
+
+static void psipe_dma_max_f64(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	psipe_f64v a, b;
+	psipe_i64v m;
+	double x, y;
+	size_t i;
+
+	for (i = 0; i + sizeof(a) <= len; i += sizeof(a)) {
+		memcpy(&a, dst + i, sizeof(a));
+		memcpy(&b, src + i, sizeof(b));
+		m = a < b;
+		a = (psipe_f64v)(((psipe_i64v)a & ~m) | ((psipe_i64v)b & m));
+		memcpy(dst + i, &a, sizeof(a));
+	}
+	for (; i < len; i += sizeof(x)) {
+		memcpy(&x, dst + i, sizeof(x));
+		memcpy(&y, src + i, sizeof(y));
+		if (x < y)
+			memcpy(dst + i, &y, sizeof(y));
+	}
+}
+
+static inline size_t psipe_dma_red_elem(uint32_t red)
+{
+	return red == PSIPE_HW_DMA_RED_SUM_F32 ? sizeof(float) : sizeof(double);
+}
+
+/*
+ * Reduction: fold what the destination of the next len_want bytes holds into
+ * the incoming page, which is then written over it as usual.
+ */
+static int psipe_dma_fold(PSIPEDevice *dev, int len_want)
+{
+	DMAEngine *dma = &dev->dma;
+	dma_addr_t addr = dma->current.addr, next;
+	size_t len_have = psipe_dma_len_have(dma, addr, len_want);
+
+	if (len_want % psipe_dma_red_elem(dma->config.red))
+		return PSIPE_FAILURE;
+
+	if (len_want <= len_have) {
+		if (pci_dma_read(&dev->pci_dev, addr, dma->acc, len_want))
+			return PSIPE_FAILURE;
+	} else {
+		next = psipe_dma_peek_addr(dma);
+		if (!next || pci_dma_read(&dev->pci_dev, addr, dma->acc,
+					len_have) ||
+				pci_dma_read(&dev->pci_dev, next,
+					dma->acc + len_have,
+					len_want - len_have))
+			return PSIPE_FAILURE;
+	}
+
+	switch (dma->config.red) {
+	case PSIPE_HW_DMA_RED_SUM_F64:
+		psipe_dma_sum_f64(dma->buff, dma->acc, len_want);
+		break;
+	case PSIPE_HW_DMA_RED_SUM_F32:
+		psipe_dma_sum_f32(dma->buff, dma->acc, len_want);
+		break;
+	case PSIPE_HW_DMA_RED_MAX_F64:
+		psipe_dma_max_f64(dma->buff, dma->acc, len_want);
+		break;
+	default:
+		return PSIPE_FAILURE;
+	}
+
+	return PSIPE_SUCCESS;
+}
 
 /* ============================================================================
  * Public
@@ -77,13 +217,11 @@ static inline dma_addr_t psipe_dma_next_addr(DMAEngine *dma)
 int psipe_dma_rx_page(PSIPEDevice *dev)
 {
 	DMAEngine *dma = &dev->dma;
-	unsigned long mask = psipe_dma_mask(dma, dma->config.page_size - 1);
 	dma_addr_t addr = dma->current.addr;
-	size_t ofs, len_want, len_have;
+	size_t len_want, len_have;
 
-	ofs = addr & mask;
-	len_have = dma->config.page_size - ofs;
 	len_want = MIN(dma->config.page_size, dma->current.len_left);
+	len_have = psipe_dma_len_have(dma, addr, len_want);
 
 	if (len_want <= len_have) {
 		if (psipe_dma_read(dev, addr, len_want, 0) < 0)
@@ -112,16 +250,18 @@ int psipe_dma_rx_page(PSIPEDevice *dev)
 int psipe_dma_tx_page(PSIPEDevice *dev, int len_want)
 {
 	DMAEngine *dma = &dev->dma;
-	unsigned long mask = psipe_dma_mask(dma, dma->config.page_size - 1);
 	dma_addr_t addr = dma->current.addr;
-	size_t ofs, len_have;
-
-	ofs = addr & mask;
-	len_have = dma->config.page_size - ofs;
+	size_t len_have;
 
 	if (!len_want || len_want == PSIPE_FAILURE)
 		return PSIPE_FAILURE;
 
+	if (dma->config.red != PSIPE_HW_DMA_RED_NONE &&
+			psipe_dma_fold(dev, len_want) == PSIPE_FAILURE)
+		return PSIPE_FAILURE;
+
+	len_have = psipe_dma_len_have(dma, addr, len_want);
+
 	if (len_want <= len_have) {
 		if (psipe_dma_write(dev, addr, len_want, 0) < 0)
 			return PSIPE_FAILURE;
@@ -143,6 +283,20 @@ int psipe_dma_tx_page(PSIPEDevice *dev, int len_want)
 	return PSIPE_SUCCESS;
 }
 
+/*
+ * Local page: DMA buffer <-- RAM (source of a DMA_MODE_LOCAL run)
+ */
+int psipe_dma_local_page(PSIPEDevice *dev)
+{
+	DMAEngine *dma = &dev->dma;
+	dma_size_t done = dma->config.len - dma->current.len_left;
+	int len = MIN(dma->config.page_size, dma->current.len_left);
+
+	if (psipe_dma_read(dev, dma->config.src + done, len, 0) < 0)
+		return PSIPE_FAILURE;
+	return len;
+}
+
 int psipe_dma_begin_run(PSIPEDevice *dev)
 {
 	DMAStatus status;
@@ -182,8 +336,13 @@ void psipe_dma_reset(PSIPEDevice *dev)
 {
 	DMAEngine *dma = &dev->dma;
 	dma->status = DMA_STATUS_IDLE;
+	dma->armed = false;
 	dma->config.npages = 0;
 	dma->config.len = 0;
+	dma->config.flags = 0;
+	dma->config.red = PSIPE_HW_DMA_RED_NONE;
+	dma->config.src = 0;
+	dma->config.trace = 0;
 	dma->config.page_size = qemu_target_page_size();
 	memset(dma->buff, 0, PSIPE_HW_DMA_AREA_SIZE);
 	memset(dma->config.handles, 0,
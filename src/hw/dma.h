@@ -27,6 +27,10 @@ typedef struct DMAConfig {
 	dma_size_t len;
 	dma_size_t len_avail;
 	dma_mask_t mask;
+	uint32_t flags;
+	uint32_t red;
+	dma_addr_t src; /* DMA_MODE_LOCAL source */
+	uint64_t trace; /* see PSIPE_HW_BAR0_DMA_CFG_TRC */
 	size_t page_size;
 	dma_addr_t handles[PSIPE_HW_BAR0_DMA_HANDLES_CNT];
 } DMAConfig;
@@ -46,6 +50,7 @@ typedef enum DMAStatus {
 typedef enum DMAMode {
 	DMA_MODE_ACTIVE,
 	DMA_MODE_PASSIVE,
+	DMA_MODE_LOCAL,
 } DMAMode;
 
 typedef struct DMAEngine {
@@ -53,7 +58,9 @@ typedef struct DMAEngine {
 	DMACurrent current;
 	DMAStatus status;
 	DMAMode mode;
+	bool armed; /* passive run waiting for the peer */
 	uint8_t buff[PSIPE_HW_DMA_AREA_SIZE];
+	uint8_t acc[PSIPE_HW_DMA_AREA_SIZE]; /* destination, for reductions */
 } DMAEngine;
 
 /* ============================================================================
@@ -63,6 +70,7 @@ typedef struct DMAEngine {
 
 int psipe_dma_rx_page(PSIPEDevice *dev);
 int psipe_dma_tx_page(PSIPEDevice *dev, int len_want);
+int psipe_dma_local_page(PSIPEDevice *dev);
 
 int psipe_dma_begin_run(PSIPEDevice *dev);
 void psipe_dma_end_run(PSIPEDevice *dev);
@@ -0,0 +1,79 @@
+/* group.c - Devices of the same machine sharing active runs
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "psipe.h"
+#include "group.h"
+
+/* ============================================================================
+ * Private
+ * ============================================================================
+ */
+
+/* Every psipe device of this QEMU, by id. Only touched with the BQL held. */
+static PSIPEDevice *psipe_group_devs[PSIPE_HW_GROUP_MAX];
+
+/* ============================================================================
+ * Public
+ * ============================================================================
+ */
+
+/*
+ * Devices whose peers take the active run of dev: every registered member
+ * of its group mask, or dev alone if the mask is empty. The pages are read
+ * from guest memory once and sent through each of their proxies.
+ */
+int psipe_group_targets(PSIPEDevice *dev, PSIPEDevice **targets)
+{
+	uint32_t mask = dev->group.mask;
+	int i, n = 0;
+
+	if (!mask) {
+		targets[0] = dev;
+		return 1;
+	}
+
+	for (i = 0; i < PSIPE_HW_GROUP_MAX; ++i) {
+		if ((mask & (1U << i)) && psipe_group_devs[i])
+			targets[n++] = psipe_group_devs[i];
+	}
+
+	return n;
+}
+
+void psipe_group_reset(PSIPEDevice *dev)
+{
+	dev->group.mask = 0;
+}
+
+void psipe_group_init(PSIPEDevice *dev, Error **errp)
+{
+	int i;
+
+	psipe_group_reset(dev);
+	dev->group.id = -1;
+
+	for (i = 0; i < PSIPE_HW_GROUP_MAX; ++i) {
+		if (!psipe_group_devs[i]) {
+			psipe_group_devs[i] = dev;
+			dev->group.id = i;
+			return;
+		}
+	}
+
+	error_setg(errp, "psipe: no more than %d devices per machine",
+			PSIPE_HW_GROUP_MAX);
+}
+
+void psipe_group_fini(PSIPEDevice *dev)
+{
+	if (dev->group.id >= 0)
+		psipe_group_devs[dev->group.id] = NULL;
+	dev->group.id = -1;
+}
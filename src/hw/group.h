@@ -0,0 +1,34 @@
+/* group.h - Devices of the same machine sharing active runs
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PSIPE_GROUP_H
+#define PSIPE_GROUP_H
+
+#include "qemu/osdep.h"
+#include "psipe_hw.h"
+
+/* forward declaration */
+typedef struct PSIPEDevice PSIPEDevice;
+
+typedef struct PSIPEGroup {
+	int id; /* index in the machine's registry, -1 if none */
+	uint32_t mask; /* ids the next active run goes to, 0 for own peer */
+} PSIPEGroup;
+
+/* ============================================================================
+ * Public
+ * ============================================================================
+ */
+
+int psipe_group_targets(PSIPEDevice *dev, PSIPEDevice **targets);
+
+void psipe_group_reset(PSIPEDevice *dev);
+void psipe_group_init(PSIPEDevice *dev, Error **errp);
+void psipe_group_fini(PSIPEDevice *dev);
+
+#endif /* PSIPE_GROUP_H */
@@ -110,8 +110,28 @@ int psipe_irq_check(PSIPEDevice *dev, unsigned int vector)
 	return -1;
 }
 
+/*
+ * Cause bits tell the driver why the work-ended vector fired. The line stays
+ * raised (or MSI is notified again) while any cause is left unacknowledged.
+ */
+void psipe_irq_raise_cause(PSIPEDevice *dev, uint32_t cause)
+{
+	dev->irq_cause |= cause;
+	psipe_irq_raise(dev, PSIPE_HW_IRQ_WORK_ENDED_VECTOR);
+}
+
+void psipe_irq_ack_cause(PSIPEDevice *dev, uint32_t cause)
+{
+	dev->irq_cause &= ~cause;
+	if (dev->irq_cause)
+		psipe_irq_raise(dev, PSIPE_HW_IRQ_WORK_ENDED_VECTOR);
+	else
+		psipe_irq_lower(dev, PSIPE_HW_IRQ_WORK_ENDED_VECTOR);
+}
+
 void psipe_irq_reset(PSIPEDevice *dev)
 {
+	dev->irq_cause = 0;
 	for (int i = 0; i < PSIPE_HW_IRQ_CNT; ++i)
 		psipe_irq_lower(dev, i);
 }
@@ -44,6 +44,8 @@ typedef union IRQStatus {
 void psipe_irq_raise(PSIPEDevice *dev, unsigned int vector);
 void psipe_irq_lower(PSIPEDevice *dev, unsigned int vector);
 int psipe_irq_check(PSIPEDevice *dev, unsigned int vector);
+void psipe_irq_raise_cause(PSIPEDevice *dev, uint32_t cause);
+void psipe_irq_ack_cause(PSIPEDevice *dev, uint32_t cause);
 
 void psipe_irq_reset(PSIPEDevice *dev);
 void psipe_irq_init(PSIPEDevice *dev, Error **errp);
@@ -14,6 +14,9 @@
 #include "qemu/units.h"
 #include "mmio.h"
 #include "irq.h"
+#include "pool.h"
+#include "stats.h"
+#include "trace.h"
 #include "psipe_hw.h"
 
 /* ============================================================================
@@ -31,15 +34,31 @@ static inline int psipe_mmio_handle_pos(hwaddr addr)
 	return ((addr - PSIPE_HW_BAR0_DMA_HANDLES) / sizeof(uint32_t));
 }
 
-static void psipe_mmio_write_handle(DMAEngine *dma, hwaddr addr, uint64_t hnd)
+static inline bool psipe_mmio_in_range(hwaddr addr, hwaddr base, int cnt)
 {
-	int pos = psipe_mmio_handle_pos(addr);
+	return base <= addr && addr < base + 8 * cnt;
+}
+
+static inline int psipe_mmio_slot(hwaddr addr, hwaddr base)
+{
+	return (addr - base) / 8;
+}
 
+static void psipe_mmio_write_handle(PSIPEDevice *dev, hwaddr addr,
+		uint64_t hnd)
+{
+	DMAEngine *dma = &dev->dma;
+	int pos;
+
+	if (addr < PSIPE_HW_BAR0_DMA_HANDLES)
+		return;
+
+	pos = psipe_mmio_handle_pos(addr);
 	if (pos >= dma->config.npages || !dma->config.handles)
 		return;
 
 	dma->config.handles[pos] = hnd;
-	printf("+ %#010lx at %#06lx (pos=%d)\n", hnd, addr, pos);
+	trace_psipe_mmio_handle(dev->group.id, pos, hnd);
 }
 
 static uint64_t psipe_mmio_read(void *opaque, hwaddr addr, unsigned int size)
@@ -64,16 +83,57 @@ static uint64_t psipe_mmio_read(void *opaque, hwaddr addr, unsigned int size)
 	case PSIPE_HW_BAR0_DMA_CFG_MOD:
 		val = dev->dma.mode;
 		break;
+	case PSIPE_HW_BAR0_DMA_CFG_FLG:
+		val = dev->dma.config.flags;
+		break;
 	case PSIPE_HW_BAR0_DMA_CFG_LEN_AVAIL:
-		if (dev->dma.mode == DMA_MODE_ACTIVE) {
-			psipe_proxy_issue_req(dev, PSIPE_REQ_SLN);
-			psipe_proxy_await_req(dev, PSIPE_REQ_RLN);
-		}
-		val = dev->dma.config.len_avail;
+		if (dev->dma.mode == DMA_MODE_ACTIVE)
+			val = psipe_negotiate(dev);
+		else
+			val = dev->dma.config.len_avail;
+		break;
+	case PSIPE_HW_BAR0_IRQ_CAUSE:
+		val = dev->irq_cause;
+		break;
+	case PSIPE_HW_BAR0_POOL_BUF_SIZE:
+		val = dev->pool.buf_size;
+		break;
+	case PSIPE_HW_BAR0_DEV_ID:
+		val = dev->group.id;
+		break;
+	case PSIPE_HW_BAR0_DMA_CFG_GRP:
+		val = dev->group.mask;
+		break;
+	case PSIPE_HW_BAR0_DMA_CFG_RED:
+		val = dev->dma.config.red;
+		break;
+	case PSIPE_HW_BAR0_DMA_CFG_SRC:
+		val = dev->dma.config.src;
+		break;
+	case PSIPE_HW_BAR0_DMA_CFG_TRC:
+		val = dev->dma.config.trace;
+		break;
+	case PSIPE_HW_BAR0_CLOCK:
+		val = get_clock_realtime();
+		break;
+	default:
+		if (psipe_mmio_in_range(addr, PSIPE_HW_BAR0_POOL_SLOT_LEN,
+					PSIPE_HW_POOL_SLOTS))
+			val = psipe_pool_slot_len(dev, psipe_mmio_slot(addr,
+						PSIPE_HW_BAR0_POOL_SLOT_LEN));
+		else if (psipe_mmio_in_range(addr, PSIPE_HW_BAR0_POOL_SLOT_TRC,
+					PSIPE_HW_POOL_SLOTS))
+			val = psipe_pool_slot_trace(dev, psipe_mmio_slot(addr,
+						PSIPE_HW_BAR0_POOL_SLOT_TRC));
+		else if (psipe_mmio_in_range(addr, PSIPE_HW_BAR0_STATS,
+					PSIPE_HW_STAT_CNT))
+			val = psipe_stats_read(dev, psipe_mmio_slot(addr,
+						PSIPE_HW_BAR0_STATS));
 		break;
 	}
 
 mmio_read_end:
+	trace_psipe_mmio_read(dev->group.id, addr, val);
 	return val;
 }
 
@@ -89,6 +149,10 @@ static void psipe_mmio_write(void *opaque, hwaddr addr, uint64_t val,
 	if (!psipe_dma_is_idle(dev))
 		return;
 
+	/* the handles are traced on their own, there may be many */
+	if (addr < PSIPE_HW_BAR0_DMA_HANDLES)
+		trace_psipe_mmio_write(dev->group.id, addr, val);
+
 	switch(addr) {
 	case PSIPE_HW_BAR0_IRQ_0_RAISE:
 		psipe_irq_raise(dev, 0);
@@ -103,16 +167,52 @@ static void psipe_mmio_write(void *opaque, hwaddr addr, uint64_t val,
 		dma->config.npages = val;
 		break;
 	case PSIPE_HW_BAR0_DMA_CFG_MOD:
-		dma->mode = val > 0 ? DMA_MODE_ACTIVE : DMA_MODE_PASSIVE;
+		if (val == PSIPE_HW_DMA_MODE_LOCAL)
+			dma->mode = DMA_MODE_LOCAL;
+		else
+			dma->mode = val > 0 ? DMA_MODE_ACTIVE : DMA_MODE_PASSIVE;
+		break;
+	case PSIPE_HW_BAR0_DMA_CFG_FLG:
+		dma->config.flags = val;
 		break;
 	case PSIPE_HW_BAR0_DMA_CFG_LEN_AVAIL:
 		dma->config.len_avail = val;
 		break;
 	case PSIPE_HW_BAR0_DMA_DOORBELL_RING:
+		trace_psipe_doorbell(dev->group.id, dma->mode, dma->config.len,
+				dma->config.npages);
 		psipe_execute(dev);
 		break;
-	default: /* DMA handles area */
-		psipe_mmio_write_handle(dma, addr, val);
+	case PSIPE_HW_BAR0_IRQ_CAUSE:
+		psipe_irq_ack_cause(dev, val);
+		break;
+	case PSIPE_HW_BAR0_POOL_BUF_SIZE:
+		dev->pool.buf_size = val;
+		break;
+	case PSIPE_HW_BAR0_DMA_CFG_GRP:
+		dev->group.mask = val;
+		break;
+	case PSIPE_HW_BAR0_DMA_CFG_RED:
+		dma->config.red = val;
+		break;
+	case PSIPE_HW_BAR0_DMA_CFG_SRC:
+		dma->config.src = val & dma->config.mask;
+		break;
+	case PSIPE_HW_BAR0_STATS_CLEAR:
+		psipe_stats_reset(dev);
+		break;
+	case PSIPE_HW_BAR0_DMA_CFG_TRC:
+		dma->config.trace = val;
+		break;
+	default:
+		if (psipe_mmio_in_range(addr, PSIPE_HW_BAR0_POOL_SLOT_ADDR,
+					PSIPE_HW_POOL_SLOTS)) {
+			psipe_pool_post(dev, psipe_mmio_slot(addr,
+						PSIPE_HW_BAR0_POOL_SLOT_ADDR), val);
+			psipe_serve_peer(dev);
+		} else { /* DMA handles area */
+			psipe_mmio_write_handle(dev, addr, val);
+		}
 		break;
 	}
 }
@@ -130,7 +230,7 @@ void psipe_mmio_reset(PSIPEDevice *dev)
 void psipe_mmio_init(PSIPEDevice *dev, Error **errp)
 {
 	memory_region_init_io(&dev->mmio, OBJECT(dev), &psipe_mmio_ops, dev,
-			"psipe-mmio", qemu_target_page_size());
+			"psipe-mmio", PSIPE_HW_BAR0_SIZE);
 
 	pci_register_bar(&dev->pci_dev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY,
 			&dev->mmio);
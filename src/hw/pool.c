@@ -0,0 +1,122 @@
+/* pool.c - Pre-posted receive buffers
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/log.h"
+#include "psipe.h"
+#include "pool.h"
+#include "trace.h"
+
+/* ============================================================================
+ * Private
+ * ============================================================================
+ */
+
+static inline bool psipe_pool_slot_free(PSIPEPool *pool, int slot)
+{
+	return pool->addr[slot] && !pool->len[slot];
+}
+
+/* ============================================================================
+ * Public
+ * ============================================================================
+ */
+
+/*
+ * Posting an address (again) hands the slot back to the device. A zero
+ * address withdraws it.
+ */
+void psipe_pool_post(PSIPEDevice *dev, int slot, dma_addr_t addr)
+{
+	PSIPEPool *pool = &dev->pool;
+
+	if (slot < 0 || slot >= PSIPE_HW_POOL_SLOTS)
+		return;
+
+	pool->addr[slot] = addr & dev->dma.config.mask;
+	pool->len[slot] = 0;
+	pool->trace[slot] = 0;
+}
+
+uint64_t psipe_pool_slot_len(PSIPEDevice *dev, int slot)
+{
+	if (slot < 0 || slot >= PSIPE_HW_POOL_SLOTS)
+		return 0;
+	return dev->pool.len[slot];
+}
+
+uint64_t psipe_pool_slot_trace(PSIPEDevice *dev, int slot)
+{
+	if (slot < 0 || slot >= PSIPE_HW_POOL_SLOTS)
+		return 0;
+	return dev->pool.trace[slot];
+}
+
+bool psipe_pool_can_take(PSIPEDevice *dev, dma_size_t len)
+{
+	PSIPEPool *pool = &dev->pool;
+
+	return len && len <= pool->buf_size &&
+		psipe_pool_slot_free(pool, pool->fill);
+}
+
+/*
+ * Receive a whole transfer: socket --> buffer --> pool slot
+ */
+int psipe_pool_rx(PSIPEDevice *dev, dma_size_t len)
+{
+	PSIPEPool *pool = &dev->pool;
+	int slot = pool->fill;
+	dma_size_t done = 0;
+	int64_t start = psipe_stats_now(), t;
+	int n;
+
+	while (done < len) {
+		t = psipe_stats_now();
+		n = psipe_proxy_rx_page(dev, dev->dma.buff);
+		t = psipe_stats_time(dev, PSIPE_HW_STAT_NET_NS, t);
+		if (n == PSIPE_FAILURE || done + n > pool->buf_size)
+			return PSIPE_FAILURE;
+		if (pci_dma_write(&dev->pci_dev, pool->addr[slot] + done,
+					dev->dma.buff, n) != MEMTX_OK)
+			return PSIPE_FAILURE;
+		psipe_stats_time(dev, PSIPE_HW_STAT_DMA_NS, t);
+		psipe_stats_add(dev, PSIPE_HW_STAT_RX_BYTES, n);
+		psipe_stats_add(dev, PSIPE_HW_STAT_RX_PAGES, 1);
+		done += n;
+	}
+
+	psipe_stats_run(dev, PSIPE_HW_STAT_RX_RUNS, start);
+	trace_psipe_pool_rx(dev->group.id, slot, done,
+			dev->proxy.sln_stamp.trace);
+	pool->len[slot] = done;
+	pool->trace[slot] = dev->proxy.sln_stamp.trace;
+	pool->fill = (slot + 1) % PSIPE_HW_POOL_SLOTS;
+	return PSIPE_SUCCESS;
+}
+
+void psipe_pool_reset(PSIPEDevice *dev)
+{
+	PSIPEPool *pool = &dev->pool;
+
+	pool->buf_size = 0;
+	pool->fill = 0;
+	memset(pool->addr, 0, sizeof(pool->addr));
+	memset(pool->len, 0, sizeof(pool->len));
+	memset(pool->trace, 0, sizeof(pool->trace));
+}
+
+void psipe_pool_init(PSIPEDevice *dev, Error **errp)
+{
+	psipe_pool_reset(dev);
+}
+
+void psipe_pool_fini(PSIPEDevice *dev)
+{
+	psipe_pool_reset(dev);
+}
@@ -0,0 +1,42 @@
+/* pool.h - Pre-posted receive buffers
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PSIPE_POOL_H
+#define PSIPE_POOL_H
+
+#include "qemu/osdep.h"
+#include "psipe_hw.h"
+#include "dma.h"
+
+/* forward declaration */
+typedef struct PSIPEDevice PSIPEDevice;
+
+typedef struct PSIPEPool {
+	dma_size_t buf_size;
+	dma_addr_t addr[PSIPE_HW_POOL_SLOTS];
+	dma_size_t len[PSIPE_HW_POOL_SLOTS];
+	uint64_t trace[PSIPE_HW_POOL_SLOTS];
+	int fill;
+} PSIPEPool;
+
+/* ============================================================================
+ * Public
+ * ============================================================================
+ */
+
+void psipe_pool_post(PSIPEDevice *dev, int slot, dma_addr_t addr);
+uint64_t psipe_pool_slot_len(PSIPEDevice *dev, int slot);
+uint64_t psipe_pool_slot_trace(PSIPEDevice *dev, int slot);
+bool psipe_pool_can_take(PSIPEDevice *dev, dma_size_t len);
+int psipe_pool_rx(PSIPEDevice *dev, dma_size_t len);
+
+void psipe_pool_reset(PSIPEDevice *dev);
+void psipe_pool_init(PSIPEDevice *dev, Error **errp);
+void psipe_pool_fini(PSIPEDevice *dev);
+
+#endif /* PSIPE_POOL_H */
@@ -7,9 +7,13 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/cutils.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
 #include "proxy.h"
 #include "psipe.h"
+#include "trace.h"
+#include "qapi/error.h"
 #include "qapi/qapi-commands-machine.h"
 
 /* ============================================================================
@@ -17,6 +21,9 @@
  * ============================================================================
  */
 
+static void psipe_proxy_read_handler(void *opaque);
+static int psipe_proxy_negotiate(PSIPEDevice *dev);
+
 static void psipe_proxy_init_server(PSIPEDevice *dev)
 {
 	PSIPEProxy *proxy = &dev->proxy;
@@ -53,6 +60,14 @@ static void psipe_proxy_init_server(PSIPEDevice *dev)
 	}
 	puts("Client connection established.");
 	/* End connection test */
+
+	if (psipe_proxy_negotiate(dev) != PSIPE_SUCCESS) {
+		perror("psipe_proxy_negotiate");
+		return;
+	}
+
+	qemu_set_fd_handler(proxy->client.sockd, psipe_proxy_read_handler,
+			NULL, dev);
 }
 
 static void psipe_proxy_init_client(PSIPEDevice *dev)
@@ -76,6 +91,14 @@ static void psipe_proxy_init_client(PSIPEDevice *dev)
 	}
 	puts("Server connection established.");
 	/* End connection test */
+
+	if (psipe_proxy_negotiate(dev) != PSIPE_SUCCESS) {
+		perror("psipe_proxy_negotiate");
+		return;
+	}
+
+	qemu_set_fd_handler(proxy->server.sockd, psipe_proxy_read_handler,
+			NULL, dev);
 }
 
 static inline int psipe_proxy_endpoint(PSIPEDevice *dev)
@@ -84,6 +107,36 @@ static inline int psipe_proxy_endpoint(PSIPEDevice *dev)
 			dev->proxy.client.sockd : dev->proxy.server.sockd);
 }
 
+static inline int psipe_proxy_recv_all(int con, void *buff, size_t len)
+{
+	return recv(con, buff, len, MSG_WAITALL) == (ssize_t)len ?
+		PSIPE_SUCCESS : PSIPE_FAILURE;
+}
+
+/*
+ * Each end tells the other the codec it would like to send with and the
+ * ones it can take. A direction is compressed with the choice of its
+ * sender if the receiver can undo it, and goes as is otherwise.
+ */
+static int psipe_proxy_negotiate(PSIPEDevice *dev)
+{
+	PSIPEProxy *proxy = &dev->proxy;
+	int con = psipe_proxy_endpoint(dev);
+	uint32_t mine[2] = { proxy->codec, psipe_codec_mask() };
+	uint32_t peer[2]; /* the codec the peer wants is only informative */
+
+	if (send(con, mine, sizeof(mine), 0) < 0 ||
+			psipe_proxy_recv_all(con, peer, sizeof(peer)) < 0)
+		return PSIPE_FAILURE;
+
+	proxy->tx_codec = peer[1] & BIT(proxy->codec) ?
+		proxy->codec : PSIPE_CODEC_NONE;
+	trace_psipe_proxy_codec(dev->group.id,
+			psipe_codec_name(proxy->tx_codec));
+
+	return PSIPE_SUCCESS;
+}
+
 static ProxyRequest psipe_proxy_wait_req(PSIPEDevice *dev)
 {
 	int con = psipe_proxy_endpoint(dev);
@@ -92,14 +145,21 @@ static ProxyRequest psipe_proxy_wait_req(PSIPEDevice *dev)
 
 	FD_ZERO(&cons);
 	FD_SET(con, &cons);
-	if (select(con+1, &cons, NULL, NULL, NULL) && FD_ISSET(con, &cons))
-		recv(con, &req, sizeof(req), 0);
+	if (select(con+1, &cons, NULL, NULL, NULL) && FD_ISSET(con, &cons)) {
+		if (psipe_proxy_recv_all(con, &req, sizeof(req)) < 0)
+			req = PSIPE_REQ_NIL;
+	}
 
 	return req;
 }
 
+/*
+ * An SLN is only recorded here. It is answered by psipe_serve_peer() once
+ * there is somewhere to put the data: an armed receive or a free pool slot.
+ */
 static int psipe_proxy_handle_req(PSIPEDevice *dev, ProxyRequest req)
 {
+	PSIPEProxy *proxy = &dev->proxy;
 	int con = psipe_proxy_endpoint(dev);
 
 	switch(req) {
@@ -110,13 +170,23 @@ static int psipe_proxy_handle_req(PSIPEDevice *dev, ProxyRequest req)
 		qmp_system_reset(NULL); /* see qemu/ui/gtk.c L1313 */
 		break;
 	case PSIPE_REQ_SLN:
-		psipe_proxy_issue_req(dev, PSIPE_REQ_RLN);
-		send(con, &dev->dma.config.len_avail,
-				sizeof(dev->dma.config.len_avail), 0);
+		if (psipe_proxy_recv_all(con, &proxy->sln_len,
+					sizeof(proxy->sln_len)) < 0 ||
+				psipe_proxy_recv_all(con, &proxy->sln_stamp,
+					sizeof(proxy->sln_stamp)) < 0)
+			return PSIPE_FAILURE;
+		trace_psipe_proxy_clock(dev->group.id, proxy->sln_stamp.trace,
+				proxy->sln_stamp.clock, get_clock_realtime());
+		proxy->sln_pending = true;
 		break;
 	case PSIPE_REQ_RLN:
-		recv(con, &dev->dma.config.len_avail,
-				sizeof(dev->dma.config.len_avail), 0);
+		if (psipe_proxy_recv_all(con, &proxy->rln_len,
+					sizeof(proxy->rln_len)) < 0 ||
+				psipe_proxy_recv_all(con, &proxy->rln_stamp,
+					sizeof(proxy->rln_stamp)) < 0)
+			return PSIPE_FAILURE;
+		trace_psipe_proxy_clock(dev->group.id, proxy->rln_stamp.trace,
+				proxy->rln_stamp.clock, get_clock_realtime());
 		break;
 	case PSIPE_REQ_ACK:
 		break;
@@ -124,9 +194,35 @@ static int psipe_proxy_handle_req(PSIPEDevice *dev, ProxyRequest req)
 		return PSIPE_FAILURE;
 	}
 
+	trace_psipe_proxy_req_rx(dev->group.id, req,
+			req == PSIPE_REQ_SLN ? proxy->sln_len :
+			req == PSIPE_REQ_RLN ? proxy->rln_len : 0);
 	return PSIPE_SUCCESS;
 }
 
+/*
+ * Requests arriving while no vCPU is talking to the peer, e.g. an SLN for
+ * which the pool may have room.
+ */
+static void psipe_proxy_read_handler(void *opaque)
+{
+	PSIPEDevice *dev = opaque;
+	int ret, con = psipe_proxy_endpoint(dev);
+	ProxyRequest req;
+
+	ret = recv(con, &req, sizeof(req), MSG_DONTWAIT | MSG_PEEK);
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return; /* consumed by a vCPU in the meantime */
+	if (ret <= 0) {
+		qemu_set_fd_handler(con, NULL, NULL, NULL);
+		return;
+	}
+
+	req = psipe_proxy_wait_req(dev);
+	if (psipe_proxy_handle_req(dev, req) == PSIPE_SUCCESS)
+		psipe_serve_peer(dev);
+}
+
 /* ============================================================================
  * Public
  * ============================================================================
@@ -136,6 +232,7 @@ int psipe_proxy_issue_req(PSIPEDevice *dev, ProxyRequest req)
 {
 	int ret, con = psipe_proxy_endpoint(dev);
 
+	trace_psipe_proxy_req_tx(dev->group.id, req);
 	ret = send(con, &req, sizeof(req), 0);
 	if (ret < 0)
 		return PSIPE_FAILURE;
@@ -148,48 +245,203 @@ int psipe_proxy_wait_and_handle_req(PSIPEDevice *dev)
 	return psipe_proxy_handle_req(dev, psipe_proxy_wait_req(dev));
 }
 
+/*
+ * Both lengths carry a stamp. The trace id of the SLN comes back in the
+ * RLN, and the clocks let the trace of each end be put on the other's.
+ */
+int psipe_proxy_issue_sln(PSIPEDevice *dev, uint64_t len, uint64_t trace)
+{
+	int con = psipe_proxy_endpoint(dev);
+	PSIPEProxyStamp stamp = { .trace = trace };
+
+	if (psipe_proxy_issue_req(dev, PSIPE_REQ_SLN) < 0)
+		return PSIPE_FAILURE;
+	stamp.clock = get_clock_realtime();
+	if (send(con, &len, sizeof(len), 0) < 0 ||
+			send(con, &stamp, sizeof(stamp), 0) < 0)
+		return PSIPE_FAILURE;
+
+	return PSIPE_SUCCESS;
+}
+
+int psipe_proxy_issue_rln(PSIPEDevice *dev, uint64_t len_avail)
+{
+	int con = psipe_proxy_endpoint(dev);
+	PSIPEProxyStamp stamp = { .trace = dev->proxy.sln_stamp.trace };
+
+	if (psipe_proxy_issue_req(dev, PSIPE_REQ_RLN) < 0)
+		return PSIPE_FAILURE;
+	stamp.clock = get_clock_realtime();
+	if (send(con, &len_avail, sizeof(len_avail), 0) < 0 ||
+			send(con, &stamp, sizeof(stamp), 0) < 0)
+		return PSIPE_FAILURE;
+
+	return PSIPE_SUCCESS;
+}
+
+/*
+ * Other requests seen while waiting are handled instead of dropped. When
+ * both ends send at once each one is waiting for the other's RLN, so the
+ * server side takes the peer's data first to break the tie.
+ */
 int psipe_proxy_await_req(PSIPEDevice *dev, ProxyRequest req)
 {
 	ProxyRequest new_req;
 
-	do {
+	for (;;) {
 		new_req = psipe_proxy_wait_req(dev);
-	} while(new_req != PSIPE_FAILURE && new_req != req);
+		if (new_req == req || new_req == PSIPE_REQ_NIL)
+			break;
+		if (psipe_proxy_handle_req(dev, new_req) < 0)
+			return PSIPE_FAILURE;
+		if (dev->proxy.server_mode)
+			psipe_serve_peer(dev);
+	}
 
 	return psipe_proxy_handle_req(dev, new_req);
 }
 
 /*
  * Receive page: buffer <-- socket
+ *
+ * The frame may stand for the page instead of carrying it, see
+ * psipe_proxy_tx_page().
  */
 int psipe_proxy_rx_page(PSIPEDevice *dev, uint8_t *buff)
 {
+	PSIPEProxy *proxy = &dev->proxy;
 	int src = psipe_proxy_endpoint(dev);
-	int len = 0;
+	const uint8_t *page;
+	PSIPEProxyComp comp;
+	PSIPEProxyRef ref;
+	int hdr = 0, len;
 
-	if (recv(src, &len, sizeof(len), 0) < 0 || !len)
+	if (psipe_proxy_recv_all(src, &hdr, sizeof(hdr)) < 0 || hdr <= 0)
 		return PSIPE_FAILURE;
 
-	if (recv(src, buff, len, 0) < 0)
+	len = hdr & PSIPE_PROXY_FRM_LEN;
+	if (!len || len > PSIPE_HW_DMA_AREA_SIZE)
 		return PSIPE_FAILURE;
+	trace_psipe_proxy_rx_page(dev->group.id, hdr, len);
+
+	if (hdr & PSIPE_PROXY_FRM_ZERO) {
+		memset(buff, 0, len);
+		return len;
+	}
+
+	if (hdr & PSIPE_PROXY_FRM_REF) {
+		if (psipe_proxy_recv_all(src, &ref, sizeof(ref)) < 0)
+			return PSIPE_FAILURE;
+		page = psipe_dedup_hit(&proxy->rx_cache, ref.slot, len,
+				ref.crc);
+		if (!page)
+			return PSIPE_FAILURE;
+		memcpy(buff, page, len);
+		return len;
+	}
+
+	if (hdr & PSIPE_PROXY_FRM_COMP) {
+		if (psipe_proxy_recv_all(src, &comp, sizeof(comp)) < 0 ||
+				!comp.len || comp.len > PSIPE_CODEC_BOUND)
+			return PSIPE_FAILURE;
+		if (psipe_proxy_recv_all(src, proxy->zbuf, comp.len) < 0)
+			return PSIPE_FAILURE;
+		if (psipe_codec_decompress(&proxy->codec_ctx, comp.codec,
+					proxy->zbuf, comp.len, buff, len) != len)
+			return PSIPE_FAILURE;
+	} else if (psipe_proxy_recv_all(src, buff, len) < 0) {
+		return PSIPE_FAILURE;
+	}
+
+	if (hdr & PSIPE_PROXY_FRM_KEEP)
+		psipe_dedup_insert(&proxy->rx_cache, buff, len,
+				psipe_dedup_crc(buff, len));
 
 	return len;
 }
 
 /*
  * Transmit page: buffer --> socket
+ *
+ * With dedup on, a page of zeros goes as its length alone, and one the
+ * peer got before as the slot its copy is in. Any other page long enough
+ * is sent whole for both ends to cache, compressed if that was agreed on
+ * and makes it shorter.
  */
 int psipe_proxy_tx_page(PSIPEDevice *dev, uint8_t *buff, int len)
 {
+	PSIPEProxy *proxy = &dev->proxy;
 	int dst = psipe_proxy_endpoint(dev);
+	PSIPEProxyComp comp;
+	PSIPEProxyRef ref;
+	uint32_t crc = 0;
+	int hdr = len, slot = -1, clen = -1;
 
-	if (!len || len <= 0)
+	if (len <= 0 || len > PSIPE_HW_DMA_AREA_SIZE)
 		return PSIPE_FAILURE;
 
-	if (send(dst, &len, sizeof(len), 0) < 0)
+	if (proxy->dedup && buffer_is_zero(buff, len)) {
+		hdr |= PSIPE_PROXY_FRM_ZERO;
+		trace_psipe_proxy_tx_page(dev->group.id, hdr, sizeof(hdr));
+		return send(dst, &hdr, sizeof(hdr), 0) < 0 ?
+			PSIPE_FAILURE : PSIPE_SUCCESS;
+	}
+
+	if (proxy->dedup && len >= PSIPE_DEDUP_MIN) {
+		crc = psipe_dedup_crc(buff, len);
+		slot = psipe_dedup_find(&proxy->tx_cache, buff, len, crc);
+		hdr |= slot < 0 ? PSIPE_PROXY_FRM_KEEP : PSIPE_PROXY_FRM_REF;
+	}
+
+	if (slot < 0 && proxy->tx_codec != PSIPE_CODEC_NONE) {
+		clen = psipe_codec_compress(&proxy->codec_ctx, proxy->tx_codec,
+				buff, len, proxy->zbuf);
+		if (clen > 0)
+			hdr |= PSIPE_PROXY_FRM_COMP;
+	}
+
+	if (send(dst, &hdr, sizeof(hdr), 0) < 0)
 		return PSIPE_FAILURE;
 
-	if (send(dst, buff, len, 0) < 0)
+	if (slot >= 0) {
+		ref.slot = slot;
+		ref.crc = crc;
+		if (send(dst, &ref, sizeof(ref), 0) < 0)
+			return PSIPE_FAILURE;
+		psipe_dedup_hit(&proxy->tx_cache, slot, len, crc);
+		trace_psipe_proxy_tx_page(dev->group.id, hdr,
+				sizeof(hdr) + sizeof(ref));
+		return PSIPE_SUCCESS;
+	}
+
+	if (clen > 0) {
+		comp.codec = proxy->tx_codec;
+		comp.len = clen;
+		if (send(dst, &comp, sizeof(comp), 0) < 0 ||
+				send(dst, proxy->zbuf, clen, 0) < 0)
+			return PSIPE_FAILURE;
+	} else if (send(dst, buff, len, 0) < 0) {
+		return PSIPE_FAILURE;
+	}
+
+	if (hdr & PSIPE_PROXY_FRM_KEEP)
+		psipe_dedup_insert(&proxy->tx_cache, buff, len, crc);
+
+	trace_psipe_proxy_tx_page(dev->group.id, hdr, sizeof(hdr) +
+			(clen > 0 ? sizeof(comp) + clen : len));
+	return PSIPE_SUCCESS;
+}
+
+/*
+ * A zero length frame makes the peer drop a receive it already accepted.
+ */
+int psipe_proxy_tx_abort(PSIPEDevice *dev)
+{
+	int dst = psipe_proxy_endpoint(dev);
+	int len = 0;
+
+	trace_psipe_proxy_tx_abort(dev->group.id);
+	if (send(dst, &len, sizeof(len), 0) < 0)
 		return PSIPE_FAILURE;
 
 	return PSIPE_SUCCESS;
@@ -207,9 +459,52 @@ void psipe_proxy_set_mode(Object *obj, bool mode, Error **errp)
 	dev->proxy.server_mode = mode;
 }
 
+bool psipe_proxy_get_dedup(Object *obj, Error **errp)
+{
+	PSIPEDevice *dev = PSIPE(obj);
+	return dev->proxy.dedup;
+}
+
+void psipe_proxy_set_dedup(Object *obj, bool dedup, Error **errp)
+{
+	PSIPEDevice *dev = PSIPE(obj);
+	dev->proxy.dedup = dedup;
+}
+
+char *psipe_proxy_get_codec(Object *obj, Error **errp)
+{
+	PSIPEDevice *dev = PSIPE(obj);
+	return g_strdup(psipe_codec_name(dev->proxy.codec));
+}
+
+void psipe_proxy_set_codec(Object *obj, const char *name, Error **errp)
+{
+	PSIPEDevice *dev = PSIPE(obj);
+	int codec = psipe_codec_parse(name);
+
+	if (codec < 0) {
+		error_setg(errp, "unknown codec '%s' (none, xor, zstd)", name);
+		return;
+	}
+	if (!(psipe_codec_mask() & BIT(codec))) {
+		error_setg(errp, "codec '%s' not built in", name);
+		return;
+	}
+	dev->proxy.codec = codec;
+}
+
+/*
+ * The dedup caches outlive a reset: the peer does not see it, and would
+ * keep sending references to what this end dropped.
+ */
 void psipe_proxy_reset(PSIPEDevice *dev)
 {
-	return;
+	dev->proxy.sln_pending = false;
+	dev->proxy.sln_len = 0;
+	dev->proxy.rln_len = 0;
+	memset(&dev->proxy.sln_stamp, 0, sizeof(dev->proxy.sln_stamp));
+	memset(&dev->proxy.rln_stamp, 0, sizeof(dev->proxy.rln_stamp));
+	dev->proxy.peer_armed = false;
 }
 
 void psipe_proxy_init(PSIPEDevice *dev, Error **errp)
@@ -217,6 +512,11 @@ void psipe_proxy_init(PSIPEDevice *dev, Error **errp)
 	PSIPEProxy *proxy = &dev->proxy;
 	struct hostent *h;
 
+	psipe_dedup_init(&proxy->tx_cache);
+	psipe_dedup_init(&proxy->rx_cache);
+	psipe_codec_init(&proxy->codec_ctx);
+	proxy->tx_codec = PSIPE_CODEC_NONE;
+
 	h = gethostbyname(PSIPE_PROXY_HOST);
 	if (!h) {
 		herror("gethostbyname");
@@ -242,7 +542,11 @@ void psipe_proxy_init(PSIPEDevice *dev, Error **errp)
 
 void psipe_proxy_fini(PSIPEDevice *dev)
 {
+	qemu_set_fd_handler(psipe_proxy_endpoint(dev), NULL, NULL, NULL);
 	if (dev->proxy.server_mode)
 		close(dev->proxy.client.sockd);
 	close(dev->proxy.server.sockd);
+	psipe_dedup_fini(&dev->proxy.tx_cache);
+	psipe_dedup_fini(&dev->proxy.rx_cache);
+	psipe_codec_fini(&dev->proxy.codec_ctx);
 }
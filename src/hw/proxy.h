@@ -12,6 +12,8 @@
 #include "qemu/osdep.h"
 #include "qemu/typedefs.h"
 #include <sys/socket.h>
+#include "codec.h"
+#include "dedup.h"
 
 #define PSIPE_PROXY_HOST "localhost"
 #define PSIPE_PROXY_PORT 8987
@@ -22,9 +24,16 @@
 #define PSIPE_REQ_ACK 0x1 /* general acknowledge */
 #define PSIPE_REQ_SYN 0x2 /* start syncing page data */
 #define PSIPE_REQ_RST 0x3 /* reset machine */
-#define PSIPE_REQ_SLN 0x4 /* send your available length */
+#define PSIPE_REQ_SLN 0x4 /* send your available length (+ my length) */
 #define PSIPE_REQ_RLN 0x5 /* receive my available length */
 
+/* flags in the length heading a page frame */
+#define PSIPE_PROXY_FRM_ZERO 0x40000000 /* all zeros, nothing follows */
+#define PSIPE_PROXY_FRM_REF 0x20000000 /* PSIPEProxyRef follows */
+#define PSIPE_PROXY_FRM_KEEP 0x10000000 /* data follows, cache it */
+#define PSIPE_PROXY_FRM_COMP 0x08000000 /* PSIPEProxyComp, then its data */
+#define PSIPE_PROXY_FRM_LEN 0x07ffffff
+
 /* Forward declaration */
 typedef struct PSIPEDevice PSIPEDevice;
 
@@ -35,11 +44,42 @@ typedef struct PSIPEProxyConn {
 	struct sockaddr_in addr;
 } PSIPEProxyConn;
 
+/* a page the receiver holds in its dedup slot */
+typedef struct PSIPEProxyRef {
+	uint32_t slot;
+	uint32_t crc;
+} PSIPEProxyRef;
+
+/* after the length of an SLN, and of the RLN answering it */
+typedef struct PSIPEProxyStamp {
+	uint64_t trace; /* of the transfer, see PSIPE_HW_BAR0_DMA_CFG_TRC */
+	int64_t clock; /* realtime ns of the sender as it sent it */
+} PSIPEProxyStamp;
+
+/* a page as compressed by the sender */
+typedef struct PSIPEProxyComp {
+	uint32_t codec;
+	uint32_t len;
+} PSIPEProxyComp;
+
 typedef struct PSIPEProxy {
 	PSIPEProxyConn server;
 	PSIPEProxyConn client;
 	bool server_mode;
 	uint16_t port;
+	bool sln_pending; /* peer wants to send, not answered yet */
+	uint64_t sln_len;
+	uint64_t rln_len; /* what the peer can take, from its last RLN */
+	PSIPEProxyStamp sln_stamp;
+	PSIPEProxyStamp rln_stamp;
+	bool peer_armed; /* peer took our SLN and waits for the pages */
+	bool dedup; /* send references and zero frames */
+	PSIPEDedup tx_cache; /* what the peer holds from us */
+	PSIPEDedup rx_cache; /* what we hold from the peer */
+	int codec; /* what we would like to compress with */
+	int tx_codec; /* what we do, once the peer said it can take it */
+	PSIPECodec codec_ctx;
+	uint8_t zbuf[PSIPE_CODEC_BOUND];
 } PSIPEProxy;
 
 /* ============================================================================
@@ -49,11 +89,18 @@ typedef struct PSIPEProxy {
 
 int psipe_proxy_rx_page(PSIPEDevice *dev, uint8_t *buff);
 int psipe_proxy_tx_page(PSIPEDevice *dev, uint8_t *buff, int len);
+int psipe_proxy_tx_abort(PSIPEDevice *dev);
 
 bool psipe_proxy_get_mode(Object *obj, Error **errp);
 void psipe_proxy_set_mode(Object *obj, bool mode, Error **errp);
+bool psipe_proxy_get_dedup(Object *obj, Error **errp);
+void psipe_proxy_set_dedup(Object *obj, bool dedup, Error **errp);
+char *psipe_proxy_get_codec(Object *obj, Error **errp);
+void psipe_proxy_set_codec(Object *obj, const char *name, Error **errp);
 
 int psipe_proxy_issue_req(PSIPEDevice *dev, ProxyRequest req);
+int psipe_proxy_issue_sln(PSIPEDevice *dev, uint64_t len, uint64_t trace);
+int psipe_proxy_issue_rln(PSIPEDevice *dev, uint64_t len_avail);
 int psipe_proxy_wait_and_handle_req(PSIPEDevice *dev);
 int psipe_proxy_await_req(PSIPEDevice *dev, ProxyRequest req);
 
@@ -10,9 +10,13 @@
 #include "psipe.h"
 #include "psipe_hw.h"
 #include "dma.h"
+#include "group.h"
 #include "irq.h"
 #include "mmio.h"
+#include "pool.h"
 #include "proxy.h"
+#include "stats.h"
+#include "trace.h"
 #include "qom/object.h"
 
 /* ============================================================================
@@ -23,9 +27,14 @@
 static void psipe_device_init(PCIDevice *pci_dev, Error **errp)
 {
 	PSIPEDevice *dev = PSIPE_DEVICE(pci_dev);
+	psipe_group_init(dev, errp);
+	if (dev->group.id < 0)
+		return;
 	psipe_irq_init(dev, errp);
 	psipe_dma_init(dev, errp);
 	psipe_mmio_init(dev, errp);
+	psipe_pool_init(dev, errp);
+	psipe_stats_init(dev, errp);
 	psipe_proxy_init(dev, errp);
 }
 
@@ -35,7 +44,10 @@ static void psipe_device_fini(PCIDevice *pci_dev)
 	psipe_irq_fini(dev);
 	psipe_dma_fini(dev);
 	psipe_mmio_fini(dev);
+	psipe_pool_fini(dev);
 	psipe_proxy_fini(dev);
+	psipe_stats_fini(dev);
+	psipe_group_fini(dev);
 }
 
 static void psipe_device_reset(DeviceState *dev_st)
@@ -44,7 +56,10 @@ static void psipe_device_reset(DeviceState *dev_st)
 	psipe_irq_reset(dev);
 	psipe_dma_reset(dev);
 	psipe_mmio_reset(dev);
+	psipe_pool_reset(dev);
 	psipe_proxy_reset(dev);
+	psipe_stats_reset(dev);
+	psipe_group_reset(dev);
 }
 
 /* ============================================================================
@@ -80,6 +95,14 @@ static void psipe_instance_init(Object *obj)
 	dev->proxy.port = PSIPE_PROXY_PORT;
 	object_property_add_uint16_ptr(obj, "port", &dev->proxy.port,
 				OBJ_PROP_FLAG_READWRITE);
+
+	dev->proxy.dedup = true;
+	object_property_add_bool(obj, "dedup", psipe_proxy_get_dedup,
+				psipe_proxy_set_dedup);
+
+	dev->proxy.codec = PSIPE_CODEC_NONE;
+	object_property_add_str(obj, "compress", psipe_proxy_get_codec,
+				psipe_proxy_set_codec);
 }
 
 /* ============================================================================
@@ -113,19 +136,41 @@ type_init(psipe_register_types)
 
 static void psipe_transfer_pages(PSIPEDevice *dev)
 {
-	int ret, len;
+	PSIPEDevice *targets[PSIPE_HW_GROUP_MAX];
+	int i, n, ret, len;
+	int64_t start, t;
 
 	//printf("(TX) beginning - %lu\n", dev->dma.config.len);
 	if (psipe_dma_begin_run(dev) < 0)
 		return;
 
+	start = psipe_stats_now();
+	trace_psipe_run_start(dev->group.id, "tx", dev->dma.config.len,
+			dev->dma.config.trace);
+	n = psipe_group_targets(dev, targets);
 	do {
-		printf("TX:\t%lu / %lu bytes left\n", dev->dma.current.len_left,
-				dev->dma.config.len);
+		trace_psipe_run_page(dev->group.id, "tx",
+				dev->dma.current.len_left, dev->dma.config.len);
+		t = psipe_stats_now();
 		len = psipe_dma_rx_page(dev);
-		ret = psipe_proxy_tx_page(dev, dev->dma.buff, len);
+		t = psipe_stats_time(dev, PSIPE_HW_STAT_DMA_NS, t);
+		for (i = 0, ret = PSIPE_FAILURE; i < n; ++i) {
+			ret = psipe_proxy_tx_page(targets[i], dev->dma.buff,
+					len);
+			if (ret == PSIPE_FAILURE)
+				break;
+			psipe_stats_add(dev, PSIPE_HW_STAT_TX_BYTES, len);
+			psipe_stats_add(dev, PSIPE_HW_STAT_TX_PAGES, 1);
+		}
+		psipe_stats_time(dev, PSIPE_HW_STAT_NET_NS, t);
 	} while (ret != PSIPE_FAILURE && !psipe_dma_is_finished(dev));
 
+	for (i = 0; i < n; ++i)
+		targets[i]->proxy.peer_armed = false;
+	psipe_stats_run(dev, PSIPE_HW_STAT_TX_RUNS, start);
+	trace_psipe_run_end(dev->group.id, "tx",
+			dev->dma.config.len - dev->dma.current.len_left,
+			dev->dma.config.trace);
 	psipe_dma_end_run(dev);
 	//printf("(TX) finished - %d\n", ret);
 }
@@ -133,41 +178,186 @@ static void psipe_transfer_pages(PSIPEDevice *dev)
 static void psipe_receive_pages(PSIPEDevice *dev)
 {
 	int ret, len;
+	int64_t start, t;
 
 	//printf("(RX) beginning - %lu\n", dev->dma.config.len);
 	if (psipe_dma_begin_run(dev) < 0)
 		return;
 
+	start = psipe_stats_now();
+	trace_psipe_run_start(dev->group.id, "rx", dev->dma.config.len,
+			dev->dma.config.trace);
 	do {
-		printf("RX:\t%lu / %lu bytes left\n", dev->dma.current.len_left,
-				dev->dma.config.len);
+		trace_psipe_run_page(dev->group.id, "rx",
+				dev->dma.current.len_left, dev->dma.config.len);
+		t = psipe_stats_now();
 		len = psipe_proxy_rx_page(dev, dev->dma.buff);
+		t = psipe_stats_time(dev, PSIPE_HW_STAT_NET_NS, t);
 		ret = psipe_dma_tx_page(dev, len);
+		psipe_stats_time(dev, PSIPE_HW_STAT_DMA_NS, t);
+		if (ret != PSIPE_FAILURE) {
+			psipe_stats_add(dev, PSIPE_HW_STAT_RX_BYTES, len);
+			psipe_stats_add(dev, PSIPE_HW_STAT_RX_PAGES, 1);
+		}
 	} while (ret != PSIPE_FAILURE && !psipe_dma_is_finished(dev));
 
+	/* cut short (e.g. a dropped broadcast), report what arrived */
+	dev->dma.config.len -= dev->dma.current.len_left;
+	psipe_stats_run(dev, PSIPE_HW_STAT_RX_RUNS, start);
+	trace_psipe_run_end(dev->group.id, "rx", dev->dma.config.len,
+			dev->dma.config.trace);
 	psipe_dma_end_run(dev);
 	//printf("(RX) finished - %d\n", ret);
 }
 
+/*
+ * Same as receiving, with the pages taken from guest memory. Lets a
+ * reduction consume data the pool took in before the receive was posted.
+ */
+static void psipe_local_pages(PSIPEDevice *dev)
+{
+	int ret, len;
+	int64_t start;
+
+	if (psipe_dma_begin_run(dev) < 0)
+		return;
+
+	start = psipe_stats_now();
+	trace_psipe_run_start(dev->group.id, "local", dev->dma.config.len,
+			dev->dma.config.trace);
+	do {
+		len = psipe_dma_local_page(dev);
+		ret = psipe_dma_tx_page(dev, len);
+	} while (ret != PSIPE_FAILURE && !psipe_dma_is_finished(dev));
+
+	dev->dma.config.len -= dev->dma.current.len_left;
+	psipe_stats_time(dev, PSIPE_HW_STAT_DMA_NS, start);
+	psipe_stats_run(dev, -1, start);
+	trace_psipe_run_end(dev->group.id, "local", dev->dma.config.len,
+			dev->dma.config.trace);
+	psipe_dma_end_run(dev);
+}
+
 /* ============================================================================
  * Public
  * ============================================================================
  */
 
+/*
+ * Handshake for an active run: offer its length to the peer of every target
+ * and return the least they can take. If that falls short the run will not
+ * happen, so targets whose peer already accepted are told to drop it.
+ * A target still in the middle of its own run is not interrupted, that
+ * reads as no room.
+ */
+uint64_t psipe_negotiate(PSIPEDevice *dev)
+{
+	PSIPEDevice *targets[PSIPE_HW_GROUP_MAX];
+	uint64_t len = dev->dma.config.len, avail = UINT64_MAX;
+	int64_t start;
+	int i, n;
+
+	n = psipe_group_targets(dev, targets);
+	for (i = 0; i < n; ++i) {
+		if (targets[i]->proxy.peer_armed)
+			return 0;
+	}
+	if (!n)
+		return 0;
+
+	if (!dev->dma.config.trace)
+		dev->dma.config.trace = (uint64_t)g_random_int() << 32 |
+			g_random_int();
+
+	start = psipe_stats_now();
+	for (i = 0; i < n; ++i)
+		psipe_proxy_issue_sln(targets[i], len, dev->dma.config.trace);
+	for (i = 0; i < n; ++i) {
+		PSIPEProxy *proxy = &targets[i]->proxy;
+
+		if (psipe_proxy_await_req(targets[i], PSIPE_REQ_RLN) < 0)
+			proxy->rln_len = 0;
+		proxy->peer_armed = proxy->rln_len >= len;
+		avail = MIN(avail, proxy->rln_len);
+	}
+	psipe_stats_time(dev, PSIPE_HW_STAT_PEER_NS, start);
+	trace_psipe_negotiate(dev->group.id, len, avail);
+
+	if (avail < len) {
+		psipe_stats_add(dev, PSIPE_HW_STAT_TX_STALLS, 1);
+		for (i = 0; i < n; ++i) {
+			if (targets[i]->proxy.peer_armed)
+				psipe_proxy_tx_abort(targets[i]);
+			targets[i]->proxy.peer_armed = false;
+		}
+	}
+
+	return avail;
+}
+
 void psipe_execute(PSIPEDevice *dev)
 {
-	printf(">>>>>>>>>> START RUN\n");
 	switch(dev->dma.mode) {
 	case DMA_MODE_ACTIVE:
 		psipe_transfer_pages(dev);
+		psipe_irq_raise_cause(dev, PSIPE_HW_IRQ_CAUSE_WORK_ENDED);
 		break;
 	case DMA_MODE_PASSIVE:
-		psipe_proxy_await_req(dev, PSIPE_REQ_SLN);
-		psipe_receive_pages(dev);
+		dev->dma.armed = true;
+		psipe_stats_armed(dev);
 		break;
+	case DMA_MODE_LOCAL:
+		psipe_local_pages(dev);
+		psipe_irq_raise_cause(dev, PSIPE_HW_IRQ_CAUSE_WORK_ENDED);
+		return;
 	default:
 		return;
 	}
-	printf("<<<<<<<<<< END RUN\n");
-	psipe_irq_raise(dev, PSIPE_HW_IRQ_WORK_ENDED_VECTOR);
+	psipe_serve_peer(dev);
+}
+
+/*
+ * Answer a pending SLN from the peer. An armed receive takes the data
+ * directly; otherwise it lands in the next pool slot. With neither available
+ * the peer keeps waiting for its RLN.
+ */
+void psipe_serve_peer(PSIPEDevice *dev)
+{
+	PSIPEProxy *proxy = &dev->proxy;
+	DMAEngine *dma = &dev->dma;
+	dma_size_t len;
+	bool pool;
+
+	if (!proxy->sln_pending || !psipe_dma_is_idle(dev))
+		return;
+
+	pool = psipe_pool_can_take(dev, proxy->sln_len);
+	trace_psipe_serve_peer(dev->group.id, proxy->sln_len, dma->armed, pool);
+	psipe_stats_rx_stall(dev, !dma->armed && !pool);
+	if (dma->armed) {
+		proxy->sln_pending = false;
+		psipe_proxy_issue_rln(dev, dma->config.len_avail);
+		if (proxy->sln_len > dma->config.len_avail)
+			return; /* the peer gives up, stay armed */
+
+		dma->armed = false;
+		dma->config.trace = proxy->sln_stamp.trace;
+		psipe_stats_peer_started(dev);
+		len = dma->config.len;
+		dma->config.len = MIN(len, proxy->sln_len);
+		psipe_receive_pages(dev);
+		if (!dma->config.len) { /* dropped by the sender, wait again */
+			dma->config.len = len;
+			dma->armed = true;
+			psipe_stats_armed(dev);
+			return;
+		}
+		psipe_irq_raise_cause(dev, PSIPE_HW_IRQ_CAUSE_WORK_ENDED);
+	} else if (pool) {
+		proxy->sln_pending = false;
+		psipe_proxy_issue_rln(dev, dev->pool.buf_size);
+		if (psipe_pool_rx(dev, proxy->sln_len) == PSIPE_SUCCESS)
+			psipe_irq_raise_cause(dev,
+					PSIPE_HW_IRQ_CAUSE_POOL_FILLED);
+	}
 }
@@ -15,8 +15,11 @@
 #include "hw/pci/pci_device.h"
 #include "psipe_hw.h"
 #include "dma.h"
+#include "group.h"
 #include "irq.h"
+#include "pool.h"
 #include "proxy.h"
+#include "stats.h"
 
 #define TYPE_PSIPE_DEVICE "psipe"
 #define PSIPE_DEVICE_DESC "Proto-SIPE Device"
@@ -34,9 +37,13 @@ typedef struct PSIPEDeviceClass {
 typedef struct PSIPEDevice {
 	PCIDevice pci_dev;
 	IRQStatus irq;
+	uint32_t irq_cause;
 	DMAEngine dma;
 	MemoryRegion mmio;
+	PSIPEPool pool;
 	PSIPEProxy proxy;
+	PSIPEGroup group;
+	PSIPEStats stats;
 } PSIPEDevice;
 
 
@@ -45,6 +52,8 @@ typedef struct PSIPEDevice {
  * ============================================================================
  */
 
+uint64_t psipe_negotiate(PSIPEDevice *dev);
 void psipe_execute(PSIPEDevice *dev);
+void psipe_serve_peer(PSIPEDevice *dev);
 
 #endif /* PSIPE_H */
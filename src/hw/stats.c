@@ -0,0 +1,101 @@
+/* stats.c - Counters of what the device has been doing
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "psipe.h"
+#include "stats.h"
+
+/* ============================================================================
+ * Public
+ * ============================================================================
+ */
+
+void psipe_stats_add(PSIPEDevice *dev, int stat, uint64_t val)
+{
+	dev->stats.val[stat] += val;
+}
+
+/*
+ * Charge the time from since to stat, and return now to time what follows.
+ */
+int64_t psipe_stats_time(PSIPEDevice *dev, int stat, int64_t since)
+{
+	int64_t now = psipe_stats_now();
+
+	dev->stats.val[stat] += now - since;
+	return now;
+}
+
+/*
+ * A run started at since is over. stat counts it, if it is not -1.
+ */
+void psipe_stats_run(PSIPEDevice *dev, int stat, int64_t since)
+{
+	PSIPEStats *stats = &dev->stats;
+	uint64_t ns = psipe_stats_now() - since;
+
+	if (stat >= 0)
+		++stats->val[stat];
+	if (!stats->val[PSIPE_HW_STAT_RUN_MIN_NS] ||
+			ns < stats->val[PSIPE_HW_STAT_RUN_MIN_NS])
+		stats->val[PSIPE_HW_STAT_RUN_MIN_NS] = ns;
+	if (ns > stats->val[PSIPE_HW_STAT_RUN_MAX_NS])
+		stats->val[PSIPE_HW_STAT_RUN_MAX_NS] = ns;
+}
+
+/*
+ * A passive run waits for the peer from now until psipe_stats_peer_started()
+ */
+void psipe_stats_armed(PSIPEDevice *dev)
+{
+	dev->stats.armed_at = psipe_stats_now();
+}
+
+void psipe_stats_peer_started(PSIPEDevice *dev)
+{
+	PSIPEStats *stats = &dev->stats;
+
+	if (stats->armed_at)
+		psipe_stats_time(dev, PSIPE_HW_STAT_PEER_NS, stats->armed_at);
+	stats->armed_at = 0;
+}
+
+/*
+ * Whether the pending SLN of the peer could not be taken. Counted once per
+ * SLN, however many times it is looked at.
+ */
+void psipe_stats_rx_stall(PSIPEDevice *dev, bool stalled)
+{
+	PSIPEStats *stats = &dev->stats;
+
+	if (stalled && !stats->rx_stalled)
+		++stats->val[PSIPE_HW_STAT_RX_STALLS];
+	stats->rx_stalled = stalled;
+}
+
+uint64_t psipe_stats_read(PSIPEDevice *dev, int stat)
+{
+	if (stat < 0 || stat >= PSIPE_HW_STAT_CNT)
+		return ~0ULL;
+	return dev->stats.val[stat];
+}
+
+void psipe_stats_reset(PSIPEDevice *dev)
+{
+	memset(&dev->stats, 0, sizeof(dev->stats));
+}
+
+void psipe_stats_init(PSIPEDevice *dev, Error **errp)
+{
+	psipe_stats_reset(dev);
+}
+
+void psipe_stats_fini(PSIPEDevice *dev)
+{
+	psipe_stats_reset(dev);
+}
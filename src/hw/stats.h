@@ -0,0 +1,47 @@
+/* stats.h - Counters of what the device has been doing
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#ifndef PSIPE_STATS_H
+#define PSIPE_STATS_H
+
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "psipe_hw.h"
+
+/* forward declaration */
+typedef struct PSIPEDevice PSIPEDevice;
+
+typedef struct PSIPEStats {
+	uint64_t val[PSIPE_HW_STAT_CNT];
+	int64_t armed_at; /* passive run waiting for the peer since */
+	bool rx_stalled; /* pending SLN already counted */
+} PSIPEStats;
+
+static inline int64_t psipe_stats_now(void)
+{
+	return get_clock();
+}
+
+/* ============================================================================
+ * Public
+ * ============================================================================
+ */
+
+void psipe_stats_add(PSIPEDevice *dev, int stat, uint64_t val);
+int64_t psipe_stats_time(PSIPEDevice *dev, int stat, int64_t since);
+void psipe_stats_run(PSIPEDevice *dev, int stat, int64_t since);
+void psipe_stats_armed(PSIPEDevice *dev);
+void psipe_stats_peer_started(PSIPEDevice *dev);
+void psipe_stats_rx_stall(PSIPEDevice *dev, bool stalled);
+uint64_t psipe_stats_read(PSIPEDevice *dev, int stat);
+
+void psipe_stats_reset(PSIPEDevice *dev);
+void psipe_stats_init(PSIPEDevice *dev, Error **errp);
+void psipe_stats_fini(PSIPEDevice *dev);
+
+#endif /* PSIPE_STATS_H */
@@ -0,0 +1 @@
+#include "trace/trace-hw_misc_psipe.h"
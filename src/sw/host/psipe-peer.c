@@ -0,0 +1,852 @@
+/* psipe-peer.c - Stand-in for the machine at the other end of a psipe link
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "psipe_bench.h"
+
+/*
+ * Speaks the proxy protocol of the psipe device (src/hw/proxy.c) to one
+ * QEMU, so a single VM can be run against it. Listens like a device with
+ * server_mode=on, the default of vm.sh being a client, or connects with -c.
+ *
+ * A message is one SLN, the RLN answering it and its page frames. When
+ * both ends send at once the server side takes the other's data first, as
+ * in psipe_proxy_await_req(), and the client answers after. Pages are sent
+ * plain; the negotiation asks for no compression, and the dedup cache of
+ * what the VM sends is kept like a device would.
+ */
+
+// from src/hw/proxy.h, src/hw/dedup.h and include/hw/psipe_hw.h
+#define PEER_REQ_ACK 0x1
+#define PEER_REQ_SLN 0x4
+#define PEER_REQ_RLN 0x5
+
+#define PEER_FRM_ZERO 0x40000000
+#define PEER_FRM_REF 0x20000000
+#define PEER_FRM_KEEP 0x10000000
+#define PEER_FRM_COMP 0x08000000
+#define PEER_FRM_LEN 0x07ffffff
+
+#define PEER_PAGE 0x1000
+#define PEER_DEDUP_SLOTS 256
+
+// the first device of vm.sh
+#define PEER_PORT 9991
+// what psipe_coll cuts transfers in, the VM posts receives of this much
+#define PEER_CHUNK (128 * 1024)
+
+enum peer_mode {
+	PEER_SINK, // take everything
+	PEER_SOURCE, // send -n messages of -s bytes, -g us apart
+	PEER_ECHO, // send back each message
+	PEER_COMPUTE, // -w us per message, then -s bytes back (its size if 0)
+	PEER_BENCH, // chiplet-bench, for master-bench
+};
+
+static const char *peer_modes[] = {
+	[PEER_SINK] = "sink",
+	[PEER_SOURCE] = "source",
+	[PEER_ECHO] = "echo",
+	[PEER_COMPUTE] = "compute",
+	[PEER_BENCH] = "bench",
+};
+
+struct peer_stamp {
+	uint64_t trace;
+	int64_t clock;
+};
+
+struct peer_dedup {
+	uint8_t data[PEER_DEDUP_SLOTS][PEER_PAGE];
+	uint32_t crc[PEER_DEDUP_SLOTS];
+	int len[PEER_DEDUP_SLOTS];
+	uint64_t used[PEER_DEDUP_SLOTS];
+	uint64_t clock;
+};
+
+struct peer_msg {
+	struct peer_msg *next;
+	size_t len;
+	uint8_t data[]; // only if the mode looks at it
+};
+
+struct peer_opts {
+	enum peer_mode mode;
+	bool client;
+	const char *host;
+	int port;
+	double rate; // bytes/s each way, 0 for no limit
+	size_t size;
+	long count;
+	long gap; // us
+	long work; // us
+	long delay; // us before answering an SLN
+	size_t chunk;
+	size_t cap; // most we take in one message
+};
+
+struct peer_dir {
+	uint64_t msgs, bytes;
+	double start; // of the rate limit
+	uint64_t limited; // bytes since start
+};
+
+static struct peer_opts opts;
+static int con = -1;
+static struct peer_dedup rx_cache;
+static uint32_t crc_table[256];
+static struct peer_msg *inbox, **inbox_tail = &inbox;
+static struct peer_dir rx, tx;
+static bool sln_pending;
+static uint64_t sln_len;
+static struct peer_stamp sln_stamp;
+static uint64_t next_trace;
+static double t_begin;
+static volatile sig_atomic_t stop;
+
+static void sigint_handler(int signo)
+{
+	stop = 1;
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int64_t realtime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_us(double us)
+{
+	struct timespec ts;
+
+	if (us <= 0)
+		return;
+	ts.tv_sec = us / 1e6;
+	ts.tv_nsec = (us - ts.tv_sec * 1e6) * 1e3;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR && !stop)
+		;
+}
+
+// 4096, 64K, 1M, 2G
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t v = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'G': case 'g':
+		v <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		v <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		v <<= 10;
+		break;
+	}
+	return v;
+}
+
+static void die(const char *what)
+{
+	if (stop)
+		return;
+	if (errno)
+		perror(what);
+	else
+		fprintf(stderr, "%s: link closed\n", what);
+	stop = 1;
+}
+
+/* ============================================================================
+ * Dedup
+ * ============================================================================
+ */
+
+// CRC32C, as the device checks references with
+static void crc_init(void)
+{
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; ++i) {
+		for (c = i, k = 0; k < 8; ++k)
+			c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t crc32c(const uint8_t *buf, int len)
+{
+	uint32_t crc = 0xffffffff;
+
+	while (len--)
+		crc = crc_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffff;
+}
+
+// psipe_dedup_hit() and psipe_dedup_insert(), slot for slot
+static const uint8_t *dedup_hit(int slot, int len, uint32_t crc)
+{
+	struct peer_dedup *dd = &rx_cache;
+
+	if (slot < 0 || slot >= PEER_DEDUP_SLOTS || dd->len[slot] != len ||
+			dd->crc[slot] != crc)
+		return NULL;
+	dd->used[slot] = ++dd->clock;
+	return dd->data[slot];
+}
+
+static void dedup_insert(const uint8_t *buf, int len)
+{
+	struct peer_dedup *dd = &rx_cache;
+	int i, slot = 0;
+
+	for (i = 1; i < PEER_DEDUP_SLOTS; ++i) {
+		if (dd->used[i] < dd->used[slot])
+			slot = i;
+	}
+	memcpy(dd->data[slot], buf, len);
+	dd->crc[slot] = crc32c(buf, len);
+	dd->len[slot] = len;
+	dd->used[slot] = ++dd->clock;
+}
+
+/* ============================================================================
+ * Protocol
+ * ============================================================================
+ */
+
+static int recv_all(void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = recv(con, buf, len, MSG_WAITALL);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR && !stop)
+				continue;
+			if (!n)
+				errno = 0;
+			return -1;
+		}
+		buf = (char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int send_all(const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = send(con, buf, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR && !stop)
+				continue;
+			return -1;
+		}
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+// keeps a direction under -r, counting this many bytes more
+static void throttle(struct peer_dir *dir, size_t len)
+{
+	double ahead;
+
+	if (!opts.rate)
+		return;
+	if (!dir->limited)
+		dir->start = now_s();
+	dir->limited += len;
+	ahead = dir->start + dir->limited / opts.rate - now_s();
+	sleep_us(ahead * 1e6);
+}
+
+static int send_req(uint32_t req, uint64_t len, uint64_t trace)
+{
+	struct {
+		uint32_t req;
+		uint64_t len;
+		struct peer_stamp stamp;
+	} __attribute__((packed)) msg = { req, len, { trace, realtime_ns() } };
+
+	return send_all(&msg, sizeof(msg));
+}
+
+static int handshake(void)
+{
+	uint32_t ack = PEER_REQ_ACK, req;
+	uint32_t mine[2] = { 0, 1 }, peer[2]; // no codec, and only that taken
+
+	if (!opts.client && send_all(&ack, sizeof(ack)) < 0)
+		return -1;
+	do {
+		if (recv_all(&req, sizeof(req)) < 0)
+			return -1;
+	} while (req != PEER_REQ_ACK);
+	if (opts.client && send_all(&ack, sizeof(ack)) < 0)
+		return -1;
+
+	if (send_all(mine, sizeof(mine)) < 0 || recv_all(peer, sizeof(peer)) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * One page frame into buf, its length, or 0 if the VM dropped the transfer
+ */
+static int rx_page(uint8_t *buf)
+{
+	struct { uint32_t slot, crc; } ref;
+	const uint8_t *page;
+	int hdr, len;
+
+	if (recv_all(&hdr, sizeof(hdr)) < 0)
+		return -1;
+	if (hdr <= 0)
+		return 0;
+
+	len = hdr & PEER_FRM_LEN;
+	if (!len || len > PEER_PAGE || hdr & PEER_FRM_COMP) {
+		fprintf(stderr, "bad frame 0x%x\n", hdr);
+		errno = EPROTO;
+		return -1;
+	}
+
+	if (hdr & PEER_FRM_ZERO) {
+		memset(buf, 0, len);
+	} else if (hdr & PEER_FRM_REF) {
+		if (recv_all(&ref, sizeof(ref)) < 0)
+			return -1;
+		page = dedup_hit(ref.slot, len, ref.crc);
+		if (!page) {
+			fprintf(stderr, "dedup slot %u out of step\n", ref.slot);
+			errno = EPROTO;
+			return -1;
+		}
+		memcpy(buf, page, len);
+	} else {
+		if (recv_all(buf, len) < 0)
+			return -1;
+		if (hdr & PEER_FRM_KEEP)
+			dedup_insert(buf, len);
+	}
+
+	throttle(&rx, len);
+	return len;
+}
+
+static int recv_sln(void)
+{
+	if (recv_all(&sln_len, sizeof(sln_len)) < 0 ||
+			recv_all(&sln_stamp, sizeof(sln_stamp)) < 0)
+		return -1;
+	sln_pending = true;
+	return 0;
+}
+
+/*
+ * Answer the SLN recorded and take its pages. The message goes to the
+ * inbox, with its data only for the modes that look at it.
+ */
+static int serve_sln(void)
+{
+	struct peer_msg *msg;
+	uint8_t page[PEER_PAGE];
+	bool keep = opts.mode != PEER_SINK && opts.mode != PEER_SOURCE;
+	uint64_t len = sln_len, done = 0;
+	int n;
+
+	if (!sln_pending)
+		return 0;
+	sln_pending = false;
+
+	sleep_us(opts.delay);
+	if (send_req(PEER_REQ_RLN, opts.cap, sln_stamp.trace) < 0)
+		return -1;
+	if (len > opts.cap)
+		return 0; // the VM gives up
+
+	msg = malloc(sizeof(*msg) + (keep ? len : 0));
+	if (!msg)
+		return -1;
+	while (done < len) {
+		n = rx_page(keep ? msg->data + done : page);
+		if (n <= 0 || done + n > len) {
+			free(msg);
+			return n < 0 ? -1 : 0;
+		}
+		done += n;
+	}
+
+	msg->len = len;
+	msg->next = NULL;
+	*inbox_tail = msg;
+	inbox_tail = &msg->next;
+	rx.msgs++;
+	rx.bytes += len;
+	return 0;
+}
+
+/*
+ * Requests until an RLN, its length. An SLN of the VM on the way is served
+ * now if we are the server, else left for after our transfer.
+ */
+static int64_t wait_rln(void)
+{
+	struct peer_stamp stamp;
+	uint64_t len;
+	uint32_t req;
+
+	for (;;) {
+		if (recv_all(&req, sizeof(req)) < 0)
+			return -1;
+		switch (req) {
+		case PEER_REQ_SLN:
+			if (recv_sln() < 0)
+				return -1;
+			if (!opts.client && serve_sln() < 0)
+				return -1;
+			break;
+		case PEER_REQ_RLN:
+			if (recv_all(&len, sizeof(len)) < 0 ||
+					recv_all(&stamp, sizeof(stamp)) < 0)
+				return -1;
+			return len;
+		default: // ACK, SYN and RST mean nothing here
+			break;
+		}
+	}
+}
+
+/* ============================================================================
+ * Messages
+ * ============================================================================
+ */
+
+/*
+ * Next message of the VM, NULL if the link is gone. To be freed.
+ */
+static struct peer_msg *peer_recv(void)
+{
+	struct peer_msg *msg;
+	uint32_t req;
+
+	while (!inbox) {
+		if (stop || recv_all(&req, sizeof(req)) < 0)
+			return NULL;
+		if (req == PEER_REQ_SLN && (recv_sln() < 0 || serve_sln() < 0))
+			return NULL;
+	}
+
+	msg = inbox;
+	inbox = msg->next;
+	if (!inbox)
+		inbox_tail = &inbox;
+	return msg;
+}
+
+/*
+ * len bytes of buf (zeros if NULL) in messages of -k bytes at most. An RLN
+ * shorter than the SLN refuses it, and the VM stays armed: the message is
+ * asked again with what it offered, and the rest goes in the next ones.
+ */
+static int peer_send(const uint8_t *buf, size_t len)
+{
+	static const uint8_t zeros[PEER_PAGE];
+	uint8_t frame[sizeof(int) + PEER_PAGE];
+	size_t pos = 0, end, clen, most = opts.chunk;
+	int64_t avail;
+	int hdr;
+
+	while (pos < len && !stop) {
+		clen = len - pos < most ? len - pos : most;
+		if (send_req(PEER_REQ_SLN, clen, next_trace++) < 0)
+			return -1;
+		avail = wait_rln();
+		if (avail < 0)
+			return -1;
+		if ((uint64_t)avail < clen) {
+			if (serve_sln() < 0)
+				return -1;
+			if (avail)
+				most = avail;
+			else
+				sleep_us(1000);
+			continue;
+		}
+		most = opts.chunk;
+
+		for (end = pos + clen; pos < end; pos += hdr) {
+			hdr = end - pos < PEER_PAGE ? end - pos : PEER_PAGE;
+			memcpy(frame, &hdr, sizeof(hdr));
+			memcpy(frame + sizeof(hdr), buf ? buf + pos : zeros, hdr);
+			if (send_all(frame, sizeof(hdr) + hdr) < 0)
+				return -1;
+			throttle(&tx, hdr);
+		}
+		tx.msgs++;
+		tx.bytes += clen;
+		if (serve_sln() < 0)
+			return -1;
+	}
+	return stop ? -1 : 0;
+}
+
+/* ============================================================================
+ * Modes
+ * ============================================================================
+ */
+
+static void run_sink(void)
+{
+	struct peer_msg *msg;
+
+	while ((msg = peer_recv()))
+		free(msg);
+}
+
+static void run_source(void)
+{
+	uint8_t *buf = malloc(opts.size);
+	long i;
+
+	if (!buf) {
+		perror("malloc");
+		return;
+	}
+	memset(buf, 0x5a, opts.size);
+
+	for (i = 0; !opts.count || i < opts.count; ++i) {
+		if (peer_send(buf, opts.size) < 0)
+			break;
+		while (inbox) // nobody reads them
+			free(peer_recv());
+		sleep_us(opts.gap);
+	}
+	free(buf);
+}
+
+// echo is compute with no work and the same size back
+static void run_compute(void)
+{
+	struct peer_msg *msg;
+	uint8_t *out = NULL;
+	size_t len;
+	int rv;
+
+	while ((msg = peer_recv())) {
+		sleep_us(opts.work);
+		len = opts.size ? opts.size : msg->len;
+		if (len <= msg->len) {
+			rv = peer_send(msg->data, len);
+		} else {
+			out = realloc(out, len);
+			if (!out) {
+				free(msg);
+				break;
+			}
+			memcpy(out, msg->data, msg->len);
+			memset(out + msg->len, 0, len - msg->len);
+			rv = peer_send(out, len);
+		}
+		free(msg);
+		if (rv < 0)
+			break;
+	}
+	free(out);
+}
+
+// takes len bytes, whatever the messages
+static int bench_take(uint64_t len)
+{
+	struct peer_msg *msg;
+
+	while (len) {
+		msg = peer_recv();
+		if (!msg)
+			return -1;
+		len -= msg->len < len ? msg->len : len;
+		free(msg);
+	}
+	return 0;
+}
+
+static int bench_ack(void)
+{
+	uint64_t ack = 0;
+
+	return peer_send((uint8_t *)&ack, sizeof(ack));
+}
+
+// as chiplet-bench, the data only counts
+static int bench_one(const struct psipe_bench_cmd *cmd)
+{
+	switch (cmd->test) {
+	case PSIPE_BENCH_BW:
+	case PSIPE_BENCH_MULTI:
+		return bench_take(cmd->len);
+	case PSIPE_BENCH_BIBW:
+		if (peer_send(NULL, cmd->len) < 0)
+			return -1;
+		return bench_take(cmd->len);
+	case PSIPE_BENCH_LAT:
+		if (bench_take(cmd->len) < 0)
+			return -1;
+		return peer_send(NULL, cmd->len);
+	case PSIPE_BENCH_RATE:
+		return bench_take(cmd->len * cmd->window);
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+static void run_bench(void)
+{
+	struct psipe_bench_cmd cmd;
+	struct peer_msg *msg;
+	bool acks;
+	long i;
+
+	opts.chunk = PEER_CHUNK;
+	for (;;) {
+		msg = peer_recv();
+		if (!msg)
+			return;
+		if (msg->len != sizeof(cmd)) {
+			fprintf(stderr, "bench: %zu bytes for a command\n",
+					msg->len);
+			free(msg);
+			return;
+		}
+		memcpy(&cmd, msg->data, sizeof(cmd));
+		free(msg);
+		if (cmd.test == PSIPE_BENCH_END)
+			return;
+		if (!cmd.active)
+			continue;
+
+		acks = cmd.test != PSIPE_BENCH_LAT;
+		for (i = 0; i < cmd.warmup; ++i) {
+			if (bench_one(&cmd) < 0)
+				return;
+		}
+		if (acks && bench_ack() < 0)
+			return;
+		for (i = 0; i < cmd.iters; ++i) {
+			if (bench_one(&cmd) < 0)
+				return;
+		}
+		if (acks && bench_ack() < 0)
+			return;
+	}
+}
+
+/* ============================================================================
+ * Main
+ * ============================================================================
+ */
+
+static int peer_connect(void)
+{
+	struct addrinfo hints = { .ai_family = AF_INET,
+		.ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+	struct addrinfo *ai;
+	char port[16];
+	int fd, one = 1, err;
+
+	snprintf(port, sizeof(port), "%d", opts.port);
+	err = getaddrinfo(opts.host, port, &hints, &ai);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", opts.host, gai_strerror(err));
+		return -1;
+	}
+
+	fd = socket(ai->ai_family, ai->ai_socktype, 0);
+	if (fd < 0)
+		goto err;
+
+	if (opts.client) {
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+			goto err_fd;
+		con = fd;
+	} else {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 ||
+				listen(fd, 1) < 0)
+			goto err_fd;
+		printf("Waiting for the VM on port %d...\n", opts.port);
+		con = accept(fd, NULL, NULL);
+		close(fd);
+		if (con < 0)
+			goto err;
+	}
+	setsockopt(con, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	freeaddrinfo(ai);
+	return 0;
+
+err_fd:
+	close(fd);
+err:
+	perror(opts.client ? "connect" : "listen");
+	freeaddrinfo(ai);
+	return -1;
+}
+
+static void report(void)
+{
+	double secs = now_s() - t_begin;
+
+	printf("%.3f s\n", secs);
+	printf("rx: %lu messages, %lu bytes, %.2f MB/s\n", (unsigned long)rx.msgs,
+			(unsigned long)rx.bytes, rx.bytes / secs / 1e6);
+	printf("tx: %lu messages, %lu bytes, %.2f MB/s\n", (unsigned long)tx.msgs,
+			(unsigned long)tx.bytes, tx.bytes / secs / 1e6);
+}
+
+static void usage(char *prog)
+{
+	printf("Us: %s [-m sink|source|echo|compute|bench] [-c] [-H host]\n"
+			"\t[-p port] [-r MB/s] [-s size] [-n count] [-g gap_us]\n"
+			"\t[-w work_us] [-d delay_us] [-k chunk] [-b max]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sigaction sa;
+	int i, m;
+
+	opts = (struct peer_opts){
+		.mode = PEER_SINK,
+		.host = "localhost",
+		.port = PEER_PORT,
+		.size = 4096,
+		.chunk = PEER_CHUNK,
+		.cap = 1UL << 30,
+	};
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-c")) {
+			opts.client = true;
+		} else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+			++i;
+			for (m = 0; m <= PEER_BENCH; ++m) {
+				if (!strcmp(argv[i], peer_modes[m]))
+					break;
+			}
+			if (m > PEER_BENCH) {
+				fprintf(stderr, "Invalid mode (%s)\n", argv[i]);
+				exit(1);
+			}
+			opts.mode = m;
+		} else if (!strcmp(argv[i], "-H") && i + 1 < argc) {
+			opts.host = argv[++i];
+		} else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+			opts.port = strtol(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+			opts.rate = strtod(argv[++i], NULL) * 1e6;
+		} else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			opts.size = parse_size(argv[++i]);
+		} else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			opts.count = strtol(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-g") && i + 1 < argc) {
+			opts.gap = strtol(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+			opts.work = strtol(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+			opts.delay = strtol(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-k") && i + 1 < argc) {
+			opts.chunk = parse_size(argv[++i]);
+		} else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+			opts.cap = parse_size(argv[++i]);
+		} else {
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (opts.mode == PEER_ECHO) {
+		opts.mode = PEER_COMPUTE;
+		opts.size = 0;
+		opts.work = 0;
+	}
+	if (!opts.chunk || !opts.cap || opts.rate < 0 ||
+			(opts.mode == PEER_SOURCE && !opts.size)) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigint_handler; // no SA_RESTART, to leave recv()
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	crc_init();
+	next_trace = (uint64_t)getpid() << 32 | 1;
+
+	if (peer_connect() < 0)
+		exit(1);
+	if (handshake() < 0) {
+		die("handshake");
+		exit(1);
+	}
+	printf("Connected, %s mode\n", peer_modes[opts.mode]);
+
+	t_begin = now_s();
+	switch (opts.mode) {
+	case PEER_SINK:
+		run_sink();
+		break;
+	case PEER_SOURCE:
+		run_source();
+		break;
+	case PEER_COMPUTE:
+		run_compute();
+		break;
+	case PEER_BENCH:
+		run_bench();
+		break;
+	default:
+		break;
+	}
+	if (!stop && errno)
+		die("psipe-peer");
+	report();
+
+	close(con);
+	while (inbox)
+		free(peer_recv());
+
+	return 0;
+}
@@ -0,0 +1,637 @@
+/* psipe-timeline.c - Merge guest and QEMU traces of psipe into one timeline
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+/*
+ * Each machine gives the ftrace text of its guest (trace_clock set to mono,
+ * psipe events and psipe_clock enabled) and the log of its QEMU (-trace
+ * "psipe_*" with -msg timestamp=on). Everything is put on the host clock
+ * of the first machine given:
+ *
+ * - guest to host, with the psipe_clock pair read in the least time.
+ * - host to host, with the stamps of SLN and RLN. Each end logs how far
+ *   ahead of the peer's clock it got them; the least of each way holds the
+ *   same latency and the opposite offset, so half their difference is it.
+ *   The samples of the first machine are told apart by the trace ids of
+ *   the runs of the others.
+ *
+ * The output is Chrome trace JSON (chrome://tracing, ui.perfetto.dev): a
+ * process per guest and per QEMU, a thread per device, ops split into
+ * queued (async) and on the device, runs, and one flow per trace id
+ * through every step of the transfer on both machines. Guest programs may
+ * add their own slices writing "B|pid|name" and "E|pid" to trace_marker.
+ */
+
+#define TL_MACHINES 16
+#define TL_LINE 1024
+
+struct tl_sample {
+	int64_t peer, local; // ns, on each host
+	uint64_t trace;
+};
+
+struct tl_anchor {
+	uint64_t trace;
+	double ts; // us, on the reference host
+	int pid, tid;
+};
+
+struct tl_machine {
+	const char *name;
+	const char *guest, *host; // files, may be NULL
+	// host clock of the guest's, from the best psipe_clock
+	int64_t g2h;
+	uint64_t g2h_window;
+	bool g2h_set;
+	// this host's clock minus the reference one
+	int64_t delta;
+	struct tl_sample *samples;
+	size_t nsamples;
+	uint64_t *traces; // of the runs here, sorted
+	size_t ntraces;
+};
+
+static struct tl_machine machines[TL_MACHINES];
+static int nmachines;
+
+static struct tl_anchor *anchors;
+static size_t nanchors, anchors_cap;
+
+static FILE *out;
+static bool first_event = true;
+
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p) {
+		perror("realloc");
+		exit(1);
+	}
+	return p;
+}
+
+static struct tl_machine *tl_machine(const char *name)
+{
+	int i;
+
+	for (i = 0; i < nmachines; ++i) {
+		if (!strcmp(machines[i].name, name))
+			return &machines[i];
+	}
+	if (nmachines == TL_MACHINES) {
+		fprintf(stderr, "Too many machines (%d)\n", TL_MACHINES);
+		exit(1);
+	}
+	machines[nmachines].name = name;
+	return &machines[nmachines++];
+}
+
+static const char *tl_mode_names[] = { "recv", "send", "local" };
+
+static inline int tl_guest_pid(struct tl_machine *m)
+{
+	return 2 * (m - machines) + 1;
+}
+
+static inline int tl_host_pid(struct tl_machine *m)
+{
+	return 2 * (m - machines) + 2;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static int cmp_anchor(const void *a, const void *b)
+{
+	const struct tl_anchor *x = a, *y = b;
+
+	if (x->trace != y->trace)
+		return (x->trace > y->trace) - (x->trace < y->trace);
+	return (x->ts > y->ts) - (x->ts < y->ts);
+}
+
+static void tl_anchor(uint64_t trace, double ts, int pid, int tid)
+{
+	if (!trace)
+		return;
+	if (nanchors == anchors_cap) {
+		anchors_cap = anchors_cap ? 2 * anchors_cap : 1024;
+		anchors = xrealloc(anchors, anchors_cap * sizeof(*anchors));
+	}
+	anchors[nanchors++] = (struct tl_anchor){ trace, ts, pid, tid };
+}
+
+/* ============================================================================
+ * Parsing
+ * ============================================================================
+ */
+
+/*
+ * "sec.frac" as ns, whatever the number of digits of frac
+ */
+static int64_t tl_parse_time(const char *s)
+{
+	int64_t sec = 0, frac = 0;
+	int digits = 0;
+
+	while (*s >= '0' && *s <= '9')
+		sec = sec * 10 + *s++ - '0';
+	if (*s == '.') {
+		for (++s; *s >= '0' && *s <= '9'; ++s, ++digits) {
+			if (digits < 9)
+				frac = frac * 10 + *s - '0';
+		}
+	}
+	for (; digits < 9; ++digits)
+		frac *= 10;
+	return sec * 1000000000 + frac;
+}
+
+/*
+ * An ftrace line: "task-pid [cpu] flags time: event: args". Returns the
+ * event name (up to the colon) and sets time and args, or NULL.
+ */
+static char *tl_parse_ftrace(char *line, int64_t *time, char **args)
+{
+	char *ev, *colon, *p;
+
+	ev = strstr(line, ": psipe_");
+	if (!ev)
+		ev = strstr(line, ": tracing_mark_write: ");
+	if (!ev)
+		return NULL;
+
+	for (p = ev; p > line && p[-1] != ' '; --p)
+		;
+	*time = tl_parse_time(p);
+
+	ev += 2;
+	colon = strchr(ev, ':');
+	if (!colon)
+		return NULL;
+	*colon = '\0';
+	*args = colon + 1;
+	return ev;
+}
+
+/*
+ * A QEMU log line: "pid@sec.usec:event args"
+ */
+static char *tl_parse_qemu(char *line, int64_t *time, char **args)
+{
+	char *at, *colon, *space;
+
+	at = strchr(line, '@');
+	colon = at ? strchr(at, ':') : NULL;
+	if (!colon || strncmp(colon, ":psipe_", 7))
+		return NULL;
+	*time = tl_parse_time(at + 1);
+
+	space = strchr(colon, ' ');
+	if (!space)
+		return NULL;
+	*space = '\0';
+	*args = space + 1;
+	return colon + 1;
+}
+
+static FILE *tl_open(const char *path)
+{
+	FILE *f = fopen(path, "r");
+
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	return f;
+}
+
+/* ============================================================================
+ * Clocks
+ * ============================================================================
+ */
+
+static void tl_scan_guest(struct tl_machine *m)
+{
+	char line[TL_LINE], *ev, *args;
+	uint64_t guest, host, window;
+	unsigned int dev;
+	int64_t time;
+	FILE *f;
+
+	if (!m->guest)
+		return;
+
+	f = tl_open(m->guest);
+	while (fgets(line, sizeof(line), f)) {
+		ev = tl_parse_ftrace(line, &time, &args);
+		if (!ev || strcmp(ev, "psipe_clock"))
+			continue;
+		if (sscanf(args, " dev=%u guest=%" SCNu64 " host=%" SCNu64
+					" window=%" SCNu64, &dev, &guest, &host,
+					&window) != 4)
+			continue;
+		if (!m->g2h_set || window < m->g2h_window) {
+			m->g2h = host - guest;
+			m->g2h_window = window;
+			m->g2h_set = true;
+		}
+	}
+	fclose(f);
+
+	if (!m->g2h_set)
+		fprintf(stderr, "%s: no psipe_clock events, the guest is not "
+				"aligned\n", m->name);
+}
+
+static void tl_scan_host(struct tl_machine *m)
+{
+	char line[TL_LINE], *ev, *args, kind[16];
+	struct tl_sample s;
+	uint64_t len, trace;
+	int64_t time;
+	int dev, slot;
+	size_t cap = 0, tcap = 0;
+	FILE *f;
+
+	if (!m->host)
+		return;
+
+	f = tl_open(m->host);
+	while (fgets(line, sizeof(line), f)) {
+		ev = tl_parse_qemu(line, &time, &args);
+		if (!ev)
+			continue;
+
+		trace = 0;
+		if (!strcmp(ev, "psipe_proxy_clock")) {
+			if (sscanf(args, "dev %d trace 0x%" SCNx64 " peer %" SCNd64
+						" local %" SCNd64, &dev, &s.trace,
+						&s.peer, &s.local) != 4)
+				continue;
+			if (m->nsamples == cap) {
+				cap = cap ? 2 * cap : 256;
+				m->samples = xrealloc(m->samples,
+						cap * sizeof(*m->samples));
+			}
+			m->samples[m->nsamples++] = s;
+		} else if (!strcmp(ev, "psipe_run_start")) {
+			sscanf(args, "dev %d %15s run of %" SCNu64 " bytes trace 0x%"
+					SCNx64, &dev, kind, &len, &trace);
+		} else if (!strcmp(ev, "psipe_pool_rx")) {
+			sscanf(args, "dev %d slot %d took %" SCNu64 " bytes trace 0x%"
+					SCNx64, &dev, &slot, &len, &trace);
+		}
+
+		if (!trace)
+			continue;
+		if (m->ntraces == tcap) {
+			tcap = tcap ? 2 * tcap : 256;
+			m->traces = xrealloc(m->traces, tcap * sizeof(*m->traces));
+		}
+		m->traces[m->ntraces++] = trace;
+	}
+	fclose(f);
+
+	qsort(m->traces, m->ntraces, sizeof(*m->traces), cmp_u64);
+}
+
+static bool tl_has_trace(struct tl_machine *m, uint64_t trace)
+{
+	return bsearch(&trace, m->traces, m->ntraces, sizeof(trace), cmp_u64);
+}
+
+/*
+ * Least local - peer over the samples of a that b took part in
+ */
+static bool tl_min_lag(struct tl_machine *a, struct tl_machine *b,
+		int64_t *lag)
+{
+	bool found = false;
+	size_t i;
+
+	for (i = 0; i < a->nsamples; ++i) {
+		if (nmachines > 2 && !tl_has_trace(b, a->samples[i].trace))
+			continue;
+		if (!found || a->samples[i].local - a->samples[i].peer < *lag)
+			*lag = a->samples[i].local - a->samples[i].peer;
+		found = true;
+	}
+	return found;
+}
+
+static void tl_align_hosts(void)
+{
+	struct tl_machine *ref = &machines[0], *m;
+	int64_t lag_ref, lag_m;
+	bool has_ref, has_m;
+	int i;
+
+	for (i = 1; i < nmachines; ++i) {
+		m = &machines[i];
+		has_ref = tl_min_lag(ref, m, &lag_ref);
+		has_m = tl_min_lag(m, ref, &lag_m);
+
+		/* lag_m = latency + delta, lag_ref = latency - delta */
+		if (has_ref && has_m)
+			m->delta = (lag_m - lag_ref) / 2;
+		else if (has_m)
+			m->delta = lag_m;
+		else if (has_ref)
+			m->delta = -lag_ref;
+		else
+			fprintf(stderr, "%s: no psipe_proxy_clock events with %s, "
+					"the host is not aligned\n", m->name,
+					ref->name);
+	}
+}
+
+/* ============================================================================
+ * Output
+ * ============================================================================
+ */
+
+static void tl_event(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void tl_event(const char *fmt, ...)
+{
+	va_list ap;
+
+	fputs(first_event ? "\n" : ",\n", out);
+	first_event = false;
+	va_start(ap, fmt);
+	vfprintf(out, fmt, ap);
+	va_end(ap);
+}
+
+static void tl_names(struct tl_machine *m)
+{
+	tl_event("{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+			"\"args\":{\"name\":\"%s guest\"}}", tl_guest_pid(m),
+			m->name);
+	tl_event("{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+			"\"args\":{\"name\":\"%s qemu\"}}", tl_host_pid(m), m->name);
+}
+
+/* ns on a host to us on the reference one */
+static inline double tl_ts(struct tl_machine *m, int64_t host)
+{
+	return (host - m->delta) / 1000.0;
+}
+
+static void tl_emit_guest(struct tl_machine *m)
+{
+	char line[TL_LINE], *ev, *args, name[128], mark;
+	unsigned int dev;
+	unsigned long id, len;
+	long retval;
+	uint64_t trace;
+	int64_t time;
+	int mode, pid = tl_guest_pid(m), tpid;
+	double ts;
+	FILE *f;
+
+	if (!m->guest)
+		return;
+
+	f = tl_open(m->guest);
+	while (fgets(line, sizeof(line), f)) {
+		ev = tl_parse_ftrace(line, &time, &args);
+		if (!ev)
+			continue;
+		ts = tl_ts(m, time + m->g2h);
+
+		if (!strcmp(ev, "tracing_mark_write")) {
+			name[0] = '\0';
+			if (sscanf(args, " %c|%d|%127[^\n]", &mark, &tpid,
+						name) < 2 || (mark != 'B' &&
+							mark != 'E'))
+				continue;
+			for (char *c = name; *c; ++c) {
+				if (*c == '"' || *c == '\\' || *c < ' ')
+					*c = '_';
+			}
+			tl_event("{\"ph\":\"%c\",\"name\":\"%s\",\"pid\":%d,"
+					"\"tid\":%d,\"ts\":%.3f}", mark, name, pid,
+					tpid, ts);
+			continue;
+		}
+
+		if (strncmp(ev, "psipe_op_", 9) || sscanf(args, " dev=%u id=%lu "
+					"len=%lu retval=%ld mode=%d trace=0x%" SCNx64,
+					&dev, &id, &len, &retval, &mode,
+					&trace) != 6)
+			continue;
+		ev += 9;
+
+		if (!strcmp(ev, "submit")) {
+			tl_event("{\"ph\":\"b\",\"cat\":\"psipe\",\"name\":\"queued\","
+					"\"id\":\"%d.%u.%lu\",\"pid\":%d,\"tid\":%u,"
+					"\"ts\":%.3f,\"args\":{\"len\":%lu}}",
+					pid, dev, id, pid, dev, ts, len);
+		} else if (!strcmp(ev, "start")) {
+			tl_event("{\"ph\":\"e\",\"cat\":\"psipe\",\"name\":\"queued\","
+					"\"id\":\"%d.%u.%lu\",\"pid\":%d,\"tid\":%u,"
+					"\"ts\":%.3f}", pid, dev, id, pid, dev, ts);
+			tl_event("{\"ph\":\"B\",\"name\":\"%s\",\"pid\":%d,"
+					"\"tid\":%u,\"ts\":%.3f,\"args\":{\"id\":%lu,"
+					"\"len\":%lu}}", mode >= 0 && mode < 3 ?
+					tl_mode_names[mode] : "op",
+					pid, dev, ts, id, len);
+			if (mode == 1)
+				tl_anchor(trace, ts, pid, dev);
+		} else if (!strcmp(ev, "irq")) {
+			tl_event("{\"ph\":\"E\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,"
+					"\"args\":{\"retval\":%ld,\"trace\":"
+					"\"0x%" PRIx64 "\"}}", pid, dev, ts, retval,
+					trace);
+			/* inside the slice, it ends here; a fold is local */
+			if (mode == 0 || mode == 2)
+				tl_anchor(trace, ts - 0.001, pid, dev);
+		} else if (!strcmp(ev, "complete") && mode == -1) {
+			/* served by the driver alone, e.g. from the pool */
+			tl_event("{\"ph\":\"e\",\"cat\":\"psipe\",\"name\":\"queued\","
+					"\"id\":\"%d.%u.%lu\",\"pid\":%d,\"tid\":%u,"
+					"\"ts\":%.3f}", pid, dev, id, pid, dev, ts);
+			tl_event("{\"ph\":\"X\",\"name\":\"recv (pool)\",\"pid\":%d,"
+					"\"tid\":%u,\"ts\":%.3f,\"dur\":0.002,"
+					"\"args\":{\"id\":%lu,\"retval\":%ld,\"trace\":"
+					"\"0x%" PRIx64 "\"}}", pid, dev, ts, id, retval,
+					trace);
+			tl_anchor(trace, ts + 0.001, pid, dev);
+		} else if (!strcmp(ev, "wake") || !strcmp(ev, "flush")) {
+			tl_event("{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\","
+					"\"pid\":%d,\"tid\":%u,\"ts\":%.3f,"
+					"\"args\":{\"id\":%lu}}", ev, pid, dev, ts, id);
+		}
+	}
+	fclose(f);
+}
+
+static void tl_emit_host(struct tl_machine *m)
+{
+	char line[TL_LINE], *ev, *args, kind[16];
+	uint64_t len, trace;
+	int64_t time;
+	int dev, slot, pid = tl_host_pid(m);
+	double ts;
+	FILE *f;
+
+	if (!m->host)
+		return;
+
+	f = tl_open(m->host);
+	while (fgets(line, sizeof(line), f)) {
+		ev = tl_parse_qemu(line, &time, &args);
+		if (!ev)
+			continue;
+		ts = tl_ts(m, time);
+
+		if (!strcmp(ev, "psipe_run_start")) {
+			if (sscanf(args, "dev %d %15s run of %" SCNu64
+						" bytes trace 0x%" SCNx64, &dev,
+						kind, &len, &trace) != 4)
+				continue;
+			tl_event("{\"ph\":\"B\",\"name\":\"%s run\",\"pid\":%d,"
+					"\"tid\":%d,\"ts\":%.3f,\"args\":{\"len\":%"
+					PRIu64 ",\"trace\":\"0x%" PRIx64 "\"}}", kind,
+					pid, dev, ts, len, trace);
+			tl_anchor(trace, ts, pid, dev);
+		} else if (!strcmp(ev, "psipe_run_end")) {
+			if (sscanf(args, "dev %d", &dev) != 1)
+				continue;
+			tl_event("{\"ph\":\"E\",\"pid\":%d,\"tid\":%d,"
+					"\"ts\":%.3f}", pid, dev, ts);
+		} else if (!strcmp(ev, "psipe_pool_rx")) {
+			if (sscanf(args, "dev %d slot %d took %" SCNu64
+						" bytes trace 0x%" SCNx64, &dev,
+						&slot, &len, &trace) != 4)
+				continue;
+			tl_event("{\"ph\":\"i\",\"s\":\"t\",\"name\":\"pool rx\","
+					"\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"
+					"\"args\":{\"slot\":%d,\"len\":%" PRIu64 "}}",
+					pid, dev, ts, slot, len);
+			tl_anchor(trace, ts, pid, dev);
+		}
+	}
+	fclose(f);
+}
+
+/*
+ * One flow per trace id, through its anchors in time order
+ */
+static void tl_emit_flows(void)
+{
+	size_t i, j, k;
+	char ph;
+
+	qsort(anchors, nanchors, sizeof(*anchors), cmp_anchor);
+
+	for (i = 0; i < nanchors; i = j) {
+		for (j = i + 1; j < nanchors && anchors[j].trace ==
+				anchors[i].trace; ++j)
+			;
+		if (j - i < 2)
+			continue;
+		for (k = i; k < j; ++k) {
+			ph = k == i ? 's' : k == j - 1 ? 'f' : 't';
+			tl_event("{\"ph\":\"%c\",\"cat\":\"psipe\",\"name\":"
+					"\"transfer\",\"id\":\"0x%" PRIx64 "\","
+					"\"pid\":%d,\"tid\":%d,\"ts\":%.3f%s}", ph,
+					anchors[k].trace, anchors[k].pid,
+					anchors[k].tid, anchors[k].ts,
+					ph == 'f' ? ",\"bp\":\"e\"" : "");
+		}
+	}
+}
+
+/* ============================================================================
+ * Main
+ * ============================================================================
+ */
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-o out.json] {-g name=guest.txt | -q name=qemu.log}...\n"
+		"  -g  ftrace text of a guest (trace_clock mono)\n"
+		"  -q  QEMU log with -msg timestamp=on\n"
+		"  The first machine named is the reference clock.\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct tl_machine *m;
+	char *eq;
+	int i;
+
+	out = stdout;
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+			out = fopen(argv[++i], "w");
+			if (!out) {
+				perror(argv[i]);
+				exit(1);
+			}
+		} else if ((!strcmp(argv[i], "-g") || !strcmp(argv[i], "-q")) &&
+				i + 1 < argc && (eq = strchr(argv[i + 1], '='))) {
+			*eq = '\0';
+			m = tl_machine(argv[i + 1]);
+			if (argv[i][1] == 'g')
+				m->guest = eq + 1;
+			else
+				m->host = eq + 1;
+			++i;
+		} else {
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (!nmachines) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	for (i = 0; i < nmachines; ++i) {
+		tl_scan_guest(&machines[i]);
+		tl_scan_host(&machines[i]);
+	}
+	tl_align_hosts();
+
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", out);
+	for (i = 0; i < nmachines; ++i) {
+		tl_names(&machines[i]);
+		tl_emit_guest(&machines[i]);
+		tl_emit_host(&machines[i]);
+	}
+	tl_emit_flows();
+	fputs("\n]}\n", out);
+
+	for (i = 0; i < nmachines; ++i) {
+		fprintf(stderr, "%s: guest %+" PRId64 " ns, host %+" PRId64
+				" ns\n", machines[i].name, machines[i].g2h,
+				-machines[i].delta);
+		free(machines[i].samples);
+		free(machines[i].traces);
+	}
+	free(anchors);
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
@@ -0,0 +1,126 @@
+/* psipe_buf.c - psipe driver-allocated DMA buffers
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#include "psipe_module.h"
+#include <linux/dma-mapping.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+
+/*
+ * Freeing coherent memory may sleep, and the last reference can be dropped
+ * from the irq handler when an op ends.
+ */
+static void psipe_buf_free_work(struct work_struct *work)
+{
+	struct psipe_buf *buf = container_of(work, struct psipe_buf, free_work);
+
+	dma_free_coherent(&buf->psipe_dev->pdev->dev, buf->size, buf->cpu,
+			buf->dma);
+	kfree(buf);
+}
+
+static void psipe_buf_release(struct kref *ref)
+{
+	struct psipe_buf *buf = container_of(ref, struct psipe_buf, ref);
+
+	schedule_work(&buf->free_work);
+}
+
+static void psipe_buf_vm_close(struct vm_area_struct *vma)
+{
+	psipe_buf_put(vma->vm_private_data);
+}
+
+static int psipe_buf_vm_may_split(struct vm_area_struct *vma,
+		unsigned long addr)
+{
+	return -EINVAL;
+}
+
+static const struct vm_operations_struct psipe_buf_vm_ops = {
+	.close = psipe_buf_vm_close,
+	.may_split = psipe_buf_vm_may_split,
+};
+
+/*
+ * Every mmap() of the device allocates a physically contiguous buffer of the
+ * mapping's size. It lives as long as the mapping and any op that uses it.
+ */
+int psipe_buf_mmap(struct psipe_dev *psipe_dev, struct vm_area_struct *vma)
+{
+	struct psipe_buf *buf;
+	size_t size = vma->vm_end - vma->vm_start;
+	int rv;
+
+	if (vma->vm_pgoff)
+		return -EINVAL;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	buf->cpu = dma_alloc_coherent(&psipe_dev->pdev->dev, size, &buf->dma,
+			GFP_KERNEL);
+	if (!buf->cpu) {
+		kfree(buf);
+		return -ENOMEM;
+	}
+
+	buf->psipe_dev = psipe_dev;
+	buf->size = size;
+	kref_init(&buf->ref);
+	INIT_WORK(&buf->free_work, psipe_buf_free_work);
+
+	rv = dma_mmap_coherent(&psipe_dev->pdev->dev, vma, buf->cpu, buf->dma,
+			size);
+	if (rv < 0) {
+		dma_free_coherent(&psipe_dev->pdev->dev, size, buf->cpu,
+				buf->dma);
+		kfree(buf);
+		return rv;
+	}
+
+	vm_flags_set(vma, VM_DONTCOPY | VM_DONTEXPAND | VM_DONTDUMP);
+	vma->vm_ops = &psipe_buf_vm_ops;
+	vma->vm_private_data = buf;
+
+	return 0;
+}
+
+/*
+ * Find the buffer mapped at uaddr (the address mmap() returned) and take a
+ * reference on it.
+ */
+struct psipe_buf *psipe_buf_get(struct psipe_dev *psipe_dev,
+		unsigned long uaddr)
+{
+	struct vm_area_struct *vma;
+	struct psipe_buf *buf = NULL;
+
+	mmap_read_lock(current->mm);
+	vma = vma_lookup(current->mm, uaddr);
+	if (!vma || vma->vm_ops != &psipe_buf_vm_ops ||
+			vma->vm_start != uaddr)
+		goto unlock;
+
+	buf = vma->vm_private_data;
+	if (buf->psipe_dev != psipe_dev) {
+		buf = NULL;
+		goto unlock;
+	}
+	kref_get(&buf->ref);
+
+unlock:
+	mmap_read_unlock(current->mm);
+	return buf;
+}
+
+void psipe_buf_put(struct psipe_buf *buf)
+{
+	kref_put(&buf->ref, psipe_buf_release);
+}
@@ -0,0 +1,117 @@
+/* psipe_debugfs.c - Latency histograms of the ops queue in debugfs
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#include "psipe_module.h"
+#include <linux/debugfs.h>
+#include <linux/log2.h>
+#include <linux/seq_file.h>
+
+/*
+ * psipe/<device>/latency holds one histogram for each step of an op, with
+ * buckets by powers of two of nanoseconds. Writing to it zeroes them.
+ */
+
+static struct dentry *psipe_debugfs_root;
+
+static const char *psipe_lat_names[PSIPE_LAT_NUM] = {
+	[PSIPE_LAT_QUEUE] = "submit_to_start",
+	[PSIPE_LAT_DEVICE] = "start_to_irq",
+	[PSIPE_LAT_WAKE] = "irq_to_waiter",
+};
+
+void psipe_lat_add(struct psipe_dev *psipe_dev, enum psipe_lat_kind kind,
+		u64 from, u64 to)
+{
+	unsigned int b;
+
+	if (!from || to < from)
+		return;
+
+	b = to - from ? ilog2(to - from) : 0;
+	if (b >= PSIPE_LAT_BUCKETS)
+		b = PSIPE_LAT_BUCKETS - 1;
+	atomic64_inc(&psipe_dev->lat.hist[kind][b]);
+}
+
+static int psipe_lat_show(struct seq_file *m, void *v)
+{
+	struct psipe_dev *psipe_dev = m->private;
+	atomic64_t *hist;
+	s64 n;
+	int k, b;
+
+	for (k = 0; k < PSIPE_LAT_NUM; ++k) {
+		hist = psipe_dev->lat.hist[k];
+		seq_printf(m, "%s\n", psipe_lat_names[k]);
+		for (b = 0; b < PSIPE_LAT_BUCKETS; ++b) {
+			n = atomic64_read(&hist[b]);
+			if (!n)
+				continue;
+			if (b == PSIPE_LAT_BUCKETS - 1)
+				seq_printf(m, "  [%12llu, ...) ns %lld\n",
+						1ULL << b, n);
+			else
+				seq_printf(m, "  [%12llu, %12llu) ns %lld\n",
+						b ? 1ULL << b : 0, 1ULL << (b + 1), n);
+		}
+	}
+
+	return 0;
+}
+
+static int psipe_lat_open(struct inode *inode, struct file *fp)
+{
+	return single_open(fp, psipe_lat_show, inode->i_private);
+}
+
+static ssize_t psipe_lat_write(struct file *fp, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct psipe_dev *psipe_dev = file_inode(fp)->i_private;
+	int k, b;
+
+	for (k = 0; k < PSIPE_LAT_NUM; ++k) {
+		for (b = 0; b < PSIPE_LAT_BUCKETS; ++b)
+			atomic64_set(&psipe_dev->lat.hist[k][b], 0);
+	}
+
+	return count;
+}
+
+static const struct file_operations psipe_lat_fops = {
+	.owner = THIS_MODULE,
+	.open = psipe_lat_open,
+	.read = seq_read,
+	.write = psipe_lat_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void psipe_debugfs_init(struct psipe_dev *psipe_dev, const char *name)
+{
+	psipe_dev->debugfs = debugfs_create_dir(name, psipe_debugfs_root);
+	debugfs_create_file("latency", 0644, psipe_dev->debugfs, psipe_dev,
+			&psipe_lat_fops);
+}
+
+void psipe_debugfs_fini(struct psipe_dev *psipe_dev)
+{
+	debugfs_remove_recursive(psipe_dev->debugfs);
+	psipe_dev->debugfs = NULL;
+}
+
+void psipe_debugfs_create_root(void)
+{
+	psipe_debugfs_root = debugfs_create_dir("psipe", NULL);
+}
+
+void psipe_debugfs_remove_root(void)
+{
+	debugfs_remove_recursive(psipe_debugfs_root);
+	psipe_debugfs_root = NULL;
+}
@@ -10,6 +10,8 @@
 #include "hw/psipe_hw.h"
 #include "psipe_module.h"
 #include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/uio.h>
 
 int psipe_dma_pin_pages(struct psipe_dma *dma)
 {
@@ -82,20 +84,194 @@ free_pages:
 	return rv;
 }
 
+/*
+ * Take the pages behind a read/write iterator, up to what the device can
+ * address. For user memory that is the first segment only, the caller
+ * reports the short count. Kernel pages (splice, bvecs) are not pinned.
+ */
+int psipe_dma_extract_pages(struct psipe_dma *dma, struct iov_iter *iter)
+{
+	size_t ofs;
+	ssize_t len;
+	int rv;
+
+	dma->pages = NULL;
+	dma->pinned = iov_iter_extract_will_pin(iter);
+	len = iov_iter_extract_pages(iter, &dma->pages, iov_iter_count(iter),
+			PSIPE_HW_BAR0_DMA_HANDLES_CNT, 0, &ofs);
+	if (len <= 0)
+		return len ? (int)len : -EFAULT;
+
+	dma->addr = ofs;
+	dma->len = len;
+	dma->npages = DIV_ROUND_UP(ofs + len, PAGE_SIZE);
+
+	rv = sg_alloc_table_from_pages_segment(&dma->sgt, dma->pages,
+			dma->npages, ofs, len, PAGE_SIZE, GFP_KERNEL);
+	if (rv < 0)
+		goto unpin_pages;
+
+	return 0;
+
+unpin_pages:
+	if (dma->pinned)
+		unpin_user_pages(dma->pages, dma->npages);
+	kvfree(dma->pages);
+	iov_iter_revert(iter, len);
+	return rv;
+}
+
+int psipe_dma_acquire(struct psipe_dma *dma)
+{
+	switch (dma->kind) {
+	case PSIPE_DMA_USER:
+		return psipe_dma_pin_pages(dma);
+	case PSIPE_DMA_BUF:
+	case PSIPE_DMA_DMABUF:
+	case PSIPE_DMA_ITER:
+		return 0; /* referenced when the op was created */
+	}
+	return -EINVAL;
+}
+
+void psipe_dma_release(struct psipe_dma *dma)
+{
+	switch (dma->kind) {
+	case PSIPE_DMA_USER:
+		psipe_dma_unpin_pages(dma);
+		break;
+	case PSIPE_DMA_BUF:
+		psipe_buf_put(dma->buf);
+		dma->buf = NULL;
+		break;
+	case PSIPE_DMA_DMABUF:
+		psipe_dmabuf_put(dma->dmabuf);
+		dma->dmabuf = NULL;
+		break;
+	case PSIPE_DMA_ITER:
+		sg_free_table(&dma->sgt);
+		if (dma->pinned)
+			unpin_user_pages(dma->pages, dma->npages);
+		kvfree(dma->pages);
+		break;
+	}
+}
+
+/*
+ * CPU copy into the op's memory, for data that did not come through the
+ * device (e.g. the receive pool).
+ */
+int psipe_dma_copy_in(struct psipe_dma *dma, const void *src, size_t len)
+{
+	switch (dma->kind) {
+	case PSIPE_DMA_USER:
+	case PSIPE_DMA_ITER:
+		if (sg_copy_from_buffer(dma->sgt.sgl, dma->sgt.orig_nents,
+					src, len) != len)
+			return -EFAULT;
+		return 0;
+	case PSIPE_DMA_BUF:
+		memcpy(dma->buf->cpu + dma->addr, src, len);
+		return 0;
+	case PSIPE_DMA_DMABUF:
+		if (iosys_map_is_null(&dma->dmabuf->vaddr))
+			return -EOPNOTSUPP;
+		memcpy(dma->dmabuf->vaddr.vaddr + dma->addr, src, len);
+		return 0;
+	}
+	return -EINVAL;
+}
+
+/*
+ * The device takes one handle per page it touches and reads each up to the
+ * end of its page. Emit those for [ofs, ofs + len) of an already mapped
+ * table, to out when given. Fails if a segment ends inside a page before the
+ * range does.
+ */
+long psipe_dma_sg_handles(struct sg_table *sgt, unsigned long ofs,
+		unsigned long len, void __iomem *out)
+{
+	struct scatterlist *sg;
+	dma_addr_t cur, end;
+	unsigned long seg, n = 0;
+	int i;
+
+	for_each_sgtable_dma_sg(sgt, sg, i) {
+		if (!len)
+			break;
+		seg = sg_dma_len(sg);
+		if (ofs >= seg) {
+			ofs -= seg;
+			continue;
+		}
+
+		cur = sg_dma_address(sg) + ofs;
+		seg -= ofs;
+		ofs = 0;
+		if (seg >= len)
+			seg = len;
+		else if ((cur + seg) & ~PAGE_MASK)
+			return -EINVAL;
+
+		for (end = cur + seg; cur < end; n++) {
+			if (n >= PSIPE_HW_BAR0_DMA_HANDLES_CNT)
+				return -EMSGSIZE;
+			if (out)
+				iowrite32((u32)cur, out + n * sizeof(u32));
+			cur = (cur & PAGE_MASK) + PAGE_SIZE;
+		}
+		len -= seg;
+	}
+
+	return len ? -EINVAL : (long)n;
+}
+
 int psipe_dma_map_pages(struct psipe_dma *dma, struct pci_dev *pdev)
 {
+	if (dma->kind == PSIPE_DMA_BUF) {
+		dma->nmapped = 1; /* coherent, a single handle */
+		return 1;
+	}
+	if (dma->kind == PSIPE_DMA_DMABUF) {
+		/* mapped on import, this is the number of handles */
+		long n = psipe_dma_sg_handles(dma->dmabuf->sgt, dma->addr,
+				dma->len, NULL);
+		dma->nmapped = n > 0 ? n : 0;
+		return (int)dma->nmapped;
+	}
+
 	dma->nmapped = dma_map_sg(&pdev->dev, dma->sgt.sgl, dma->sgt.nents,
 			dma->direction);
 
 	return (int)dma->nmapped;
 }
 
+/*
+ * A reduction reads what the receive memory holds before writing the
+ * result, so its device must see the CPU's data (swiotlb, non-coherent).
+ */
+enum dma_data_direction psipe_dma_recv_dir(struct psipe_dma *dma)
+{
+	return dma->red != PSIPE_HW_DMA_RED_NONE ?
+		DMA_BIDIRECTIONAL : DMA_FROM_DEVICE;
+}
+
 void psipe_dma_write_setup(struct psipe_dma *dma, struct psipe_bar *bar, int mode,
 		enum dma_data_direction dir)
 {
+	/* the ioctl values of a reduction go to the device as they are */
+	BUILD_BUG_ON(PSIPE_RED_SUM_F64 != PSIPE_HW_DMA_RED_SUM_F64);
+	BUILD_BUG_ON(PSIPE_RED_SUM_F32 != PSIPE_HW_DMA_RED_SUM_F32);
+	BUILD_BUG_ON(PSIPE_RED_MAX_F64 != PSIPE_HW_DMA_RED_MAX_F64);
+
 	dma->mode = mode;
 	dma->direction = dir;
 	iowrite32((u32)dma->mode, bar->mmio + PSIPE_HW_BAR0_DMA_CFG_MOD);
+	/* the length travels with the SLN, before the maps are written */
+	iowrite32((u32)dma->len, bar->mmio + PSIPE_HW_BAR0_DMA_CFG_LEN);
+	iowrite32(dma->group, bar->mmio + PSIPE_HW_BAR0_DMA_CFG_GRP);
+	iowrite32(dma->red, bar->mmio + PSIPE_HW_BAR0_DMA_CFG_RED);
+	writeq(dma->trace, bar->mmio + PSIPE_HW_BAR0_DMA_CFG_TRC);
 }
 
 void psipe_dma_write_maps(struct psipe_dma *dma, struct psipe_bar *bar)
@@ -108,6 +284,21 @@ void psipe_dma_write_maps(struct psipe_dma *dma, struct psipe_bar *bar)
 	iowrite32((u32)dma->len, bar->mmio + PSIPE_HW_BAR0_DMA_CFG_LEN);
 	iowrite32((u32)dma->nmapped, bar->mmio + PSIPE_HW_BAR0_DMA_CFG_PGS);
 
+	if (dma->kind == PSIPE_DMA_BUF) {
+		iowrite32(PSIPE_HW_DMA_FLG_CONTIG,
+				bar->mmio + PSIPE_HW_BAR0_DMA_CFG_FLG);
+		iowrite32((u32)(dma->buf->dma + dma->addr),
+				bar->mmio + PSIPE_HW_BAR0_DMA_HANDLES);
+		return;
+	}
+
+	iowrite32(0, bar->mmio + PSIPE_HW_BAR0_DMA_CFG_FLG);
+	if (dma->kind == PSIPE_DMA_DMABUF) {
+		psipe_dma_sg_handles(dma->dmabuf->sgt, dma->addr, dma->len,
+				bar->mmio + PSIPE_HW_BAR0_DMA_HANDLES);
+		return;
+	}
+
 	for_each_sg(dma->sgt.sgl, sg, dma->nmapped, i) {
 		handle = sg_dma_address(sg);
 		iowrite32((u32)handle,
@@ -123,11 +314,14 @@ void psipe_dma_doorbell_ring(struct psipe_bar *bar)
 
 void psipe_dma_unmap_pages(struct psipe_dma *dma, struct pci_dev *pdev)
 {
+	if (dma->kind != PSIPE_DMA_USER && dma->kind != PSIPE_DMA_ITER)
+		return;
 	dma_unmap_sg(&pdev->dev, dma->sgt.sgl, dma->sgt.nents, dma->direction);
 }
 
 void psipe_dma_unpin_pages(struct psipe_dma *dma)
 {
+	sg_free_table(&dma->sgt);
 	unpin_user_pages(dma->pages, dma->npages);
 	kfree(dma->pages);
 }
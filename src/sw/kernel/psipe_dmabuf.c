@@ -0,0 +1,193 @@
+/* psipe_dmabuf.c - psipe dma-buf export and import
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#include "psipe_module.h"
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/iosys-map.h>
+#include <linux/slab.h>
+
+/* ============================================================================
+ * Export: psipe buffers as dma-bufs
+ * ============================================================================
+ */
+
+static struct sg_table *psipe_dmabuf_map(struct dma_buf_attachment *attach,
+		enum dma_data_direction dir)
+{
+	struct psipe_buf *buf = attach->dmabuf->priv;
+	struct sg_table *sgt;
+	int rv;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	rv = dma_get_sgtable(&buf->psipe_dev->pdev->dev, sgt, buf->cpu,
+			buf->dma, buf->size);
+	if (rv < 0)
+		goto free_sgt;
+
+	rv = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (rv < 0)
+		goto free_table;
+
+	return sgt;
+
+free_table:
+	sg_free_table(sgt);
+free_sgt:
+	kfree(sgt);
+	return ERR_PTR(rv);
+}
+
+static void psipe_dmabuf_unmap(struct dma_buf_attachment *attach,
+		struct sg_table *sgt, enum dma_data_direction dir)
+{
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static void psipe_dmabuf_release(struct dma_buf *dbuf)
+{
+	psipe_buf_put(dbuf->priv);
+}
+
+static int psipe_dmabuf_mmap(struct dma_buf *dbuf, struct vm_area_struct *vma)
+{
+	struct psipe_buf *buf = dbuf->priv;
+
+	return dma_mmap_coherent(&buf->psipe_dev->pdev->dev, vma, buf->cpu,
+			buf->dma, buf->size);
+}
+
+static int psipe_dmabuf_vmap(struct dma_buf *dbuf, struct iosys_map *map)
+{
+	struct psipe_buf *buf = dbuf->priv;
+
+	iosys_map_set_vaddr(map, buf->cpu);
+	return 0;
+}
+
+static const struct dma_buf_ops psipe_dmabuf_ops = {
+	.map_dma_buf = psipe_dmabuf_map,
+	.unmap_dma_buf = psipe_dmabuf_unmap,
+	.release = psipe_dmabuf_release,
+	.mmap = psipe_dmabuf_mmap,
+	.vmap = psipe_dmabuf_vmap,
+};
+
+/*
+ * Wrap the buffer mapped at uaddr in a dma-buf and return a new fd for it.
+ * The dma-buf keeps the buffer alive after munmap().
+ */
+long psipe_dmabuf_export(struct psipe_dev *psipe_dev, unsigned long uaddr)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct psipe_buf *buf;
+	struct dma_buf *dbuf;
+	int fd;
+
+	buf = psipe_buf_get(psipe_dev, uaddr);
+	if (!buf)
+		return -EINVAL;
+
+	exp_info.ops = &psipe_dmabuf_ops;
+	exp_info.size = buf->size;
+	exp_info.flags = O_RDWR;
+	exp_info.priv = buf;
+
+	dbuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dbuf)) {
+		psipe_buf_put(buf);
+		return PTR_ERR(dbuf);
+	}
+
+	fd = dma_buf_fd(dbuf, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		dma_buf_put(dbuf); /* releases the buffer reference */
+
+	return fd;
+}
+
+/* ============================================================================
+ * Import: dma-bufs from other exporters as op memory
+ * ============================================================================
+ */
+
+/*
+ * Unmapping an attachment takes the reservation lock, so the last reference
+ * is dropped from a work item rather than the irq handler.
+ */
+static void psipe_dmabuf_put_work(struct work_struct *work)
+{
+	struct psipe_dmabuf *imp = container_of(work, struct psipe_dmabuf,
+			put_work);
+
+	if (!iosys_map_is_null(&imp->vaddr))
+		dma_buf_vunmap_unlocked(imp->dbuf, &imp->vaddr);
+	dma_buf_unmap_attachment_unlocked(imp->attach, imp->sgt, imp->dir);
+	dma_buf_detach(imp->dbuf, imp->attach);
+	dma_buf_put(imp->dbuf);
+	kfree(imp);
+}
+
+struct psipe_dmabuf *psipe_dmabuf_import(struct psipe_dev *psipe_dev, int fd,
+		enum dma_data_direction dir)
+{
+	struct psipe_dmabuf *imp;
+	long rv;
+
+	imp = kzalloc(sizeof(*imp), GFP_KERNEL);
+	if (!imp)
+		return ERR_PTR(-ENOMEM);
+
+	imp->dir = dir;
+	INIT_WORK(&imp->put_work, psipe_dmabuf_put_work);
+
+	imp->dbuf = dma_buf_get(fd);
+	if (IS_ERR(imp->dbuf)) {
+		rv = PTR_ERR(imp->dbuf);
+		goto free_imp;
+	}
+
+	imp->attach = dma_buf_attach(imp->dbuf, &psipe_dev->pdev->dev);
+	if (IS_ERR(imp->attach)) {
+		rv = PTR_ERR(imp->attach);
+		goto put_dbuf;
+	}
+
+	imp->sgt = dma_buf_map_attachment_unlocked(imp->attach, dir);
+	if (IS_ERR(imp->sgt)) {
+		rv = PTR_ERR(imp->sgt);
+		goto detach;
+	}
+
+	/* only needed to hand over pooled data, optional */
+	if (!dma_buf_vmap_unlocked(imp->dbuf, &imp->vaddr) &&
+			imp->vaddr.is_iomem) {
+		dma_buf_vunmap_unlocked(imp->dbuf, &imp->vaddr);
+		iosys_map_clear(&imp->vaddr);
+	}
+
+	return imp;
+
+detach:
+	dma_buf_detach(imp->dbuf, imp->attach);
+put_dbuf:
+	dma_buf_put(imp->dbuf);
+free_imp:
+	kfree(imp);
+	return ERR_PTR(rv);
+}
+
+void psipe_dmabuf_put(struct psipe_dmabuf *imp)
+{
+	schedule_work(&imp->put_work);
+}
@@ -11,17 +11,18 @@
 #include "psipe_module.h"
 #include <linux/pci.h>
 
-static inline bool psipe_irq_check_and_ack(struct psipe_dev *psipe_dev)
+static inline u32 psipe_irq_check_and_ack(struct psipe_dev *psipe_dev)
 {
 	unsigned long flags;
+	u32 cause;
 
 	spin_lock_irqsave(&psipe_dev->irq.lock, flags);
-	bool active = (bool)ioread32(psipe_dev->irq.mmio_check_irq);
-	if (active)
-		iowrite32(1, psipe_dev->irq.mmio_ack_irq);
+	cause = ioread32(psipe_dev->irq.mmio_cause);
+	if (cause)
+		iowrite32(cause, psipe_dev->irq.mmio_cause);
 	spin_unlock_irqrestore(&psipe_dev->irq.lock, flags);
 
-	return active;
+	return cause;
 }
 
 /*
@@ -34,11 +35,15 @@ static inline void psipe_irq_ack(struct psipe_dev *psipe_dev)
 static irqreturn_t psipe_irq_handler(int irq, void *data)
 {
 	struct psipe_dev *psipe_dev = data;
+	u32 cause = psipe_irq_check_and_ack(psipe_dev);
 
-	if (!psipe_irq_check_and_ack(psipe_dev))
+	if (!cause)
 		return IRQ_NONE;
 
-	psipe_ops_next(psipe_dev);
+	if (cause & PSIPE_HW_IRQ_CAUSE_WORK_ENDED)
+		psipe_ops_next(psipe_dev);
+	if (cause & PSIPE_HW_IRQ_CAUSE_POOL_FILLED)
+		psipe_pool_notify(psipe_dev);
 
 	/*
 	dev_dbg(&psipe_dev->pdev->dev, "irq_handler irq = %d dev = %d\n", irq,
@@ -82,15 +87,14 @@ static int psipe_irq_enable_vectors(struct psipe_dev *psipe_dev)
 			psipe_dev->irq.irq_num);
 	*/
 
+	psipe_dev->irq.mmio_cause =
+		psipe_dev->bar.mmio + PSIPE_HW_BAR0_IRQ_CAUSE;
+
 	err = request_irq(psipe_dev->irq.irq_num, psipe_irq_handler,
 			  IRQF_SHARED, "psipe_dma_fini", psipe_dev);
 	if (err)
 		goto err_clean_irqs;
 
-	psipe_dev->irq.mmio_check_irq =
-		psipe_dev->bar.mmio + PSIPE_HW_IRQ_WORK_ENDED_ADDR;
-	psipe_dev->irq.mmio_ack_irq =
-		psipe_dev->bar.mmio + PSIPE_HW_IRQ_WORK_ENDED_ACK_ADDR;
 	return 0;
 
 err_clean_irqs:
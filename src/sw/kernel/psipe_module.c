@@ -13,12 +13,17 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/pci.h>
+#include <linux/random.h>
 #include <linux/string.h>
 
+#define CREATE_TRACE_POINTS
+#include "psipe_trace.h"
+
 MODULE_LICENSE("GPL");
 MODULE_VERSION("2.0");
 MODULE_DESCRIPTION("Kernel module to control the psipe virtual device");
 MODULE_AUTHOR("David Cañadas López <david.canadas@estudiantat.upc.edu>");
+MODULE_IMPORT_NS(DMA_BUF);
 
 static struct class *psipe_class;
 
@@ -43,7 +48,7 @@ static int psipe_open(struct inode *inode, struct file *fp)
 
 	fp->private_data = psipe_dev;
 
-	return 0;
+	return stream_open(inode, fp);
 }
 
 static bool psipe_check_size_avail(struct psipe_dma *dma, struct psipe_bar *bar)
@@ -56,44 +61,51 @@ static void psipe_set_size_avail(struct psipe_dma *dma, struct psipe_bar *bar)
 	iowrite32((u32)dma->len, bar->mmio + PSIPE_HW_BAR0_DMA_CFG_LEN_AVAIL);
 }
 
+/*
+ * These return 0 once the doorbell is rung, the irq then finishes the op.
+ * Anything else means the op is already over (see psipe_ops_run).
+ */
 long psipe_ioctl_send(struct psipe_dev *psipe_dev, struct psipe_dma *dma)
 {
 	struct psipe_bar *bar = &psipe_dev->bar;
-	int rv = 0;
 
 	psipe_dma_write_setup(dma, bar, PSIPE_MODE_ACTIVE, DMA_TO_DEVICE);
-	if (!psipe_check_size_avail(dma, bar))
-		return -EMSGSIZE;
-
-	rv = psipe_dma_map_pages(dma, psipe_dev->pdev);
-	if (rv < 0) {
-		psipe_dma_unpin_pages(dma); /* there will be no irq */
-		return rv;
-	}
+	if (psipe_dma_map_pages(dma, psipe_dev->pdev) <= 0)
+		return -ENOMEM; /* there will be no irq */
 
 	//pr_info("psipe_dma_map_pages - success\n");
 
+	/* arms the peers, nothing may fail between this and the doorbell */
+	if (!psipe_check_size_avail(dma, bar))
+		return -EMSGSIZE;
+
 	psipe_dma_write_maps(dma, bar);
 	psipe_dma_doorbell_ring(bar);
 
 	//pr_info("psipe_ioctl_send - success\n");
 
-	return (long)rv;
+	return 0;
 }
 
 long psipe_ioctl_recv(struct psipe_dev *psipe_dev, struct psipe_dma *dma)
 {
 	struct psipe_bar *bar = &psipe_dev->bar;
-	int rv = 0;
+	long rv;
+
+	/* earlier transfers may already wait in the pool */
+	if (dma->red)
+		rv = psipe_pool_fold(psipe_dev, dma);
+	else
+		rv = psipe_pool_take(psipe_dev, dma);
+	if (rv != -EAGAIN)
+		return rv;
 
-	psipe_dma_write_setup(dma, bar, PSIPE_MODE_PASSIVE, DMA_FROM_DEVICE);
+	psipe_dma_write_setup(dma, bar, PSIPE_MODE_PASSIVE,
+			psipe_dma_recv_dir(dma));
 	psipe_set_size_avail(dma, bar);
 
-	rv = psipe_dma_map_pages(dma, psipe_dev->pdev);
-	if (rv < 0) {
-		psipe_dma_unpin_pages(dma); /* there will be no irq */
-		return rv;
-	}
+	if (psipe_dma_map_pages(dma, psipe_dev->pdev) <= 0)
+		return -ENOMEM; /* there will be no irq */
 
 	//pr_info("psipe_dma_map_pages - success\n");
 
@@ -102,12 +114,13 @@ long psipe_ioctl_recv(struct psipe_dev *psipe_dev, struct psipe_dma *dma)
 
 	//pr_info("psipe_ioctl_recv - success\n");
 
-	return (long)rv;
+	return 0;
 }
 
 static long psipe_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
 {
 	struct psipe_dev *psipe_dev = fp->private_data;
+	union psipe_op_args args;
 	struct psipe_op *op;
 	psipe_handle_t id;
 	long rv = -ENOTTY;
@@ -115,27 +128,57 @@ static long psipe_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
 	switch(cmd) {
 	case PSIPE_IOCTL_SEND:
 	case PSIPE_IOCTL_RECV:
-		op = psipe_ops_new(cmd, arg);
+	case PSIPE_IOCTL_SEND_BUF:
+	case PSIPE_IOCTL_RECV_BUF:
+	case PSIPE_IOCTL_SEND_DMABUF:
+	case PSIPE_IOCTL_RECV_DMABUF:
+	case PSIPE_IOCTL_BCAST:
+	case PSIPE_IOCTL_RECV_RED:
+		if (copy_from_user(&args, (void __user *)arg,
+					psipe_ops_args_size(cmd))) {
+			rv = -EFAULT;
+			break;
+		}
+		op = psipe_ops_new(psipe_dev, cmd, &args);
 		id = psipe_ops_init(psipe_dev, op);
 		rv = (long)id;
 		break;
 	case PSIPE_IOCTL_WAIT:
 		id = (psipe_handle_t)arg;
 		op = psipe_ops_get(&psipe_dev->ops, id);
-		rv = psipe_ops_wait(op);
+		rv = psipe_ops_wait(psipe_dev, op);
 		break;
 	case PSIPE_IOCTL_FLUSH:
 		rv = psipe_ops_flush(psipe_dev);
 		break;
+	case PSIPE_IOCTL_BUF_EXPORT:
+		rv = psipe_dmabuf_export(psipe_dev, arg);
+		break;
+	case PSIPE_IOCTL_DEV_ID:
+		rv = ioread32(psipe_dev->bar.mmio + PSIPE_HW_BAR0_DEV_ID);
+		break;
 	}
 
 	return rv;
 }
 
+static int psipe_mmap(struct file *fp, struct vm_area_struct *vma)
+{
+	return psipe_buf_mmap(fp->private_data, vma);
+}
+
 static const struct file_operations psipe_fops = {
 	.owner = THIS_MODULE,
 	.open = psipe_open,
 	.unlocked_ioctl = psipe_ioctl,
+	.mmap = psipe_mmap,
+	.uring_cmd = psipe_uring_cmd,
+	.read_iter = psipe_stream_read,
+	.write_iter = psipe_stream_write,
+	.poll = psipe_stream_poll,
+	.splice_read = copy_splice_read,
+	.splice_write = iter_file_splice_write,
+	.llseek = no_llseek,
 };
 
 static void psipe_dev_clean(struct psipe_dev *psipe_dev)
@@ -168,14 +211,16 @@ static int psipe_dev_init(struct psipe_dev *psipe_dev, struct pci_dev *pdev)
 	spin_lock_init(&psipe_dev->ops.lock);
 	INIT_LIST_HEAD(&psipe_dev->ops.active);
 	INIT_LIST_HEAD(&psipe_dev->ops.inactive);
+	init_waitqueue_head(&psipe_dev->ops.waitq);
 	psipe_dev->ops.next_id = 0;
+	psipe_dev->trace_salt = get_random_u32();
 
 	return 0;
 }
 
 static struct psipe_dev *psipe_alloc_dev(void)
 {
-	return kmalloc(sizeof(struct psipe_dev), GFP_KERNEL);
+	return kzalloc(sizeof(struct psipe_dev), GFP_KERNEL);
 }
 
 static int psipe_probe(struct pci_dev *pdev, const struct pci_device_id *id)
@@ -254,9 +299,9 @@ static int psipe_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 		goto err_cdev_add;
 	}
 
-	dev = device_create(psipe_class, &pdev->dev,
+	dev = device_create_with_groups(psipe_class, &pdev->dev,
 			MKDEV(psipe_dev->major, psipe_dev->minor),
-			psipe_dev, "d%xb%xd%xf%x_bar%u",
+			psipe_dev, psipe_stats_groups, "d%xb%xd%xf%x_bar%u",
 			pci_domain_nr(pdev->bus), pdev->bus->number,
 			PCI_SLOT(pdev->devfn), PCI_FUNC(pdev->devfn),
 			PSIPE_HW_BAR0);
@@ -272,10 +317,22 @@ static int psipe_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 		goto err_irq_enable;
 	}
 
+	err = psipe_pool_init(psipe_dev);
+	if (err) {
+		dev_err(&pdev->dev, "psipe_pool_init failed\n");
+		goto err_pool_init;
+	}
+
+	psipe_debugfs_init(psipe_dev, dev_name(dev));
+
 	//dev_info(&pdev->dev, "psipe probe - success\n");
 
 	return 0;
 
+err_pool_init:
+	free_irq(psipe_dev->irq.irq_num, psipe_dev);
+	pci_free_irq_vectors(pdev);
+
 err_irq_enable:
 	device_destroy(psipe_class,
 		       MKDEV(psipe_dev->major, psipe_dev->minor));
@@ -313,6 +370,8 @@ static void psipe_remove(struct pci_dev *pdev)
 {
 	struct psipe_dev *psipe_dev = pci_get_drvdata(pdev);
 
+	psipe_debugfs_fini(psipe_dev);
+	psipe_pool_fini(psipe_dev);
 	device_destroy(psipe_class, MKDEV(psipe_dev->major,
 				psipe_dev->minor));
 	cdev_del(&psipe_dev->cdev);
@@ -341,6 +400,7 @@ static void psipe_module_exit(void)
 {
 	pci_unregister_driver(&psipe_pci_driver);
 	class_destroy(psipe_class);
+	psipe_debugfs_remove_root();
 	//pr_debug("psipe_module_exit finished successfully\n");
 }
 
@@ -361,6 +421,7 @@ static int __init psipe_module_init(void)
 		return err;
 	}
 	psipe_class->devnode = psipe_devnode;
+	psipe_debugfs_create_root();
 	err = pci_register_driver(&psipe_pci_driver);
 	if (err) {
 		pr_err("pci_register_driver error\n");
@@ -369,6 +430,7 @@ static int __init psipe_module_init(void)
 	//pr_debug("psipe_module_init finished successfully\n");
 	return 0;
 err_pci:
+	psipe_debugfs_remove_root();
 	class_destroy(psipe_class);
 	pr_err("psipe_module_init failed with err=%d\n", err);
 	return err;
@@ -20,10 +20,26 @@
 #include <linux/list.h>
 #include <linux/spinlock.h>
 #include <linux/atomic.h>
+#include <linux/kref.h>
+#include <linux/workqueue.h>
+#include <linux/iosys-map.h>
+#include <linux/io_uring.h>
 
 #define PSIPE_MODE_ACTIVE 1
 #define PSIPE_MODE_PASSIVE 0
 #define PSIPE_MODE_OFF -1
+#define PSIPE_MODE_LOCAL PSIPE_HW_DMA_MODE_LOCAL
+
+#define PSIPE_POOL_BUF_SIZE (256 * 1024)
+
+#define PSIPE_LAT_BUCKETS 32 // log2 of the ns, the last takes the rest
+
+enum psipe_lat_kind {
+	PSIPE_LAT_QUEUE, // submit to start on the device
+	PSIPE_LAT_DEVICE, // start to irq
+	PSIPE_LAT_WAKE, // irq to an ioctl waiter running again
+	PSIPE_LAT_NUM,
+};
 
 struct psipe_bar {
 	u64 start;
@@ -33,21 +49,66 @@ struct psipe_bar {
 };
 
 struct psipe_irq {
-	void __iomem *mmio_ack_irq;
-	void __iomem *mmio_check_irq;
+	void __iomem *mmio_cause;
 	int irq_num;
 	spinlock_t lock;
 };
 
+struct psipe_pool {
+	void *cpu[PSIPE_HW_POOL_SLOTS];
+	dma_addr_t dma[PSIPE_HW_POOL_SLOTS];
+	size_t size;
+	unsigned int cons; // next slot to hand out, in device fill order
+	wait_queue_head_t waitq;
+};
+
+enum psipe_dma_kind {
+	PSIPE_DMA_USER, /* user pages, pinned per op */
+	PSIPE_DMA_BUF, /* driver buffer mapped with mmap() */
+	PSIPE_DMA_DMABUF, /* dma-buf imported from another driver */
+	PSIPE_DMA_ITER, /* pages extracted from a read/write iov_iter */
+};
+
+struct psipe_buf {
+	struct kref ref;
+	struct psipe_dev *psipe_dev;
+	void *cpu;
+	dma_addr_t dma; /* physically contiguous */
+	size_t size;
+	struct work_struct free_work;
+};
+
+struct psipe_dmabuf {
+	struct dma_buf *dbuf;
+	struct dma_buf_attachment *attach;
+	struct sg_table *sgt; /* already mapped for the psipe device */
+	struct iosys_map vaddr; /* may be null */
+	enum dma_data_direction dir;
+	struct work_struct put_work;
+};
+
 struct psipe_dma {
 	int mode;
+	enum psipe_dma_kind kind;
 	enum dma_data_direction direction;
 	struct page **pages;
 	struct sg_table sgt; /* dma page distribution */
+	struct psipe_buf *buf;
+	struct psipe_dmabuf *dmabuf;
 	unsigned long npages;
 	unsigned long nmapped;
-	unsigned long addr;
+	bool pinned; /* PSIPE_DMA_ITER pages need unpinning */
+	unsigned long addr; /* offset into buf/dmabuf for those kinds */
 	unsigned long len;
+	u32 group; /* device ids a send also goes to, see PSIPE_IOCTL_BCAST */
+	u32 red; /* PSIPE_RED_* for PSIPE_IOCTL_RECV_RED, 0 otherwise */
+	bool pooled; /* drains pool_slot, which goes back to the device after */
+	unsigned int pool_slot;
+	u64 trace; /* names the transfer across machines, see psipe_ops_init */
+};
+
+struct psipe_lat {
+	atomic64_t hist[PSIPE_LAT_NUM][PSIPE_LAT_BUCKETS];
 };
 
 struct psipe_ops {
@@ -55,6 +116,7 @@ struct psipe_ops {
 	spinlock_t lock; // to lock queue access
 	struct list_head active;
 	struct list_head inactive;
+	wait_queue_head_t waitq; // woken when the queue drains, for poll
 };
 
 struct psipe_dev {
@@ -62,6 +124,10 @@ struct psipe_dev {
 	struct psipe_bar bar;
 	struct psipe_irq irq;
 	struct psipe_ops ops;
+	struct psipe_pool pool;
+	struct psipe_lat lat;
+	struct dentry *debugfs;
+	u32 trace_salt; /* tells trace ids apart from other machines' */
 	dev_t minor, major;
 	struct cdev cdev;
 };
@@ -75,6 +141,18 @@ struct psipe_op {
 	long retval;
 	long (*ioctl_fn)(struct psipe_dev *, struct psipe_dma *);
 	struct psipe_dma dma;
+	struct io_uring_cmd *ucmd; // submitted through io_uring, reaps itself
+	struct kiocb *iocb; // async read/write, reaps itself
+	struct list_head uwaiters; // io_uring waits, see psipe_uring.c
+	u64 t_submit, t_start, t_irq; // ktime_get_ns(), 0 if it did not happen
+};
+
+union psipe_op_args {
+	struct psipe_data data;
+	struct psipe_buf_data buf;
+	struct psipe_dmabuf_data dmabuf;
+	struct psipe_bcast_data bcast;
+	struct psipe_red_data red;
 };
 
 long psipe_ioctl_send(struct psipe_dev *psipe_dev, struct psipe_dma *dma);
@@ -82,20 +160,67 @@ long psipe_ioctl_recv(struct psipe_dev *psipe_dev, struct psipe_dma *dma);
 
 int psipe_dma_pin_pages(struct psipe_dma *dma);
 void psipe_dma_unpin_pages(struct psipe_dma *dma);
+int psipe_dma_extract_pages(struct psipe_dma *dma, struct iov_iter *iter);
+int psipe_dma_acquire(struct psipe_dma *dma);
+void psipe_dma_release(struct psipe_dma *dma);
+int psipe_dma_copy_in(struct psipe_dma *dma, const void *src, size_t len);
+long psipe_dma_sg_handles(struct sg_table *sgt, unsigned long ofs,
+		unsigned long len, void __iomem *out);
 int psipe_dma_map_pages(struct psipe_dma *dma, struct pci_dev *pdev);
 void psipe_dma_unmap_pages(struct psipe_dma *dma, struct pci_dev *pdev);
+enum dma_data_direction psipe_dma_recv_dir(struct psipe_dma *dma);
 void psipe_dma_write_setup(struct psipe_dma *dma, struct psipe_bar *bar, int mode, enum dma_data_direction dir);
 void psipe_dma_write_maps(struct psipe_dma *dma, struct psipe_bar *bar);
 void psipe_dma_doorbell_ring(struct psipe_bar *bar);
 
-struct psipe_op *psipe_ops_new(unsigned int cmd, unsigned long uarg);
+struct psipe_op *psipe_ops_alloc(void);
+size_t psipe_ops_args_size(unsigned int cmd);
+struct psipe_op *psipe_ops_new(struct psipe_dev *psipe_dev, unsigned int cmd,
+		const union psipe_op_args *args);
 psipe_handle_t psipe_ops_init(struct psipe_dev *psipe_dev, struct psipe_op *op);
 struct psipe_op *psipe_ops_current(struct psipe_ops *ops);
-long psipe_ops_wait(struct psipe_op *op);
+long psipe_ops_wait(struct psipe_dev *psipe_dev, struct psipe_op *op);
 void psipe_ops_next(struct psipe_dev *psipe_dev);
 struct psipe_op *psipe_ops_get(struct psipe_ops *ops, psipe_handle_t id);
+struct psipe_op *psipe_ops_find(struct psipe_ops *ops, psipe_handle_t id);
 int psipe_ops_flush(struct psipe_dev *psipe_dev);
+bool psipe_ops_idle(struct psipe_ops *ops);
 
 int psipe_irq_enable(struct psipe_dev *psipe_dev);
 
+int psipe_buf_mmap(struct psipe_dev *psipe_dev, struct vm_area_struct *vma);
+struct psipe_buf *psipe_buf_get(struct psipe_dev *psipe_dev,
+		unsigned long uaddr);
+void psipe_buf_put(struct psipe_buf *buf);
+
+long psipe_dmabuf_export(struct psipe_dev *psipe_dev, unsigned long uaddr);
+struct psipe_dmabuf *psipe_dmabuf_import(struct psipe_dev *psipe_dev, int fd,
+		enum dma_data_direction dir);
+void psipe_dmabuf_put(struct psipe_dmabuf *imp);
+
+int psipe_pool_init(struct psipe_dev *psipe_dev);
+void psipe_pool_fini(struct psipe_dev *psipe_dev);
+long psipe_pool_take(struct psipe_dev *psipe_dev, struct psipe_dma *dma);
+long psipe_pool_fold(struct psipe_dev *psipe_dev, struct psipe_dma *dma);
+void psipe_pool_repost(struct psipe_dev *psipe_dev, unsigned int slot);
+void psipe_pool_notify(struct psipe_dev *psipe_dev);
+bool psipe_pool_ready(struct psipe_dev *psipe_dev);
+
+ssize_t psipe_stream_read(struct kiocb *iocb, struct iov_iter *to);
+ssize_t psipe_stream_write(struct kiocb *iocb, struct iov_iter *from);
+__poll_t psipe_stream_poll(struct file *fp, struct poll_table_struct *wait);
+
+int psipe_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags);
+void psipe_uring_complete(struct io_uring_cmd *ioucmd, long rv);
+bool psipe_uring_wake(struct psipe_op *op);
+
+extern const struct attribute_group *psipe_stats_groups[];
+
+void psipe_lat_add(struct psipe_dev *psipe_dev, enum psipe_lat_kind kind,
+		u64 from, u64 to);
+void psipe_debugfs_init(struct psipe_dev *psipe_dev, const char *name);
+void psipe_debugfs_fini(struct psipe_dev *psipe_dev);
+void psipe_debugfs_create_root(void);
+void psipe_debugfs_remove_root(void);
+
 #endif /* _PSIPE_MODULE_H_ */
@@ -0,0 +1,181 @@
+/* psipe_pool.c - psipe virtual device receive pool
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#include "hw/psipe_hw.h"
+#include "psipe_module.h"
+#include <linux/dma-mapping.h>
+
+static inline void __iomem *psipe_pool_reg(struct psipe_dev *psipe_dev,
+		unsigned long reg, unsigned int slot)
+{
+	return psipe_dev->bar.mmio + PSIPE_HW_BAR0_POOL_SLOT(reg, slot);
+}
+
+/* the trace id the peer sent the slot's transfer with */
+static u64 psipe_pool_trace(struct psipe_dev *psipe_dev, unsigned int slot)
+{
+	return readq(psipe_pool_reg(psipe_dev, PSIPE_HW_BAR0_POOL_SLOT_TRC,
+				slot));
+}
+
+static void psipe_pool_post(struct psipe_dev *psipe_dev, unsigned int slot)
+{
+	iowrite32((u32)psipe_dev->pool.dma[slot],
+			psipe_pool_reg(psipe_dev, PSIPE_HW_BAR0_POOL_SLOT_ADDR, slot));
+}
+
+static void psipe_pool_free(struct psipe_dev *psipe_dev)
+{
+	struct psipe_pool *pool = &psipe_dev->pool;
+	int i;
+
+	for (i = 0; i < PSIPE_HW_POOL_SLOTS; ++i) {
+		if (!pool->cpu[i])
+			continue;
+		dma_free_coherent(&psipe_dev->pdev->dev, pool->size,
+				pool->cpu[i], pool->dma[i]);
+		pool->cpu[i] = NULL;
+	}
+}
+
+/*
+ * Post every slot to the device so inbound transfers can land while no
+ * receive is pending.
+ */
+int psipe_pool_init(struct psipe_dev *psipe_dev)
+{
+	struct psipe_pool *pool = &psipe_dev->pool;
+	int i;
+
+	init_waitqueue_head(&pool->waitq);
+	pool->size = PSIPE_POOL_BUF_SIZE;
+	pool->cons = 0;
+
+	for (i = 0; i < PSIPE_HW_POOL_SLOTS; ++i) {
+		pool->cpu[i] = dma_alloc_coherent(&psipe_dev->pdev->dev,
+				pool->size, &pool->dma[i], GFP_KERNEL);
+		if (!pool->cpu[i]) {
+			psipe_pool_free(psipe_dev);
+			return -ENOMEM;
+		}
+	}
+
+	iowrite32((u32)pool->size,
+			psipe_dev->bar.mmio + PSIPE_HW_BAR0_POOL_BUF_SIZE);
+	for (i = 0; i < PSIPE_HW_POOL_SLOTS; ++i)
+		psipe_pool_post(psipe_dev, i);
+
+	return 0;
+}
+
+void psipe_pool_fini(struct psipe_dev *psipe_dev)
+{
+	int i;
+
+	iowrite32(0, psipe_dev->bar.mmio + PSIPE_HW_BAR0_POOL_BUF_SIZE);
+	for (i = 0; i < PSIPE_HW_POOL_SLOTS; ++i)
+		iowrite32(0, psipe_pool_reg(psipe_dev,
+					PSIPE_HW_BAR0_POOL_SLOT_ADDR, i));
+	psipe_pool_free(psipe_dev);
+}
+
+/*
+ * Copy the oldest pooled transfer into the memory of a receive and
+ * recycle its slot. Returns the number of bytes, or -EAGAIN when the pool is
+ * empty and the receive has to go to the device.
+ */
+long psipe_pool_take(struct psipe_dev *psipe_dev, struct psipe_dma *dma)
+{
+	/* ops->lock must be taken */
+	struct psipe_pool *pool = &psipe_dev->pool;
+	unsigned int slot = pool->cons;
+	size_t len;
+
+	if (!pool->cpu[slot])
+		return -EAGAIN;
+
+	len = ioread32(psipe_pool_reg(psipe_dev, PSIPE_HW_BAR0_POOL_SLOT_LEN,
+				slot));
+	if (!len)
+		return -EAGAIN;
+	if (len > dma->len)
+		return -EMSGSIZE;
+
+	if (psipe_dma_copy_in(dma, pool->cpu[slot], len) < 0)
+		return -EFAULT;
+	dma->trace = psipe_pool_trace(psipe_dev, slot);
+
+	pool->cons = (slot + 1) % PSIPE_HW_POOL_SLOTS;
+	psipe_pool_post(psipe_dev, slot);
+
+	return (long)len;
+}
+
+/*
+ * A reduction cannot fold on the CPU (no FPU in the kernel), so the device
+ * does it: a local run moves the pooled transfer into the receive memory
+ * through the same path as data from the peer. The slot stays out of the
+ * device until the op ends. Returns 0 once the run is started, -EAGAIN or
+ * -EMSGSIZE like psipe_pool_take.
+ */
+long psipe_pool_fold(struct psipe_dev *psipe_dev, struct psipe_dma *dma)
+{
+	/* ops->lock must be taken */
+	struct psipe_pool *pool = &psipe_dev->pool;
+	struct psipe_bar *bar = &psipe_dev->bar;
+	unsigned int slot = pool->cons;
+	size_t len;
+
+	if (!pool->cpu[slot])
+		return -EAGAIN;
+
+	len = ioread32(psipe_pool_reg(psipe_dev, PSIPE_HW_BAR0_POOL_SLOT_LEN,
+				slot));
+	if (!len)
+		return -EAGAIN;
+	if (len > dma->len)
+		return -EMSGSIZE;
+
+	dma->len = len;
+	dma->trace = psipe_pool_trace(psipe_dev, slot);
+	psipe_dma_write_setup(dma, bar, PSIPE_MODE_LOCAL,
+			psipe_dma_recv_dir(dma));
+	iowrite32((u32)pool->dma[slot], bar->mmio + PSIPE_HW_BAR0_DMA_CFG_SRC);
+
+	if (psipe_dma_map_pages(dma, psipe_dev->pdev) <= 0)
+		return -ENOMEM;
+
+	psipe_dma_write_maps(dma, bar);
+	psipe_dma_doorbell_ring(bar);
+
+	pool->cons = (slot + 1) % PSIPE_HW_POOL_SLOTS;
+	dma->pooled = true;
+	dma->pool_slot = slot;
+
+	return 0;
+}
+
+void psipe_pool_repost(struct psipe_dev *psipe_dev, unsigned int slot)
+{
+	psipe_pool_post(psipe_dev, slot);
+}
+
+/* Whether a receive would be served from the pool right now. */
+bool psipe_pool_ready(struct psipe_dev *psipe_dev)
+{
+	struct psipe_pool *pool = &psipe_dev->pool;
+
+	return pool->cpu[pool->cons] &&
+		ioread32(psipe_pool_reg(psipe_dev, PSIPE_HW_BAR0_POOL_SLOT_LEN,
+					pool->cons));
+}
+
+void psipe_pool_notify(struct psipe_dev *psipe_dev)
+{
+	wake_up_interruptible(&psipe_dev->pool.waitq);
+}
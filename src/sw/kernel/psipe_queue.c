@@ -7,81 +7,218 @@
  */
 
 #include "psipe_module.h"
+#include "psipe_trace.h"
 
-struct psipe_op *psipe_ops_new(unsigned int cmd, unsigned long uarg)
+size_t psipe_ops_args_size(unsigned int cmd)
 {
-	int rv;
-	struct psipe_data data;
+	switch (cmd) {
+	case PSIPE_IOCTL_SEND:
+	case PSIPE_IOCTL_RECV:
+		return sizeof(struct psipe_data);
+	case PSIPE_IOCTL_SEND_BUF:
+	case PSIPE_IOCTL_RECV_BUF:
+		return sizeof(struct psipe_buf_data);
+	case PSIPE_IOCTL_SEND_DMABUF:
+	case PSIPE_IOCTL_RECV_DMABUF:
+		return sizeof(struct psipe_dmabuf_data);
+	case PSIPE_IOCTL_BCAST:
+		return sizeof(struct psipe_bcast_data);
+	case PSIPE_IOCTL_RECV_RED:
+		return sizeof(struct psipe_red_data);
+	}
+	return 0;
+}
+
+struct psipe_op *psipe_ops_alloc(void)
+{
+	struct psipe_op *op = kzalloc(sizeof(*op), GFP_KERNEL);
+	if (!op)
+		return NULL;
+
+	init_waitqueue_head(&op->waitq);
+	INIT_LIST_HEAD(&op->uwaiters);
+	atomic_set(&op->nwaiting, 0);
+	op->flag = 0;
 
-	struct psipe_op *op = kmalloc(sizeof(*op), GFP_KERNEL);
+	return op;
+}
+
+/* args is already in kernel memory, see psipe_ops_args_size */
+struct psipe_op *psipe_ops_new(struct psipe_dev *psipe_dev, unsigned int cmd,
+		const union psipe_op_args *args)
+{
+	const struct psipe_data *data = &args->data;
+	const struct psipe_buf_data *bdata = &args->buf;
+	const struct psipe_dmabuf_data *ddata = &args->dmabuf;
+	const struct psipe_bcast_data *bcdata = &args->bcast;
+	const struct psipe_red_data *rdata = &args->red;
+	struct psipe_dmabuf *imp;
+	enum dma_data_direction dir;
+
+	struct psipe_op *op = psipe_ops_alloc();
 	if (!op)
 		goto out;
 
 	switch(cmd) {
 	case PSIPE_IOCTL_SEND:
-		rv = copy_from_user(&data, (void *)uarg, sizeof(data));
-		if (rv < 0)
-			goto clean;
-		op->dma.addr = data.addr;
-		op->dma.len = data.len;
+		op->dma.kind = PSIPE_DMA_USER;
+		op->dma.addr = data->addr;
+		op->dma.len = data->len;
 		op->dma.mode = PSIPE_MODE_OFF;
 		op->ioctl_fn = psipe_ioctl_send;
 		break;
 	case PSIPE_IOCTL_RECV:
-		rv = copy_from_user(&data, (void *)uarg, sizeof(data));
-		if (rv < 0)
+		op->dma.kind = PSIPE_DMA_USER;
+		op->dma.addr = data->addr;
+		op->dma.len = data->len;
+		op->dma.mode = PSIPE_MODE_OFF;
+		op->ioctl_fn = psipe_ioctl_recv;
+		break;
+	case PSIPE_IOCTL_BCAST:
+		if (!bcdata->group || bcdata->group >> PSIPE_HW_GROUP_MAX)
+			goto clean;
+		op->dma.kind = PSIPE_DMA_USER;
+		op->dma.addr = bcdata->addr;
+		op->dma.len = bcdata->len;
+		op->dma.group = bcdata->group;
+		op->dma.mode = PSIPE_MODE_OFF;
+		op->ioctl_fn = psipe_ioctl_send;
+		break;
+	case PSIPE_IOCTL_RECV_RED:
+		if (rdata->op < PSIPE_RED_SUM_F64 ||
+				rdata->op > PSIPE_RED_MAX_F64)
 			goto clean;
-		op->dma.addr = data.addr;
-		op->dma.len = data.len;
+		op->dma.kind = PSIPE_DMA_USER;
+		op->dma.addr = rdata->addr;
+		op->dma.len = rdata->len;
+		op->dma.red = rdata->op;
 		op->dma.mode = PSIPE_MODE_OFF;
 		op->ioctl_fn = psipe_ioctl_recv;
 		break;
+	case PSIPE_IOCTL_SEND_BUF:
+	case PSIPE_IOCTL_RECV_BUF:
+		op->dma.buf = psipe_buf_get(psipe_dev, bdata->buf);
+		if (!op->dma.buf)
+			goto clean;
+		if (!bdata->len || bdata->ofs >= op->dma.buf->size ||
+				bdata->len > op->dma.buf->size - bdata->ofs)
+			goto clean_buf;
+		op->dma.kind = PSIPE_DMA_BUF;
+		op->dma.addr = bdata->ofs;
+		op->dma.len = bdata->len;
+		op->dma.mode = PSIPE_MODE_OFF;
+		op->ioctl_fn = cmd == PSIPE_IOCTL_SEND_BUF ?
+			psipe_ioctl_send : psipe_ioctl_recv;
+		break;
+	case PSIPE_IOCTL_SEND_DMABUF:
+	case PSIPE_IOCTL_RECV_DMABUF:
+		dir = cmd == PSIPE_IOCTL_SEND_DMABUF ?
+			DMA_TO_DEVICE : DMA_FROM_DEVICE;
+		imp = psipe_dmabuf_import(psipe_dev, ddata->fd, dir);
+		if (IS_ERR(imp))
+			goto clean;
+		op->dma.dmabuf = imp;
+		if (!ddata->len || psipe_dma_sg_handles(imp->sgt, ddata->ofs,
+					ddata->len, NULL) <= 0)
+			goto clean_dmabuf;
+		op->dma.kind = PSIPE_DMA_DMABUF;
+		op->dma.addr = ddata->ofs;
+		op->dma.len = ddata->len;
+		op->dma.mode = PSIPE_MODE_OFF;
+		op->ioctl_fn = cmd == PSIPE_IOCTL_SEND_DMABUF ?
+			psipe_ioctl_send : psipe_ioctl_recv;
+		break;
 	default:
 		goto clean;
 	}
 
-	init_waitqueue_head(&op->waitq);
-	atomic_set(&op->nwaiting, 0);
-	op->flag = 0;
-
 out:
 	return op;
 
+clean_dmabuf:
+	psipe_dmabuf_put(op->dma.dmabuf);
+	goto clean;
+clean_buf:
+	psipe_buf_put(op->dma.buf);
 clean:
 	kfree(op);
 	return NULL;
 }
 
+static void psipe_ops_fini(struct psipe_dev *psipe_dev, struct psipe_op *op);
+
+/* Ops submitted through io_uring or aio are not waited on by id. */
+static inline bool psipe_ops_anon(struct psipe_op *op)
+{
+	return op->ucmd || op->iocb;
+}
+
+static void psipe_ops_complete(struct psipe_op *op, long rv)
+{
+	if (op->ucmd)
+		psipe_uring_complete(op->ucmd, rv);
+	else
+		op->iocb->ki_complete(op->iocb, rv);
+}
+
+/*
+ * Start ops from the head of the queue. An ioctl_fn returns 0 once the device
+ * runs the op (the irq finishes it), or a result when it finished right away:
+ * an error, or a receive served from the pool.
+ */
+static void psipe_ops_run(struct psipe_dev *psipe_dev)
+{
+	/* ops->lock must be taken */
+	struct psipe_op *op;
+	long rv;
+
+	while ((op = psipe_ops_current(&psipe_dev->ops))) {
+		rv = op->ioctl_fn(psipe_dev, &op->dma);
+		if (!rv) {
+			op->t_start = ktime_get_ns();
+			psipe_lat_add(psipe_dev, PSIPE_LAT_QUEUE, op->t_submit,
+					op->t_start);
+			trace_psipe_op_start(psipe_dev, op);
+			break;
+		}
+		op->retval = rv;
+		psipe_ops_fini(psipe_dev, op);
+	}
+
+	if (!op)
+		wake_up_interruptible(&psipe_dev->ops.waitq);
+}
+
 psipe_handle_t psipe_ops_init(struct psipe_dev *psipe_dev, struct psipe_op *op)
 {
 	struct psipe_ops *ops = &psipe_dev->ops;
 	unsigned long flags;
 	long rv = 0;
-	int empty;
+	psipe_handle_t id;
 
 	if (!op)
 		return -EINVAL;
 
-	rv = psipe_dma_pin_pages(&op->dma);
-	if (rv < 0)
+	rv = psipe_dma_acquire(&op->dma);
+	if (rv < 0) {
+		kfree(op);
 		return rv;
+	}
 
 	//pr_info("psipe_dma_pin_pages - success\n");
 
 	spin_lock_irqsave(&ops->lock, flags);
-	empty = list_empty(&ops->active); 
 	list_add_tail(&op->list, &ops->active);
-	op->id = ops->next_id++;
+	id = op->id = ops->next_id++;
+	/* a receive learns the sender's at the irq, or from its pool slot */
+	op->dma.trace = (u64)psipe_dev->trace_salt << 32 | (u32)id;
+	op->t_submit = ktime_get_ns();
+	trace_psipe_op_submit(psipe_dev, op);
+	if (psipe_ops_current(ops) == op)
+		psipe_ops_run(psipe_dev);
 	spin_unlock_irqrestore(&ops->lock, flags);
 
-	if (empty) {
-		//pr_info("psipe_ops_init - running op %lu\n", op->id);
-		rv = op->ioctl_fn(psipe_dev, &op->dma);
-		if (rv < 0)
-			return rv;
-	}
-
-	return op->id;
+	return id;
 }
 
 struct psipe_op *psipe_ops_current(struct psipe_ops *ops)
@@ -93,26 +230,47 @@ struct psipe_op *psipe_ops_current(struct psipe_ops *ops)
 
 static void psipe_ops_fini(struct psipe_dev *psipe_dev, struct psipe_op *op)
 {
-	psipe_dma_unmap_pages(&op->dma, psipe_dev->pdev);
-	psipe_dma_unpin_pages(&op->dma);
+	if (op->dma.nmapped)
+		psipe_dma_unmap_pages(&op->dma, psipe_dev->pdev);
+	psipe_dma_release(&op->dma);
+	if (op->dma.pooled)
+		psipe_pool_repost(psipe_dev, op->dma.pool_slot);
+	trace_psipe_op_complete(psipe_dev, op);
 
 	/* ops->lock must be taken */
+	if (psipe_ops_anon(op)) {
+		list_del(&op->list);
+		psipe_ops_complete(op, op->retval);
+		kfree(op);
+		return;
+	}
 	list_move_tail(&op->list, &psipe_dev->ops.inactive);
 
+	/* before waking ioctl waiters, so only one side can see the last one */
+	if (psipe_uring_wake(op))
+		return;
+
 	op->flag = 1;
 	wake_up_all(&op->waitq);
 }
 
-long psipe_ops_wait(struct psipe_op *op)
+long psipe_ops_wait(struct psipe_dev *psipe_dev, struct psipe_op *op)
 {
 	long rv = -EINVAL;
+	bool slept;
 
 	if (!op)
 		goto out;
 
 	atomic_add(1, &op->nwaiting);
+	slept = !op->flag;
 	wait_event(op->waitq, op->flag == 1);
 	rv = op->retval;
+	/* a waiter that came late says nothing about wake-ups */
+	if (slept)
+		psipe_lat_add(psipe_dev, PSIPE_LAT_WAKE, op->t_irq,
+				ktime_get_ns());
+	trace_psipe_op_wake(psipe_dev, op);
 
 	if (!atomic_sub_return(1, &op->nwaiting)) {
 		list_del(&op->list);
@@ -123,6 +281,17 @@ out:
 	return rv;
 }
 
+/* a pair of clock readings, for a collector to put guest events on the host */
+static void psipe_ops_clock(struct psipe_dev *psipe_dev)
+{
+	u64 t0, t1, host;
+
+	t0 = ktime_get_ns();
+	host = readq(psipe_dev->bar.mmio + PSIPE_HW_BAR0_CLOCK);
+	t1 = ktime_get_ns();
+	trace_psipe_clock(psipe_dev, t0 + (t1 - t0) / 2, host, t1 - t0);
+}
+
 void psipe_ops_next(struct psipe_dev *psipe_dev)
 {
 	struct psipe_ops *ops = &psipe_dev->ops;
@@ -134,44 +303,51 @@ void psipe_ops_next(struct psipe_dev *psipe_dev)
 	op = psipe_ops_current(ops);
 	if (!op)
 		goto unlock;
+	/* bytes moved, as the device narrows receives to the sent length */
+	op->retval = ioread32(psipe_dev->bar.mmio + PSIPE_HW_BAR0_DMA_CFG_LEN);
+	op->t_irq = ktime_get_ns();
+	psipe_lat_add(psipe_dev, PSIPE_LAT_DEVICE, op->t_start, op->t_irq);
+	if (op->dma.mode == PSIPE_MODE_PASSIVE)
+		op->dma.trace = readq(psipe_dev->bar.mmio +
+				PSIPE_HW_BAR0_DMA_CFG_TRC);
+	trace_psipe_op_irq(psipe_dev, op);
+	if (trace_psipe_clock_enabled())
+		psipe_ops_clock(psipe_dev);
 	psipe_ops_fini(psipe_dev, op);
-	op = psipe_ops_current(ops);
-	if (op) {
-		//pr_info("psipe_ops_next - running op %lu\n", op->id);
-		op->retval = op->ioctl_fn(psipe_dev, &op->dma);
-	}
+	psipe_ops_run(psipe_dev);
 
 unlock:
 	spin_unlock_irqrestore(&ops->lock, flags);
 }
 
-struct psipe_op *psipe_ops_get(struct psipe_ops *ops, psipe_handle_t id)
+struct psipe_op *psipe_ops_find(struct psipe_ops *ops, psipe_handle_t id)
 {
-	struct psipe_op *cur_op, *op = NULL;
-	struct list_head *entry;
-	unsigned long flags;
+	/* ops->lock must be taken */
+	struct psipe_op *op;
 
 	if (id >= ops->next_id)
-		goto out;
+		return NULL;
 
-	spin_lock_irqsave(&ops->lock, flags);
-	list_for_each(entry, &ops->active) {
-		cur_op = list_entry(entry, struct psipe_op, list);
-		if (cur_op->id == id) {
-			op = cur_op;
-			goto unlock;
-		}
+	list_for_each_entry(op, &ops->active, list) {
+		if (op->id == id && !psipe_ops_anon(op))
+			return op;
 	}
-	list_for_each(entry, &ops->inactive) {
-		cur_op = list_entry(entry, struct psipe_op, list);
-		if (cur_op->id == id) {
-			op = cur_op;
-			goto unlock;
-		}
+	list_for_each_entry(op, &ops->inactive, list) {
+		if (op->id == id)
+			return op;
 	}
-unlock:
+	return NULL;
+}
+
+struct psipe_op *psipe_ops_get(struct psipe_ops *ops, psipe_handle_t id)
+{
+	struct psipe_op *op;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ops->lock, flags);
+	op = psipe_ops_find(ops, id);
 	spin_unlock_irqrestore(&ops->lock, flags);
-out:
+
 	return op;
 }
 
@@ -186,9 +362,13 @@ int psipe_ops_flush(struct psipe_dev *psipe_dev)
 	list_for_each_safe(entry, tmp, &ops->active) {
 		op = list_entry(entry, struct psipe_op, list);
 		if (!atomic_read(&op->nwaiting)) {
-			psipe_dma_unpin_pages(&op->dma);
-			psipe_dma_unmap_pages(&op->dma, psipe_dev->pdev);
+			trace_psipe_op_flush(psipe_dev, op);
+			if (op->dma.nmapped)
+				psipe_dma_unmap_pages(&op->dma, psipe_dev->pdev);
+			psipe_dma_release(&op->dma);
 			list_del(entry);
+			if (psipe_ops_anon(op))
+				psipe_ops_complete(op, -ECANCELED);
 			kfree(op);
 		} else {
 			pr_warn("psipe: op %lu still has waiters, skipping\n", op->id);
@@ -203,7 +383,20 @@ int psipe_ops_flush(struct psipe_dev *psipe_dev)
 			pr_warn("psipe: op %lu still has waiters, skipping\n", op->id);
 		}
 	}
+	wake_up_interruptible(&ops->waitq);
 	spin_unlock_irqrestore(&ops->lock, flags);
 
 	return 0;
 }
+
+bool psipe_ops_idle(struct psipe_ops *ops)
+{
+	unsigned long flags;
+	bool idle;
+
+	spin_lock_irqsave(&ops->lock, flags);
+	idle = list_empty(&ops->active);
+	spin_unlock_irqrestore(&ops->lock, flags);
+
+	return idle;
+}
@@ -0,0 +1,93 @@
+/* psipe_stats.c - Device counters in sysfs
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#include "hw/psipe_hw.h"
+#include "psipe_module.h"
+#include <linux/device.h>
+#include <linux/io.h>
+#include <linux/sysfs.h>
+
+/*
+ * One file per counter in the stats directory of the class device, read
+ * straight from the device. Writing to reset zeroes them all.
+ */
+
+struct psipe_stat_attr {
+	struct device_attribute attr;
+	int stat;
+};
+
+static ssize_t psipe_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct psipe_dev *psipe_dev = dev_get_drvdata(dev);
+	struct psipe_stat_attr *sa = container_of(attr, struct psipe_stat_attr,
+			attr);
+
+	return sysfs_emit(buf, "%llu\n", (unsigned long long)readq(
+				psipe_dev->bar.mmio + PSIPE_HW_BAR0_STAT(sa->stat)));
+}
+
+static ssize_t reset_store(struct device *dev, struct device_attribute *attr,
+		const char *buf, size_t count)
+{
+	struct psipe_dev *psipe_dev = dev_get_drvdata(dev);
+
+	writeq(0, psipe_dev->bar.mmio + PSIPE_HW_BAR0_STATS_CLEAR);
+	return count;
+}
+
+static DEVICE_ATTR_WO(reset);
+
+#define PSIPE_STAT_ATTR(_name, _stat) \
+	static struct psipe_stat_attr psipe_stat_##_name = { \
+		.attr = __ATTR(_name, 0444, psipe_stat_show, NULL), \
+		.stat = _stat, \
+	}
+
+PSIPE_STAT_ATTR(tx_bytes, PSIPE_HW_STAT_TX_BYTES);
+PSIPE_STAT_ATTR(rx_bytes, PSIPE_HW_STAT_RX_BYTES);
+PSIPE_STAT_ATTR(tx_pages, PSIPE_HW_STAT_TX_PAGES);
+PSIPE_STAT_ATTR(rx_pages, PSIPE_HW_STAT_RX_PAGES);
+PSIPE_STAT_ATTR(tx_runs, PSIPE_HW_STAT_TX_RUNS);
+PSIPE_STAT_ATTR(rx_runs, PSIPE_HW_STAT_RX_RUNS);
+PSIPE_STAT_ATTR(dma_ns, PSIPE_HW_STAT_DMA_NS);
+PSIPE_STAT_ATTR(net_ns, PSIPE_HW_STAT_NET_NS);
+PSIPE_STAT_ATTR(peer_ns, PSIPE_HW_STAT_PEER_NS);
+PSIPE_STAT_ATTR(run_min_ns, PSIPE_HW_STAT_RUN_MIN_NS);
+PSIPE_STAT_ATTR(run_max_ns, PSIPE_HW_STAT_RUN_MAX_NS);
+PSIPE_STAT_ATTR(tx_stalls, PSIPE_HW_STAT_TX_STALLS);
+PSIPE_STAT_ATTR(rx_stalls, PSIPE_HW_STAT_RX_STALLS);
+
+static struct attribute *psipe_stats_attrs[] = {
+	&psipe_stat_tx_bytes.attr.attr,
+	&psipe_stat_rx_bytes.attr.attr,
+	&psipe_stat_tx_pages.attr.attr,
+	&psipe_stat_rx_pages.attr.attr,
+	&psipe_stat_tx_runs.attr.attr,
+	&psipe_stat_rx_runs.attr.attr,
+	&psipe_stat_dma_ns.attr.attr,
+	&psipe_stat_net_ns.attr.attr,
+	&psipe_stat_peer_ns.attr.attr,
+	&psipe_stat_run_min_ns.attr.attr,
+	&psipe_stat_run_max_ns.attr.attr,
+	&psipe_stat_tx_stalls.attr.attr,
+	&psipe_stat_rx_stalls.attr.attr,
+	&dev_attr_reset.attr,
+	NULL,
+};
+
+static const struct attribute_group psipe_stats_group = {
+	.name = "stats",
+	.attrs = psipe_stats_attrs,
+};
+
+const struct attribute_group *psipe_stats_groups[] = {
+	&psipe_stats_group,
+	NULL,
+};
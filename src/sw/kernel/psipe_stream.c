@@ -0,0 +1,132 @@
+/* psipe_stream.c - psipe read/write interface
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#include "psipe_module.h"
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+
+/*
+ * write() is a SEND and read() a RECV, each queued like the ioctls and done
+ * on the caller's pages. Transfers keep their boundaries: a read returns one
+ * transfer, possibly short. A write may be short too, as only what fits in
+ * one op (the first segment of user memory) is taken.
+ *
+ * With O_NONBLOCK, read fails with -EAGAIN unless a transfer waits in the
+ * pool, and write unless the queue is idle. The op itself still runs to
+ * the end, as the device uses the caller's pages.
+ * Async kiocbs (aio, io_uring) are queued and end through ki_complete.
+ */
+
+static bool psipe_stream_ready(struct psipe_dev *psipe_dev, bool send)
+{
+	if (!psipe_ops_idle(&psipe_dev->ops))
+		return false;
+	return send || psipe_pool_ready(psipe_dev);
+}
+
+static long psipe_stream_wait(struct psipe_ops *ops, struct psipe_op *op)
+{
+	unsigned long flags;
+	long rv;
+
+	wait_event(op->waitq, op->flag == 1);
+
+	spin_lock_irqsave(&ops->lock, flags);
+	rv = op->retval;
+	if (!atomic_sub_return(1, &op->nwaiting)) {
+		list_del(&op->list);
+		kfree(op);
+	}
+	spin_unlock_irqrestore(&ops->lock, flags);
+
+	return rv;
+}
+
+static ssize_t psipe_stream_rw(struct kiocb *iocb, struct iov_iter *iter,
+		bool send)
+{
+	struct psipe_dev *psipe_dev = iocb->ki_filp->private_data;
+	bool async = !is_sync_kiocb(iocb);
+	struct psipe_op *op;
+	psipe_handle_t id;
+	size_t len;
+	long rv;
+
+	if (!iov_iter_count(iter))
+		return 0;
+	if (!async && (iocb->ki_filp->f_flags & O_NONBLOCK) &&
+			!psipe_stream_ready(psipe_dev, send))
+		return -EAGAIN;
+
+	op = psipe_ops_alloc();
+	if (!op)
+		return -ENOMEM;
+
+	rv = psipe_dma_extract_pages(&op->dma, iter);
+	if (rv < 0) {
+		kfree(op);
+		return rv;
+	}
+	len = op->dma.len;
+
+	op->dma.kind = PSIPE_DMA_ITER;
+	op->dma.mode = PSIPE_MODE_OFF;
+	op->ioctl_fn = send ? psipe_ioctl_send : psipe_ioctl_recv;
+	if (async)
+		op->iocb = iocb;
+	else
+		atomic_set(&op->nwaiting, 1); /* so a flush leaves it alone */
+
+	/* an async op may be over (and freed) before this returns */
+	id = psipe_ops_init(psipe_dev, op);
+	if ((long)id < 0) {
+		rv = (long)id;
+		goto revert;
+	}
+	if (async)
+		return -EIOCBQUEUED;
+
+	rv = psipe_stream_wait(&psipe_dev->ops, op);
+	if (rv < 0)
+		goto revert;
+
+	/* a receive takes no more than the peer sent */
+	iov_iter_revert(iter, len - rv);
+	return rv;
+
+revert:
+	iov_iter_revert(iter, len);
+	return rv;
+}
+
+ssize_t psipe_stream_read(struct kiocb *iocb, struct iov_iter *to)
+{
+	return psipe_stream_rw(iocb, to, false);
+}
+
+ssize_t psipe_stream_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	return psipe_stream_rw(iocb, from, true);
+}
+
+__poll_t psipe_stream_poll(struct file *fp, struct poll_table_struct *wait)
+{
+	struct psipe_dev *psipe_dev = fp->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(fp, &psipe_dev->pool.waitq, wait);
+	poll_wait(fp, &psipe_dev->ops.waitq, wait);
+
+	if (psipe_stream_ready(psipe_dev, false))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (psipe_stream_ready(psipe_dev, true))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
@@ -0,0 +1,96 @@
+/* psipe_trace.h - Tracepoints of the psipe ops queue
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM psipe
+
+#if !defined(_PSIPE_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _PSIPE_TRACE_H_
+
+#include "psipe_module.h"
+#include <linux/tracepoint.h>
+
+/*
+ * The life of an op: submit, start (the doorbell is rung), irq, complete,
+ * then wake for each ioctl waiter. Ops served without the device go from
+ * submit to complete, flush drops the ones left. dev is the chardev major.
+ */
+
+DECLARE_EVENT_CLASS(psipe_op_class,
+	TP_PROTO(struct psipe_dev *psipe_dev, struct psipe_op *op),
+	TP_ARGS(psipe_dev, op),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, dev)
+		__field(unsigned long, id)
+		__field(unsigned long, len)
+		__field(long, retval)
+		__field(int, mode)
+		__field(u64, trace)
+	),
+
+	TP_fast_assign(
+		__entry->dev = psipe_dev->major;
+		__entry->id = op->id;
+		__entry->len = op->dma.len;
+		__entry->retval = op->retval;
+		__entry->mode = op->dma.mode;
+		__entry->trace = op->dma.trace;
+	),
+
+	TP_printk("dev=%u id=%lu len=%lu retval=%ld mode=%d trace=0x%llx",
+		__entry->dev, __entry->id, __entry->len, __entry->retval,
+		__entry->mode, __entry->trace)
+);
+
+#define PSIPE_OP_EVENT(_name) \
+	DEFINE_EVENT(psipe_op_class, _name, \
+		TP_PROTO(struct psipe_dev *psipe_dev, struct psipe_op *op), \
+		TP_ARGS(psipe_dev, op))
+
+PSIPE_OP_EVENT(psipe_op_submit);
+PSIPE_OP_EVENT(psipe_op_start);
+PSIPE_OP_EVENT(psipe_op_irq);
+PSIPE_OP_EVENT(psipe_op_complete);
+PSIPE_OP_EVENT(psipe_op_wake);
+PSIPE_OP_EVENT(psipe_op_flush);
+
+/*
+ * guest is ktime_get_ns() halfway through reading host, the realtime clock
+ * of the host (PSIPE_HW_BAR0_CLOCK), which took window ns. Set trace_clock
+ * to mono for the event times to be on the guest clock.
+ */
+TRACE_EVENT(psipe_clock,
+	TP_PROTO(struct psipe_dev *psipe_dev, u64 guest, u64 host, u64 window),
+	TP_ARGS(psipe_dev, guest, host, window),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, dev)
+		__field(u64, guest)
+		__field(u64, host)
+		__field(u64, window)
+	),
+
+	TP_fast_assign(
+		__entry->dev = psipe_dev->major;
+		__entry->guest = guest;
+		__entry->host = host;
+		__entry->window = window;
+	),
+
+	TP_printk("dev=%u guest=%llu host=%llu window=%llu", __entry->dev,
+		__entry->guest, __entry->host, __entry->window)
+);
+
+#endif /* _PSIPE_TRACE_H_ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE psipe_trace
+#include <trace/define_trace.h>
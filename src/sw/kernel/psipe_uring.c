@@ -0,0 +1,152 @@
+/* psipe_uring.c - psipe operations submitted through io_uring
+ *
+ * Copyright (c) 2025 David Cañadas López <david.canadas@estudiantat.upc.edu>
+ *
+ * SPDX-Liscense-Identifier: GPL-2.0
+ *
+ */
+
+#include "psipe_module.h"
+#include <linux/io_uring.h>
+
+/*
+ * IORING_OP_URING_CMD with cmd_op set to one of the PSIPE_IOCTL_* numbers.
+ * The sqe command area holds what the ioctl argument points to (the handle
+ * itself for WAIT). It is 16 bytes in a normal sqe, which fits struct
+ * psipe_data; the buffer variants need a ring set up with SQE128.
+ * The cqe res is what WAIT would return for the op: bytes moved or -errno.
+ */
+
+#define PSIPE_URING_CMD_SIZE 16
+#define PSIPE_URING_CMD_SIZE128 80
+
+/* kept in io_uring_cmd->pdu while the command is in flight */
+struct psipe_uring_pdu {
+	struct list_head entry; // in op->uwaiters, for WAIT
+	struct io_uring_cmd *ioucmd;
+	long retval;
+};
+
+static inline struct psipe_uring_pdu *psipe_uring_pdu(
+		struct io_uring_cmd *ioucmd)
+{
+	BUILD_BUG_ON(sizeof(struct psipe_uring_pdu) >
+			sizeof_field(struct io_uring_cmd, pdu));
+	return (struct psipe_uring_pdu *)ioucmd->pdu;
+}
+
+static void psipe_uring_task_cb(struct io_uring_cmd *ioucmd,
+		unsigned int issue_flags)
+{
+	io_uring_cmd_done(ioucmd, psipe_uring_pdu(ioucmd)->retval, 0,
+			issue_flags);
+}
+
+/* Ops end in the irq handler, so the cqe is posted from task context. */
+void psipe_uring_complete(struct io_uring_cmd *ioucmd, long rv)
+{
+	struct psipe_uring_pdu *pdu = psipe_uring_pdu(ioucmd);
+
+	pdu->ioucmd = ioucmd;
+	pdu->retval = rv;
+	io_uring_cmd_complete_in_task(ioucmd, psipe_uring_task_cb);
+}
+
+/*
+ * Complete the io_uring waits on a finished op. Like the last ioctl waiter,
+ * the last of them frees the op. Returns true if it did.
+ */
+bool psipe_uring_wake(struct psipe_op *op)
+{
+	/* ops->lock must be taken */
+	struct psipe_uring_pdu *pdu, *tmp;
+
+	list_for_each_entry_safe(pdu, tmp, &op->uwaiters, entry) {
+		list_del(&pdu->entry);
+		psipe_uring_complete(pdu->ioucmd, op->retval);
+		if (!atomic_sub_return(1, &op->nwaiting)) {
+			list_del(&op->list);
+			kfree(op);
+			return true;
+		}
+	}
+	return false;
+}
+
+static int psipe_uring_wait(struct psipe_dev *psipe_dev,
+		struct io_uring_cmd *ioucmd, psipe_handle_t id)
+{
+	struct psipe_ops *ops = &psipe_dev->ops;
+	struct psipe_uring_pdu *pdu = psipe_uring_pdu(ioucmd);
+	struct psipe_op *op;
+	unsigned long flags;
+	int rv = -EIOCBQUEUED;
+
+	spin_lock_irqsave(&ops->lock, flags);
+	op = psipe_ops_find(ops, id);
+	if (!op) {
+		rv = -EINVAL;
+	} else if (op->flag) {
+		rv = op->retval;
+		if (!atomic_read(&op->nwaiting)) {
+			list_del(&op->list);
+			kfree(op);
+		}
+	} else {
+		pdu->ioucmd = ioucmd;
+		atomic_add(1, &op->nwaiting);
+		list_add_tail(&pdu->entry, &op->uwaiters);
+	}
+	spin_unlock_irqrestore(&ops->lock, flags);
+
+	return rv;
+}
+
+/*
+ * Pinning user pages and importing dma-bufs may block, those are issued
+ * again from io-wq. Driver buffers are only looked up.
+ */
+static bool psipe_uring_may_block(unsigned int cmd)
+{
+	return cmd != PSIPE_IOCTL_SEND_BUF && cmd != PSIPE_IOCTL_RECV_BUF;
+}
+
+int psipe_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct psipe_dev *psipe_dev = ioucmd->file->private_data;
+	const void *payload = io_uring_sqe_cmd(ioucmd->sqe);
+	unsigned int cmd = ioucmd->cmd_op;
+	union psipe_op_args args;
+	struct psipe_op *op;
+	psipe_handle_t id;
+	size_t size, room;
+
+	room = issue_flags & IO_URING_F_SQE128 ?
+		PSIPE_URING_CMD_SIZE128 : PSIPE_URING_CMD_SIZE;
+
+	if (cmd == PSIPE_IOCTL_WAIT) {
+		memcpy(&id, payload, sizeof(id));
+		return psipe_uring_wait(psipe_dev, ioucmd, id);
+	}
+
+	size = psipe_ops_args_size(cmd);
+	if (!size)
+		return -ENOTTY;
+	if (size > room)
+		return -EINVAL;
+	if ((issue_flags & IO_URING_F_NONBLOCK) && psipe_uring_may_block(cmd))
+		return -EAGAIN;
+
+	memcpy(&args, payload, size);
+	op = psipe_ops_new(psipe_dev, cmd, &args);
+	if (!op)
+		return -EINVAL;
+	op->ucmd = ioucmd;
+
+	/* the op may be over (and freed) before this returns */
+	id = psipe_ops_init(psipe_dev, op);
+	if ((long)id < 0)
+		return (long)id;
+
+	return -EIOCBQUEUED;
+}
@@ -0,0 +1,175 @@
+/* chiplet-bench.c - Chiplet end of master-bench
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include "psipe_coll.h"
+#include "psipe_bench.h"
+
+struct psipe_devices *psipe_devs;
+
+static void sighup_handler(int signo)
+{
+	return;
+}
+
+static void *sbuf, *rbuf;
+static size_t buf_cap;
+static uint64_t sends;
+
+// buffers only grow, the sweep goes up
+static int bench_bufs(size_t len)
+{
+	void *s, *r;
+	int err;
+
+	if (len <= buf_cap)
+		return 0;
+
+	err = posix_memalign(&s, 4096, len);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	err = posix_memalign(&r, 4096, len);
+	if (err) {
+		free(s);
+		errno = err;
+		return -1;
+	}
+	psipe_bench_fill(s, len);
+	memset(r, 0, len);
+
+	free(sbuf);
+	free(rbuf);
+	sbuf = s;
+	rbuf = r;
+	buf_cap = len;
+	return 0;
+}
+
+static int bench_ack(int fd)
+{
+	uint64_t ack = 0;
+
+	return psipe_coll_send(fd, &ack, sizeof(ack));
+}
+
+static int bench_window(int fd, size_t len, int window)
+{
+	long ids[window];
+	int n, rv = 0;
+
+	for (n = 0; n < window; ++n) {
+		ids[n] = psipe_recv(fd, rbuf, len);
+		if (ids[n] < 0) {
+			rv = -1;
+			break;
+		}
+	}
+
+	for (int i = 0; i < n; ++i) {
+		if (psipe_wait(fd, ids[i]) < 0)
+			rv = -1;
+	}
+	return rv;
+}
+
+static int run_one(int fd, const struct psipe_bench_cmd *cmd)
+{
+	switch (cmd->test) {
+	case PSIPE_BENCH_BW:
+	case PSIPE_BENCH_MULTI:
+		return psipe_coll_recv(fd, rbuf, cmd->len);
+	case PSIPE_BENCH_BIBW:
+		psipe_bench_stamp(sbuf, cmd->len, ++sends);
+		return psipe_coll_sendrecv(fd, sbuf, rbuf, cmd->len);
+	case PSIPE_BENCH_LAT: // echoes what the master stamped
+		if (psipe_coll_recv(fd, rbuf, cmd->len) < 0)
+			return -1;
+		return psipe_coll_send(fd, rbuf, cmd->len);
+	case PSIPE_BENCH_RATE:
+		return bench_window(fd, cmd->len, cmd->window);
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+static int run_point(int fd, const struct psipe_bench_cmd *cmd)
+{
+	bool acks = cmd->test != PSIPE_BENCH_LAT;
+
+	if (bench_bufs(cmd->len) < 0)
+		return -1;
+
+	for (long i = 0; i < cmd->warmup; ++i) {
+		if (run_one(fd, cmd) < 0)
+			return -1;
+	}
+	if (acks && bench_ack(fd) < 0)
+		return -1;
+
+	for (long i = 0; i < cmd->iters; ++i) {
+		if (run_one(fd, cmd) < 0)
+			return -1;
+	}
+	if (acks && bench_ack(fd) < 0)
+		return -1;
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sigaction sa;
+	struct psipe_bench_cmd cmd;
+	int fd, points = 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighup_handler;
+	sigaction(SIGHUP, &sa, NULL);
+
+	if (argc > 1) {
+		printf("Us: %s\n", argv[0]);
+		exit(1);
+	}
+
+	if (psipe_open_devs() < 0)
+		exit(1);
+	fd = psipe_devs->fds[0];
+
+	/* every point of every sweep, until master-bench -x */
+	for (;;) {
+		if (psipe_coll_recv(fd, &cmd, sizeof(cmd)) < 0) {
+			perror("psipe_coll_recv(cmd)");
+			exit(1);
+		}
+		if (cmd.test == PSIPE_BENCH_END)
+			break;
+		if (!cmd.active)
+			continue;
+
+		if (run_point(fd, &cmd) < 0) {
+			fprintf(stderr, "test %d, %lu bytes: %s\n", cmd.test,
+					(unsigned long)cmd.len, strerror(errno));
+			exit(1);
+		}
+		++points;
+	}
+
+	printf("%d points done\n", points);
+
+	psipe_close_devs();
+	free(sbuf);
+	free(rbuf);
+
+	return 0;
+}
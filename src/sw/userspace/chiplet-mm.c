@@ -7,7 +7,11 @@
 #include <malloc.h>
 #include <math.h>
 #include <errno.h>
-#include "psipe_wrappers.h"
+#include "psipe_coll.h"
+#include "psipe_gemm.h"
+#include "psipe_sched.h"
+#include "psipe_mm.h"
+#include "psipe_cache.h"
 #include <signal.h>
 
 static void sighup_handler(int signo)
@@ -36,129 +40,116 @@ static void matmul_func(int sz_n, int sz_t, int sz_m,
 }
 */
 
-int main(int argc, char *argv[])
+static int run_job(int fd, struct psipe_sched *sched, struct psipe_mm_ws *ws,
+		const struct psipe_mm_args *args)
 {
-	struct sigaction sa;
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = sighup_handler;
-	sigaction(SIGHUP, &sa, NULL);
-
-	void *pt_A = NULL, *pt_B = NULL, *pt_C = NULL;
-	size_t sz_A, sz_B, sz_C;
-	int sz_n, sz_t, sz_m, g_len, g_ofs, fd;
-	psipe_handle_t id;
+	struct psipe_mm_plan plan;
+	double *pt_A, *pt_B, *pt_C;
+	int rv;
+
+	if (args->layout == PSIPE_MM_DYN) {
+		printf("sz_n=%d, sz_t=%d, sz_m=%d, dynamic, gemm=%s, threads=%d\n",
+				args->sz_n, args->sz_t, args->sz_m,
+				psipe_gemm_kernel()->name,
+				psipe_sched_nthreads(sched));
+
+		/* B arrives whole, then rows of A and C as asked for */
+		return psipe_mm_dyn_chiplet(fd, sched, ws, args);
+	}
 
-	psipe_open_devs();
-	fd = psipe_devs->fds[0];
+	/* only the rows of A and columns of B this part needs */
+	if (psipe_mm_plan_init(&plan, args) < 0)
+		return -1;
 
-	id = psipe_recv_args(fd, &sz_n, &sz_t, &sz_m, &g_len, &g_ofs);
-	if (id < 0) {
-		perror("psipe_recv_args");
-		exit(1);
-	}
+	printf("sz_n=%d, sz_t=%d, sz_m=%d, rows=%d+%d, cols=%d+%d, g_len=%ld, gemm=%s, threads=%d\n",
+			plan.sz_n, plan.sz_t, plan.sz_m, plan.row0, plan.nrows,
+			plan.col0, plan.ncols, plan.g_len,
+			psipe_gemm_kernel()->name, psipe_sched_nthreads(sched));
 
-	if (psipe_wait(fd, id) < 0) {
-		perror("psipe_wait(args)");
-		exit(1);
+	/* A and B may still be here from the last job */
+	pt_C = psipe_mm_ws_get(ws, PSIPE_MM_WS_C, plan.g_len * sizeof(TYPE));
+	if (!pt_C || psipe_mm_accept(fd, ws, &plan, &pt_A, &pt_B) < 0) {
+		psipe_mm_plan_fini(&plan);
+		return -1;
 	}
+	if (plan.have_a || plan.have_b)
+		printf("resident:%s%s\n", plan.have_a ? " A" : "",
+				plan.have_b ? " B" : "");
+
+	/* C arrives first, then A and B in blocks, and C goes back as its
+	 * blocks are done */
+	rv = psipe_mm_chiplet(fd, sched, &plan, pt_A, pt_B, pt_C);
+	if (!rv)
+		psipe_mm_landed(ws, &plan);
+	psipe_mm_plan_fini(&plan);
+	return rv;
+}
 
-	printf("sz_n=%d, sz_t=%d, sz_m=%d, g_len=%d, g_ofs=%d\n",
-			sz_n, sz_t, sz_m, g_len, g_ofs);
-
-	sz_A = sz_n * sz_t * sizeof(TYPE);
-	sz_B = sz_t * sz_m * sizeof(TYPE);
-	sz_C = g_len * sizeof(TYPE);
+int main(int argc, char *argv[])
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighup_handler;
+	sigaction(SIGHUP, &sa, NULL);
 
-	if (posix_memalign((void *)&pt_A, sizeof(TYPE), sz_A) < 0) {
-		perror("posix_memalign(A)");
-		exit(1);
-	}
-	if (posix_memalign((void *)&pt_B, sizeof(TYPE), sz_B) < 0) {
-		perror("posix_memalign(B)");
-		exit(1);
-	}
-	if (posix_memalign((void *)&pt_C, sizeof(TYPE), sz_C) < 0) {
-		perror("posix_memalign(C)");
-		exit(1);
+	int fd, serve = 0, jobs = 0;
+	struct psipe_mm_args args;
+	int nthreads = psipe_sched_threads();
+	struct psipe_sched *sched;
+	struct psipe_mm_ws ws = { 0 };
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+			nthreads = strtol(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-d")) {
+			serve = 1;
+		} else {
+			printf ("Us: %s [-d] [-j threads]\n", argv[0]);
+			exit(1);
+		}
 	}
 
-	id = psipe_recv(fd, pt_A, sz_A);
-	if ((long)id < 0) {
-		perror("psipe_recv(A)");
+	sched = psipe_sched_create(nthreads);
+	if (!sched) {
+		perror("psipe_sched_create");
 		exit(1);
 	}
-#if WAIT_ALL_OPS
-	if (psipe_wait(fd, id) < 0) {
-		perror("psipe_wait(A)");
+	ws.cache = psipe_cache_create();
+	if (!ws.cache) {
+		perror("psipe_cache_create");
 		exit(1);
 	}
-#endif
 
-	id = psipe_recv(fd, pt_B, sz_B);
-	if ((long)id < 0) {
-		perror("psipe_recv(B)");
-		exit(1);
-	}
-#if WAIT_ALL_OPS
-	if (psipe_wait(fd, id) < 0) {
-		perror("psipe_wait(B)");
-		exit(1);
-	}
-#endif
+	psipe_open_devs();
+	fd = psipe_devs->fds[0];
 
-	id = psipe_recv(fd, pt_C, sz_C);
-	if ((long)id < 0) {
-		perror("psipe_recv(C)");
-		exit(1);
-	}
-	if (psipe_wait(fd, id) < 0) {
-		perror("psipe_wait(C)");
-		exit(1);
-	}
+	/* as a daemon, the device, threads and buffers stay for the next job
+	 * until one of no rows (master-mm -x) */
+	do {
+		if (psipe_coll_recv(fd, &args, sizeof(args)) < 0) {
+			perror("psipe_coll_recv(args)");
+			exit(1);
+		}
+		if (!args.sz_n)
+			break;
 
-	/* FUNCTION START -------------------------------------- */
-	TYPE *A = (TYPE *)pt_A, *B = (TYPE *)pt_B, *C = (TYPE *)pt_C;
-	for (int g = g_ofs; g < g_ofs+g_len; g++) {
-		int i = g / sz_m;
-		int j = g % sz_m;
-		for (int k=0; k < sz_t; k++) {
-			/*
-			int a_idx = i*sz_t+k;
-			int b_idx = k*sz_m+j;
-			int c_idx = g-g_ofs;
-
-			if (a_idx < 0 || a_idx >= sz_n * sz_t)
-				printf("incorrect A index for g=%d, i=%d, k=%d\n", g, i, k);
-			else if (b_idx < 0 || b_idx >= sz_t * sz_m)
-				printf("incorrect B index for g=%d, j=%d, k=%d\n", g, j, k);
-			else if (c_idx < 0 || c_idx >= g_len)
-				printf("incorrect C index for g=%d\n", g);
-			else {
-			*/
-				TYPE a = A[i*sz_t+k];
-				TYPE b = B[k*sz_m+j];
-				C[g-g_ofs] += a * b;
-				//C[g-g_ofs] += A[i*sz_t+k] * B[k*sz_m+j];
-			//}
+		/* FUNCTION START -------------------------------------- */
+		if (run_job(fd, sched, &ws, &args) < 0) {
+			perror("psipe_mm_chiplet");
+			exit(1);
 		}
-	}
-	/* FUNCTION END ---------------------------------------- */
+		/* FUNCTION END ---------------------------------------- */
 
-	id = psipe_send(fd, pt_C, sz_C);
-	if ((long)id < 0) {
-		perror("psipe_send(C)");
-		exit(1);
-	}
-	if (psipe_wait(fd, id) < 0) {
-		perror("psipe_wait(C)");
-		exit(1);
-	}
+		psipe_flush(fd);
+		++jobs;
+	} while (serve);
+
+	if (serve)
+		printf("%d jobs done\n", jobs);
 
-	psipe_flush(fd);
 	psipe_close_devs();
-	free(pt_A);
-	free(pt_B);
-	free(pt_C);
+	psipe_sched_destroy(sched);
+	psipe_mm_ws_fini(&ws);
 
 	return 0;
 }
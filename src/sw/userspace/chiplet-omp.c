@@ -0,0 +1,307 @@
+/* chiplet-omp.c - Chiplet end of the psipe libomptarget plugin
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include "psipe_coll.h"
+#include "psipe_omp.h"
+
+/*
+ * Serves the commands of psipe_omp.c on the first device, session after
+ * session. The images and memory of a session go at its PSIPE_OMP_END.
+ * Whoever drives the other end runs code here, as with any offload target.
+ */
+
+typedef uint64_t u64;
+
+struct psipe_devices *psipe_devs;
+
+static void sighup_handler(int signo)
+{
+	return;
+}
+
+// what a session has loaded and allocated
+struct session {
+	void **images;
+	int nimages;
+	void **mem;
+	int nmem;
+};
+
+static int session_add(void ***list, int *n, void *p)
+{
+	void **l = realloc(*list, (*n + 1) * sizeof(*l));
+
+	if (!l)
+		return -1;
+	l[(*n)++] = p;
+	*list = l;
+	return 0;
+}
+
+static void session_end(struct session *s)
+{
+	for (int i = 0; i < s->nmem; ++i)
+		free(s->mem[i]);
+	for (int i = 0; i < s->nimages; ++i)
+		dlclose(s->images[i]);
+	free(s->mem);
+	free(s->images);
+	memset(s, 0, sizeof(*s));
+}
+
+// take len bytes that have nowhere to go, to stay in step
+static int drain(int fd, size_t len)
+{
+	static char scratch[PSIPE_COLL_CHUNK];
+	size_t c;
+
+	for (size_t pos = 0; pos < len; pos += c) {
+		c = len - pos < sizeof(scratch) ? len - pos : sizeof(scratch);
+		if (psipe_coll_recv(fd, scratch, c) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int load(int fd, struct session *s, size_t len)
+{
+	char path[64];
+	void *image, *h;
+	int mfd, rv = -1;
+
+	image = malloc(len ? len : 1);
+	if (!image) {
+		if (drain(fd, len) < 0)
+			goto recv_failed;
+		return -ENOMEM;
+	}
+	if (psipe_coll_recv(fd, image, len) < 0)
+		goto recv_failed;
+
+	/* dlopen wants a file */
+	mfd = memfd_create("psipe-omp", MFD_CLOEXEC);
+	if (mfd < 0) {
+		rv = -errno;
+		goto free_image;
+	}
+	if (write(mfd, image, len) != (ssize_t)len) {
+		rv = -ENOSPC;
+		goto close_mfd;
+	}
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", mfd);
+	h = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!h) {
+		fprintf(stderr, "dlopen: %s\n", dlerror());
+		rv = -ENOEXEC;
+		goto close_mfd;
+	}
+	if (session_add(&s->images, &s->nimages, h) < 0) {
+		dlclose(h);
+		rv = -ENOMEM;
+		goto close_mfd;
+	}
+	rv = 0;
+
+close_mfd:
+	close(mfd);
+free_image:
+	free(image);
+	return rv;
+
+recv_failed:
+	perror("psipe_coll_recv(image)");
+	exit(1);
+}
+
+static void run(u64 addr, int n, const u64 *a)
+{
+	void *fn = (void *)(uintptr_t)addr;
+
+	switch (n) {
+	case 0:
+		((void (*)(void))fn)();
+		break;
+	case 1:
+		((void (*)(u64))fn)(a[0]);
+		break;
+	case 2:
+		((void (*)(u64, u64))fn)(a[0], a[1]);
+		break;
+	case 3:
+		((void (*)(u64, u64, u64))fn)(a[0], a[1], a[2]);
+		break;
+	case 4:
+		((void (*)(u64, u64, u64, u64))fn)(a[0], a[1], a[2], a[3]);
+		break;
+	case 5:
+		((void (*)(u64, u64, u64, u64, u64))fn)(a[0], a[1], a[2], a[3],
+			a[4]);
+		break;
+	case 6:
+		((void (*)(u64, u64, u64, u64, u64, u64))fn)(a[0], a[1], a[2],
+			a[3], a[4], a[5]);
+		break;
+	case 7:
+		((void (*)(u64, u64, u64, u64, u64, u64, u64))fn)(a[0], a[1],
+			a[2], a[3], a[4], a[5], a[6]);
+		break;
+	case 8:
+		((void (*)(u64, u64, u64, u64, u64, u64, u64, u64))fn)(a[0],
+			a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+		break;
+	case 9:
+		((void (*)(u64, u64, u64, u64, u64, u64, u64, u64,
+			u64))fn)(a[0], a[1], a[2], a[3], a[4], a[5], a[6],
+			a[7], a[8]);
+		break;
+	case 10:
+		((void (*)(u64, u64, u64, u64, u64, u64, u64, u64, u64,
+			u64))fn)(a[0], a[1], a[2], a[3], a[4], a[5], a[6],
+			a[7], a[8], a[9]);
+		break;
+	case 11:
+		((void (*)(u64, u64, u64, u64, u64, u64, u64, u64, u64, u64,
+			u64))fn)(a[0], a[1], a[2], a[3], a[4], a[5], a[6],
+			a[7], a[8], a[9], a[10]);
+		break;
+	case 12:
+		((void (*)(u64, u64, u64, u64, u64, u64, u64, u64, u64, u64,
+			u64, u64))fn)(a[0], a[1], a[2], a[3], a[4], a[5], a[6],
+			a[7], a[8], a[9], a[10], a[11]);
+		break;
+	case 13:
+		((void (*)(u64, u64, u64, u64, u64, u64, u64, u64, u64, u64,
+			u64, u64, u64))fn)(a[0], a[1], a[2], a[3], a[4], a[5],
+			a[6], a[7], a[8], a[9], a[10], a[11], a[12]);
+		break;
+	case 14:
+		((void (*)(u64, u64, u64, u64, u64, u64, u64, u64, u64, u64,
+			u64, u64, u64, u64))fn)(a[0], a[1], a[2], a[3], a[4],
+			a[5], a[6], a[7], a[8], a[9], a[10], a[11], a[12],
+			a[13]);
+		break;
+	case 15:
+		((void (*)(u64, u64, u64, u64, u64, u64, u64, u64, u64, u64,
+			u64, u64, u64, u64, u64))fn)(a[0], a[1], a[2], a[3],
+			a[4], a[5], a[6], a[7], a[8], a[9], a[10], a[11],
+			a[12], a[13], a[14]);
+		break;
+	case 16:
+		((void (*)(u64, u64, u64, u64, u64, u64, u64, u64, u64, u64,
+			u64, u64, u64, u64, u64, u64))fn)(a[0], a[1], a[2],
+			a[3], a[4], a[5], a[6], a[7], a[8], a[9], a[10], a[11],
+			a[12], a[13], a[14], a[15]);
+		break;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct sigaction sa;
+	struct psipe_omp_cmd cmd;
+	struct psipe_omp_reply reply;
+	struct session s = { 0 };
+	int fd, send_reply;
+	void *p;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighup_handler;
+	sigaction(SIGHUP, &sa, NULL);
+
+	if (psipe_open_devs() < 0)
+		exit(1);
+	fd = psipe_devs->fds[0];
+
+	for (;;) {
+		if (psipe_coll_recv(fd, &cmd, sizeof(cmd)) < 0) {
+			perror("psipe_coll_recv(cmd)");
+			exit(1);
+		}
+		memset(&reply, 0, sizeof(reply));
+		send_reply = 1;
+
+		switch (cmd.op) {
+		case PSIPE_OMP_LOAD:
+			reply.rv = load(fd, &s, cmd.len);
+			break;
+		case PSIPE_OMP_SYM:
+			cmd.name[PSIPE_OMP_NAME - 1] = 0;
+			p = s.nimages ? dlsym(s.images[s.nimages - 1],
+					cmd.name) : NULL;
+			reply.addr = (uintptr_t)p;
+			reply.rv = p ? 0 : -ENOENT;
+			break;
+		case PSIPE_OMP_ALLOC:
+			p = malloc(cmd.len ? cmd.len : 1);
+			if (p && session_add(&s.mem, &s.nmem, p) < 0) {
+				free(p);
+				p = NULL;
+			}
+			reply.addr = (uintptr_t)p;
+			reply.rv = p ? 0 : -ENOMEM;
+			break;
+		case PSIPE_OMP_FREE:
+			for (int i = 0; i < s.nmem; ++i) {
+				if ((uintptr_t)s.mem[i] == cmd.addr) {
+					free(s.mem[i]);
+					s.mem[i] = s.mem[--s.nmem];
+					break;
+				}
+			}
+			send_reply = 0;
+			break;
+		case PSIPE_OMP_SUBMIT:
+			if (psipe_coll_recv(fd, (void *)(uintptr_t)cmd.addr,
+						cmd.len) < 0) {
+				perror("psipe_coll_recv(data)");
+				exit(1);
+			}
+			send_reply = 0;
+			break;
+		case PSIPE_OMP_RETRIEVE:
+			if (psipe_coll_send(fd, (void *)(uintptr_t)cmd.addr,
+						cmd.len) < 0) {
+				perror("psipe_coll_send(data)");
+				exit(1);
+			}
+			send_reply = 0;
+			break;
+		case PSIPE_OMP_RUN:
+			if (cmd.nargs < 0 || cmd.nargs > PSIPE_OMP_MAX_ARGS) {
+				reply.rv = -EINVAL;
+				break;
+			}
+			run(cmd.addr, cmd.nargs, cmd.args);
+			break;
+		case PSIPE_OMP_END:
+			session_end(&s);
+			send_reply = 0;
+			break;
+		default:
+			fprintf(stderr, "unknown command %d\n", cmd.op);
+			exit(1);
+		}
+
+		if (send_reply && psipe_coll_send(fd, &reply,
+					sizeof(reply)) < 0) {
+			perror("psipe_coll_send(reply)");
+			exit(1);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,540 @@
+/* master-bench.c - Bandwidth, latency and message rate of the psipe devices
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include "psipe_coll.h"
+#include "psipe_bench.h"
+
+struct psipe_devices *psipe_devs;
+
+static void sighup_handler(int signo)
+{
+	return;
+}
+
+// bytes moved per point at most, iterations are cut to fit
+#define BENCH_VOLUME (256UL << 20)
+// ping-pong stops here, the sweep of the others goes on
+#define BENCH_LAT_MAX (1UL << 20)
+// latency histogram, bucket b takes [2^b, 2^(b+1)) us, the first all below 2
+#define BENCH_HIST 24
+
+enum bench_fmt {
+	BENCH_TEXT,
+	BENCH_CSV,
+	BENCH_JSON,
+};
+
+static const char *bench_names[PSIPE_BENCH_NUM] = {
+	[PSIPE_BENCH_BW] = "bw",
+	[PSIPE_BENCH_BIBW] = "bibw",
+	[PSIPE_BENCH_LAT] = "lat",
+	[PSIPE_BENCH_RATE] = "rate",
+	[PSIPE_BENCH_MULTI] = "multi",
+};
+
+struct bench_opts {
+	unsigned tests; // bit per test
+	enum bench_fmt fmt;
+	int dev;
+	size_t min, max;
+	long iters;
+	int warmup;
+	int window;
+};
+
+struct bench_result {
+	int test;
+	int devs;
+	size_t len;
+	long iters;
+	double secs;
+	double mbps;
+	double rate;
+	double lat[6]; // us: min, avg, p50, p90, p99, max
+	long hist[BENCH_HIST];
+};
+
+static void *sbuf, *rbuf;
+static size_t sbuf_len;
+static uint64_t sends;
+static int npoints;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+// 4096, 64K, 1M, 2G
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t v = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'G': case 'g':
+		v <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		v <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		v <<= 10;
+		break;
+	}
+	return v;
+}
+
+static unsigned parse_tests(char *s)
+{
+	unsigned tests = 0;
+	char *tok, *save;
+	int t;
+
+	for (tok = strtok_r(s, ",", &save); tok;
+			tok = strtok_r(NULL, ",", &save)) {
+		for (t = PSIPE_BENCH_BW; t < PSIPE_BENCH_NUM; ++t) {
+			if (!strcmp(tok, bench_names[t]))
+				break;
+		}
+		if (t == PSIPE_BENCH_NUM) {
+			fprintf(stderr, "Invalid test (%s)\n", tok);
+			exit(1);
+		}
+		tests |= 1u << t;
+	}
+	return tests;
+}
+
+/* ============================================================================
+ * Link
+ * ============================================================================
+ */
+
+// the command to every device, the ones not in the test just take it
+static int bench_post(const struct psipe_bench_cmd *cmd, int dev)
+{
+	int num = psipe_num_devs();
+	struct psipe_bench_cmd cmds[num];
+	size_t counts[num], displs[num];
+
+	for (int i = 0; i < num; ++i) {
+		cmds[i] = *cmd;
+		cmds[i].active = cmd->test == PSIPE_BENCH_MULTI ||
+			cmd->test == PSIPE_BENCH_END || i == dev;
+		counts[i] = 1;
+		displs[i] = i;
+	}
+	return psipe_scatterv(cmds, counts, displs, sizeof(*cmds));
+}
+
+static int bench_sync(int fd, bool all)
+{
+	int num = psipe_num_devs();
+	uint64_t acks[num];
+	size_t counts[num], displs[num];
+
+	if (!all)
+		return psipe_coll_recv(fd, acks, sizeof(*acks));
+
+	for (int i = 0; i < num; ++i) {
+		counts[i] = 1;
+		displs[i] = i;
+	}
+	return psipe_gatherv(acks, counts, displs, sizeof(*acks));
+}
+
+static int bench_window(int fd, size_t len, int window)
+{
+	long ids[window];
+	size_t per = sbuf_len / len; // messages with a part of sbuf of their own
+	int n, rv = 0;
+
+	psipe_bench_stamp(sbuf, len * ((size_t)window < per ? window : per),
+			++sends);
+	for (n = 0; n < window; ++n) {
+		ids[n] = psipe_send(fd, (char *)sbuf + n % per * len, len);
+		if (ids[n] < 0) {
+			rv = -1;
+			break;
+		}
+	}
+
+	for (int i = 0; i < n; ++i) {
+		if (psipe_wait(fd, ids[i]) < 0)
+			rv = -1;
+	}
+	return rv;
+}
+
+static int bench_one(int fd, const struct psipe_bench_cmd *cmd)
+{
+	int num = psipe_num_devs();
+	size_t counts[num], displs[num];
+
+	if (cmd->test != PSIPE_BENCH_RATE)
+		psipe_bench_stamp(sbuf, cmd->len, ++sends);
+	switch (cmd->test) {
+	case PSIPE_BENCH_BW:
+		return psipe_coll_send(fd, sbuf, cmd->len);
+	case PSIPE_BENCH_BIBW:
+		return psipe_coll_sendrecv(fd, sbuf, rbuf, cmd->len);
+	case PSIPE_BENCH_LAT:
+		if (psipe_coll_send(fd, sbuf, cmd->len) < 0)
+			return -1;
+		return psipe_coll_recv(fd, rbuf, cmd->len);
+	case PSIPE_BENCH_RATE:
+		return bench_window(fd, cmd->len, cmd->window);
+	case PSIPE_BENCH_MULTI:
+		/* the same bytes to every device, chunks posted round them */
+		for (int i = 0; i < num; ++i) {
+			counts[i] = cmd->len;
+			displs[i] = 0;
+		}
+		return psipe_scatterv(sbuf, counts, displs, 1);
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+/* ============================================================================
+ * Points
+ * ============================================================================
+ */
+
+static void bench_lat_stats(struct bench_result *res, double *us, long n)
+{
+	double sum = 0;
+	int b;
+
+	qsort(us, n, sizeof(*us), cmp_double);
+	for (long i = 0; i < n; ++i) {
+		sum += us[i];
+		for (b = 0; b < BENCH_HIST - 1 && us[i] >= 2 << b; ++b)
+			;
+		++res->hist[b];
+	}
+
+	res->lat[0] = us[0];
+	res->lat[1] = sum / n;
+	res->lat[2] = us[n / 2];
+	res->lat[3] = us[n * 90 / 100];
+	res->lat[4] = us[n * 99 / 100];
+	res->lat[5] = us[n - 1];
+}
+
+static int bench_point(const struct bench_opts *opts, int test, size_t len,
+		struct bench_result *res)
+{
+	struct psipe_bench_cmd cmd = {
+		.test = test,
+		.len = len,
+		.window = test == PSIPE_BENCH_RATE ? opts->window : 1,
+	};
+	int fd = psipe_fd(opts->dev), devs = 1;
+	bool acks = test != PSIPE_BENCH_LAT;
+	double t0, t1, ts, *us = NULL;
+	size_t bytes;
+
+	cmd.iters = BENCH_VOLUME / (len * cmd.window);
+	if (cmd.iters > opts->iters)
+		cmd.iters = opts->iters;
+	if (cmd.iters < 1)
+		cmd.iters = 1;
+	cmd.warmup = opts->warmup < cmd.iters ? opts->warmup : cmd.iters;
+
+	if (test == PSIPE_BENCH_MULTI)
+		devs = psipe_num_devs();
+
+	if (test == PSIPE_BENCH_LAT) {
+		us = malloc(cmd.iters * sizeof(*us));
+		if (!us)
+			return -1;
+	}
+
+	if (bench_post(&cmd, opts->dev) < 0)
+		goto err;
+
+	for (long i = 0; i < cmd.warmup; ++i) {
+		if (bench_one(fd, &cmd) < 0)
+			goto err;
+	}
+	if (acks && bench_sync(fd, devs > 1) < 0)
+		goto err;
+
+	t0 = now_ns();
+	for (long i = 0; i < cmd.iters; ++i) {
+		ts = now_ns();
+		if (bench_one(fd, &cmd) < 0)
+			goto err;
+		if (us)
+			us[i] = (now_ns() - ts) / 2e3;
+	}
+	if (acks && bench_sync(fd, devs > 1) < 0)
+		goto err;
+	t1 = now_ns();
+
+	memset(res, 0, sizeof(*res));
+	res->test = test;
+	res->devs = devs;
+	res->len = len;
+	res->iters = cmd.iters;
+	res->secs = (t1 - t0) / 1e9;
+
+	bytes = len * cmd.window * cmd.iters * devs;
+	if (test == PSIPE_BENCH_BIBW || test == PSIPE_BENCH_LAT)
+		bytes *= 2;
+	res->mbps = bytes / res->secs / 1e6;
+	res->rate = cmd.iters * cmd.window * devs / res->secs;
+	if (us)
+		bench_lat_stats(res, us, cmd.iters);
+
+	free(us);
+	return 0;
+
+err:
+	free(us);
+	return -1;
+}
+
+/* ============================================================================
+ * Output
+ * ============================================================================
+ */
+
+static void bench_header(enum bench_fmt fmt)
+{
+	switch (fmt) {
+	case BENCH_TEXT:
+		printf("%-6s %4s %12s %8s %10s %12s %10s %10s %10s %10s\n",
+				"test", "devs", "bytes", "iters", "MB/s",
+				"msg/s", "lat_min", "lat_p50", "lat_p99",
+				"lat_max");
+		break;
+	case BENCH_CSV:
+		printf("test,devs,bytes,iters,secs,mbps,msgs_per_sec,"
+				"lat_min_us,lat_avg_us,lat_p50_us,lat_p90_us,"
+				"lat_p99_us,lat_max_us\n");
+		break;
+	case BENCH_JSON:
+		printf("{\"results\": [");
+		break;
+	}
+}
+
+static void bench_print(enum bench_fmt fmt, const struct bench_result *res)
+{
+	bool lat = res->test == PSIPE_BENCH_LAT;
+	int last = 0;
+
+	switch (fmt) {
+	case BENCH_TEXT:
+		printf("%-6s %4d %12zu %8ld %10.2f %12.0f", bench_names[res->test],
+				res->devs, res->len, res->iters, res->mbps,
+				res->rate);
+		if (lat)
+			printf(" %10.2f %10.2f %10.2f %10.2f", res->lat[0],
+					res->lat[2], res->lat[4], res->lat[5]);
+		printf("\n");
+		break;
+	case BENCH_CSV:
+		printf("%s,%d,%zu,%ld,%.9f,%.3f,%.1f", bench_names[res->test],
+				res->devs, res->len, res->iters, res->secs,
+				res->mbps, res->rate);
+		for (int i = 0; i < 6; ++i) {
+			if (lat)
+				printf(",%.3f", res->lat[i]);
+			else
+				printf(",");
+		}
+		printf("\n");
+		break;
+	case BENCH_JSON:
+		printf("%s\n  {\"test\": \"%s\", \"devs\": %d, \"bytes\": %zu, "
+				"\"iters\": %ld, \"secs\": %.9f, \"mbps\": %.3f, "
+				"\"msgs_per_sec\": %.1f",
+				npoints ? "," : "", bench_names[res->test],
+				res->devs, res->len, res->iters, res->secs,
+				res->mbps, res->rate);
+		if (lat) {
+			printf(", \"lat_us\": {\"min\": %.3f, \"avg\": %.3f, "
+					"\"p50\": %.3f, \"p90\": %.3f, "
+					"\"p99\": %.3f, \"max\": %.3f}",
+					res->lat[0], res->lat[1], res->lat[2],
+					res->lat[3], res->lat[4], res->lat[5]);
+			for (int b = 0; b < BENCH_HIST; ++b) {
+				if (res->hist[b])
+					last = b + 1;
+			}
+			printf(", \"hist_log2_us\": [");
+			for (int b = 0; b < last; ++b)
+				printf("%s%ld", b ? ", " : "", res->hist[b]);
+			printf("]");
+		}
+		printf("}");
+		break;
+	}
+	fflush(stdout);
+	++npoints;
+}
+
+static void bench_footer(enum bench_fmt fmt)
+{
+	if (fmt == BENCH_JSON)
+		printf("\n]}\n");
+}
+
+static void usage(char *prog)
+{
+	printf("Us: %s [-h] [-x] [-t bw,bibw,lat,rate,multi] [-f text|csv|json]\n"
+			"\t[-d dev] [-m min] [-M max] [-i iters] [-w warmup] [-q window]\n",
+			prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sigaction sa;
+	struct bench_opts opts = {
+		.tests = ~0u,
+		.fmt = BENCH_TEXT,
+		.dev = 0,
+		.min = 64,
+		.max = 512UL << 20,
+		.iters = 1000,
+		.warmup = 10,
+		.window = 64,
+	};
+	struct bench_result res;
+	struct psipe_bench_cmd end = { .test = PSIPE_BENCH_END };
+	size_t rcap, len, max;
+	int err, stop = 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighup_handler;
+	if (sigaction(SIGHUP, &sa, NULL) < 0) {
+		perror("sigaction(sighup)");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-x")) {
+			stop = 1;
+		} else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+			opts.tests = parse_tests(argv[++i]);
+		} else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+			++i;
+			if (!strcmp(argv[i], "text")) {
+				opts.fmt = BENCH_TEXT;
+			} else if (!strcmp(argv[i], "csv")) {
+				opts.fmt = BENCH_CSV;
+			} else if (!strcmp(argv[i], "json")) {
+				opts.fmt = BENCH_JSON;
+			} else {
+				fprintf(stderr, "Invalid format (%s)\n", argv[i]);
+				exit(1);
+			}
+		} else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+			opts.dev = strtol(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+			opts.min = parse_size(argv[++i]);
+		} else if (!strcmp(argv[i], "-M") && i + 1 < argc) {
+			opts.max = parse_size(argv[++i]);
+		} else if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+			opts.iters = strtol(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+			opts.warmup = strtol(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-q") && i + 1 < argc) {
+			opts.window = strtol(argv[++i], NULL, 0);
+		} else {
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (!opts.min || opts.min > opts.max || opts.iters < 1 ||
+			opts.warmup < 0 || opts.window < 1) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	if (psipe_open_devs() < 0)
+		exit(1);
+	if (opts.dev < 0 || opts.dev >= psipe_num_devs()) {
+		fprintf(stderr, "Invalid device (%d)\n", opts.dev);
+		exit(1);
+	}
+
+	if (stop) {
+		if (bench_post(&end, opts.dev) < 0) {
+			perror("bench_post(end)");
+			exit(1);
+		}
+		psipe_close_devs();
+		return 0;
+	}
+
+	/* the receive buffer only takes whole transfers for bibw */
+	rcap = opts.tests & 1u << PSIPE_BENCH_BIBW ? opts.max :
+		opts.max < BENCH_LAT_MAX ? opts.max : BENCH_LAT_MAX;
+	err = posix_memalign(&sbuf, 4096, opts.max);
+	if (!err)
+		err = posix_memalign(&rbuf, 4096, rcap);
+	if (err) {
+		fprintf(stderr, "posix_memalign(%zu): %s, lower it with -M\n",
+				opts.max, strerror(err));
+		exit(1);
+	}
+	sbuf_len = opts.max;
+	psipe_bench_fill(sbuf, sbuf_len);
+	memset(rbuf, 0, rcap);
+
+	bench_header(opts.fmt);
+	for (int t = PSIPE_BENCH_BW; t < PSIPE_BENCH_NUM; ++t) {
+		if (!(opts.tests & 1u << t))
+			continue;
+
+		max = opts.max;
+		if (t == PSIPE_BENCH_LAT && max > BENCH_LAT_MAX)
+			max = BENCH_LAT_MAX;
+		/* ops bigger than a chunk are no messages anymore */
+		if (t == PSIPE_BENCH_RATE && max > PSIPE_COLL_CHUNK)
+			max = PSIPE_COLL_CHUNK;
+
+		for (len = opts.min; len <= max; len *= 2) {
+			if (bench_point(&opts, t, len, &res) < 0) {
+				fprintf(stderr, "%s, %zu bytes: %s\n",
+						bench_names[t], len,
+						strerror(errno));
+				exit(1);
+			}
+			bench_print(opts.fmt, &res);
+		}
+	}
+	bench_footer(opts.fmt);
+
+	psipe_close_devs();
+	free(sbuf);
+	free(rbuf);
+
+	return 0;
+}
@@ -7,7 +7,9 @@
 #include <malloc.h>
 #include <math.h>
 #include <errno.h>
-#include "psipe_wrappers.h"
+#include <stdint.h>
+#include "psipe_coll.h"
+#include "psipe_mm.h"
 #include <signal.h>
 
 static void sighup_handler(int signo)
@@ -52,9 +54,32 @@ static void matmul_gold(int sz_n, int sz_t, int sz_m,
 	}
 }
 
+// a job of no rows, for chiplet-mm -d to exit
+static void stop_chiplets(void)
+{
+	psipe_open_devs();
+
+	int num = psipe_num_devs();
+	struct psipe_mm_args args[num];
+	size_t acounts[num], adispls[num];
+
+	memset(args, 0, sizeof(args));
+	for (int i = 0; i < num; ++i) {
+		acounts[i] = 1;
+		adispls[i] = i;
+	}
+	if (psipe_scatterv(args, acounts, adispls, sizeof(*args)) < 0) {
+		perror("psipe_scatterv(args)");
+		exit(1);
+	}
+
+	psipe_close_devs();
+}
+
 void matmul(char *msg, int sz_n, int sz_t, int sz_m, 
 		TYPE (* __restrict__ C)[sz_m], TYPE (* __restrict__ A)[sz_t],
-		TYPE (* __restrict__ B)[sz_m])
+		TYPE (* __restrict__ B)[sz_m], enum psipe_mm_layout layout,
+		uint64_t ver)
 {
 	double t0, t1;
 
@@ -66,103 +91,58 @@ void matmul(char *msg, int sz_n, int sz_t, int sz_m,
 	t0 = now();
 
 	{ /* psipe PART START =================================== */
-		int fd, num = psipe_num_devs();
-		int part, pi, pj, sz_part, ofs = 0;
-		int last[num];
-		psipe_handle_t id;
+		int num = psipe_num_devs();
+		struct psipe_mm_args args[num];
+		size_t acounts[num], adispls[num];
+		struct psipe_mm_plan plans[num];
 
+		psipe_mm_partition(args, num, sz_n, sz_t, sz_m, layout);
 		for (int i = 0; i < num; ++i) {
-			fd = psipe_fd(i);
-			part = PART_FOR_DEV(i, sz_n * sz_m, num);
-			sz_part = part * sizeof(TYPE);
-			pi = ofs / sz_m;
-			pj = ofs % sz_m;
-
-			printf("dev=%d (fd=%d), part=%d (sz_part=%d), ofs=%d\n",
-					i, fd, part, part, ofs);
-
-			id = psipe_send_args(fd, sz_n, sz_t, sz_m, part, ofs);
-			if ((long)id < 0) {
-				perror("psipe_send_args");
-				exit(1);
-			}
-#if WAIT_ALL_OPS
-			if (psipe_wait(fd, id) < 0) {
-				perror("psipe_wait(args)");
-				exit(1);
-			}
-#endif
-
-			id = psipe_send(fd, A, sz_n * sz_t * sizeof(TYPE));
-			if ((long)id < 0) {
-				perror("psipe_send(A)");
-				exit(1);
-			}
-#if WAIT_ALL_OPS
-			if (psipe_wait(fd, id) < 0) {
-				perror("psipe_wait(A)");
-				exit(1);
-			}
-#endif
-
-			id = psipe_send(fd, B, sz_t * sz_m * sizeof(TYPE));
-			if ((long)id < 0) {
-				perror("psipe_send(B)");
-				exit(1);
-			}
-#if WAIT_ALL_OPS
-			if (psipe_wait(fd, id) < 0) {
-				perror("psipe_wait(B)");
-				exit(1);
-			}
-#endif
-
-			id = psipe_send(fd, &C[pi][pj], sz_part);
-			if ((long)id < 0) {
-				perror("psipe_send(C)");
-				exit(1);
-			}
-#if WAIT_ALL_OPS
-			if (psipe_wait(fd, id) < 0) {
-				perror("psipe_wait(C)");
+			args[i].a_ver = args[i].b_ver = ver;
+			acounts[i] = 1;
+			adispls[i] = i;
+			if (psipe_mm_plan_init(&plans[i], &args[i]) < 0) {
+				perror("psipe_mm_plan_init");
 				exit(1);
 			}
-#endif
 
-			last[i] = psipe_recv(fd, &C[pi][pj], sz_part);
-			if ((long)last[i] < 0) {
-				perror("psipe_recv(C)");
-				exit(1);
-			}
-			/*
-			id = psipe_recv(fd, &C[pi][pj], sz_part);
-			if ((long)id < 0) {
-				perror("psipe_recv(C)");
-				exit(1);
-			}
-			if (psipe_wait(fd, id) < 0) {
-				perror("psipe_wait(C)");
-				exit(1);
-			}
+			if (layout == PSIPE_MM_DYN)
+				printf("dev=%d (fd=%d), dynamic\n",
+						i, psipe_fd(i));
+			else if (layout == PSIPE_MM_2D)
+				printf("dev=%d (fd=%d), rows=%d+%d, cols=%d+%d\n",
+						i, psipe_fd(i),
+						args[i].row0, args[i].nrows,
+						args[i].col0, args[i].ncols);
+			else
+				printf("dev=%d (fd=%d), part=%ld, ofs=%ld\n",
+						i, psipe_fd(i), args[i].g_len,
+						args[i].g_ofs);
+		}
 
-			psipe_flush(fd);
-			*/
-			ofs += part;
-			/*
-			printf("matmul - part %d/%d ready\n", i+1, num);
-			fflush(NULL);
-			*/
+		if (psipe_scatterv(args, acounts, adispls, sizeof(*args)) < 0) {
+			perror("psipe_scatterv(args)");
+			exit(1);
 		}
-		for (int i = 0; i < num; ++i) {
-			id = last[i];
-			fd = psipe_fd(i);
-			if (psipe_wait(fd, id) < 0) {
-				perror("psipe_wait(C)");
+
+		/* each chiplet gets its part of C and the rows of A and
+		 * columns of B it needs in blocks, and C comes back as they are
+		 * done. Or, dynamic, asks for rows until there are none left */
+		if (layout == PSIPE_MM_DYN) {
+			if (psipe_mm_dyn_master(num, args, (TYPE *)A,
+						(TYPE *)B, (TYPE *)C) < 0) {
+				perror("psipe_mm_dyn_master");
 				exit(1);
 			}
-			psipe_flush(fd);
-			printf("matmul - part %d/%d ready\n", i+1, num);
+		} else if (psipe_mm_offer(plans, num) < 0 ||
+				psipe_mm_master(plans, num, (TYPE *)A,
+					(TYPE *)B, (TYPE *)C) < 0) {
+			perror("psipe_mm_master");
+			exit(1);
 		}
+		for (int i = 0; i < num; ++i)
+			psipe_mm_plan_fini(&plans[i]);
+		printf("matmul - %d parts ready\n", num);
 	} /* psipe PART END ===================================== */
 
 	t1 = now();
@@ -224,13 +204,33 @@ int main(int argc, char *argv[])
 	}
 
 	int sz_n = SIZE_N, sz_t = SIZE_T, sz_m = SIZE_M;
-	int save_matrices = 0;
+	int save_matrices = 0, iters = 1;
+	enum psipe_mm_layout layout = PSIPE_MM_2D;
 	int i;
 	for (i=1; i < argc; i++) {
 		if (!strcmp(argv[i], "-s")) {
 			save_matrices = 1;
+		} else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+			iters = strtol(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-x")) {
+			stop_chiplets();
+			exit(0);
+		} else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+			++i;
+			if (!strcmp(argv[i], "linear")) {
+				layout = PSIPE_MM_LINEAR;
+			} else if (!strcmp(argv[i], "dyn")) {
+				layout = PSIPE_MM_DYN;
+			} else if (!strcmp(argv[i], "2d")) {
+				layout = PSIPE_MM_2D;
+			} else {
+				fprintf(stderr, "Invalid partitioning (%s)\n",
+						argv[i]);
+				exit(1);
+			}
 		} else if (!strcmp(argv[i], "-h")) {
-			printf ("Us: %s [-s] [-h] [N [T [M]]]\n", argv[0]);
+			printf ("Us: %s [-s] [-h] [-x] [-r iters] [-p linear|2d|dyn] [N [T [M]]]\n",
+					argv[0]);
 			exit(1);
 		} else {
 			break;
@@ -271,8 +271,15 @@ int main(int argc, char *argv[])
 
 	//printf("Iniciant matmul, pid = %d\n", getpid());
 
-	matmul("C += AxB", sz_n, sz_t, sz_m, (TYPE (*)[sz_m])C, A, B);
-	matmul_gold(sz_n, sz_t, sz_m, (TYPE (*)[sz_m])C_golden, A, B);
+	/* A and B are the same every time, chiplet-mm -d keeps them. Another
+	 * run has other ones, so another version */
+	uint64_t ver = ((uint64_t)getpid() << 32 ^ (uint64_t)now()) | 1;
+
+	for (int it = 0; it < iters; ++it) {
+		matmul("C += AxB", sz_n, sz_t, sz_m, (TYPE (*)[sz_m])C, A, B,
+				layout, ver);
+		matmul_gold(sz_n, sz_t, sz_m, (TYPE (*)[sz_m])C_golden, A, B);
+	}
 
 	/*
 	for (int i=0; i<sz_n; ++i) {
@@ -0,0 +1,62 @@
+/* psipe_bench.h - Benchmarks of the psipe devices
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * master-bench sends one of these to every device for each point of a
+ * sweep, and the chiplet-bench at the other end posts the mirror image of
+ * what the master does. Devices not in the test only take the command.
+ * After the warmup and again after the timed iterations the chiplet sends
+ * an ack of 8 bytes, so the time covers the data landing.
+ */
+
+enum psipe_bench_test {
+	PSIPE_BENCH_END, // chiplet-bench exits
+	PSIPE_BENCH_BW, // one way, master to chiplet
+	PSIPE_BENCH_BIBW, // both ways at once
+	PSIPE_BENCH_LAT, // ping-pong, no acks
+	PSIPE_BENCH_RATE, // window ops of len in flight, per iteration
+	PSIPE_BENCH_MULTI, // one way, every device at once
+	PSIPE_BENCH_NUM,
+};
+
+struct psipe_bench_cmd {
+	int32_t test;
+	int32_t active;
+	uint64_t len;
+	int64_t iters;
+	int32_t warmup;
+	int32_t window;
+};
+
+// the unit the device moves and deduplicates
+#define PSIPE_BENCH_PAGE 4096
+
+// Payloads: no page repeats another, nor itself from one iteration to the
+// next, or the zero page and dedup frames would stand in for the data.
+// fill once, then stamp before each send with a new count
+static inline void psipe_bench_fill(void *buf, size_t len)
+{
+	uint64_t x = 0x9e3779b97f4a7c15ULL, *w = buf;
+
+	for (size_t i = 0; i < len / sizeof(x); ++i) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		w[i] = x;
+	}
+}
+
+static inline void psipe_bench_stamp(void *buf, size_t len, uint64_t count)
+{
+	for (size_t o = 0; o + sizeof(count) <= len; o += PSIPE_BENCH_PAGE)
+		memcpy((char *)buf + o, &count, sizeof(count));
+}
@@ -0,0 +1,175 @@
+/* psipe_cache.c - Buffers kept on the chiplets from one offload to the next
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "psipe_cache.h"
+#include "psipe_coll.h"
+
+/*
+ * The chiplet decides what is resident, so it holds whatever state the
+ * master processes before this one left. An offer is a header, answered
+ * with whether the chiplet has it: same key, version, tag and length. A
+ * miss takes over the buffer of the key, the data going in after, and the
+ * entry holds nothing until psipe_cache_commit() says it has landed.
+ */
+
+struct psipe_cache_entry {
+	struct psipe_cache_hdr hdr;
+	struct psipe_cache_hdr pending; // of the last offer, until committed
+	void *buf;
+	size_t cap;
+};
+
+struct psipe_cache {
+	struct psipe_cache_entry *entries;
+	int n;
+};
+
+/* ============================================================================
+ * Master side
+ * ============================================================================
+ */
+
+int psipe_cache_offer(int fd, uint64_t key, uint64_t version, uint64_t tag,
+		size_t len)
+{
+	struct psipe_cache_hdr hdr = {
+		.key = key, .version = version, .tag = tag, .len = len,
+	};
+	int64_t have;
+
+	if (psipe_coll_send(fd, &hdr, sizeof(hdr)) < 0 ||
+			psipe_coll_recv(fd, &have, sizeof(have)) < 0)
+		return -1;
+	if (have < 0) {
+		errno = -have;
+		return -1;
+	}
+	return have ? 1 : 0;
+}
+
+/* ============================================================================
+ * Chiplet side
+ * ============================================================================
+ */
+
+struct psipe_cache *psipe_cache_create(void)
+{
+	return calloc(1, sizeof(struct psipe_cache));
+}
+
+void psipe_cache_destroy(struct psipe_cache *cache)
+{
+	if (!cache)
+		return;
+	for (int i = 0; i < cache->n; ++i)
+		free(cache->entries[i].buf);
+	free(cache->entries);
+	free(cache);
+}
+
+static struct psipe_cache_entry *psipe_cache_find(struct psipe_cache *cache,
+		uint64_t key)
+{
+	struct psipe_cache_entry *e;
+
+	for (int i = 0; i < cache->n; ++i) {
+		if (cache->entries[i].hdr.key == key)
+			return &cache->entries[i];
+	}
+
+	e = realloc(cache->entries, (cache->n + 1) * sizeof(*e));
+	if (!e)
+		return NULL;
+	cache->entries = e;
+	e = &cache->entries[cache->n++];
+	memset(e, 0, sizeof(*e));
+	e->hdr.key = key;
+	return e;
+}
+
+// take an offer, its entry in *out or NULL on an error
+static int psipe_cache_take(struct psipe_cache *cache, int fd, bool *have,
+		struct psipe_cache_entry **out)
+{
+	struct psipe_cache_entry *e;
+	struct psipe_cache_hdr hdr;
+	int64_t reply = 0;
+	void *buf;
+
+	*out = NULL;
+	if (psipe_coll_recv(fd, &hdr, sizeof(hdr)) < 0)
+		return -1;
+
+	e = psipe_cache_find(cache, hdr.key);
+	if (!e) {
+		reply = -ENOMEM;
+		goto reply;
+	}
+
+	*have = hdr.version != PSIPE_CACHE_NOVER &&
+		!memcmp(&hdr, &e->hdr, sizeof(hdr));
+	if (!*have) {
+		if (!e->buf || hdr.len > e->cap) {
+			buf = malloc(hdr.len ? hdr.len : 1);
+			if (!buf) {
+				reply = -ENOMEM;
+				goto reply;
+			}
+			free(e->buf);
+			e->buf = buf;
+			e->cap = hdr.len;
+		}
+		e->hdr.version = PSIPE_CACHE_NOVER;
+	}
+	e->pending = hdr;
+	reply = *have;
+
+reply:
+	/* the master gives up on an error, and so does this end */
+	if (psipe_coll_send(fd, &reply, sizeof(reply)) < 0)
+		return -1;
+	if (reply < 0) {
+		errno = -reply;
+		return -1;
+	}
+	*out = e;
+	return 0;
+}
+
+void *psipe_cache_accept(struct psipe_cache *cache, int fd, bool *have,
+		size_t *len)
+{
+	struct psipe_cache_entry *e;
+
+	if (psipe_cache_take(cache, fd, have, &e) < 0)
+		return NULL;
+	*len = e->pending.len;
+	return e->buf;
+}
+
+void psipe_cache_commit(struct psipe_cache *cache, uint64_t key)
+{
+	for (int i = 0; i < cache->n; ++i) {
+		if (cache->entries[i].hdr.key == key)
+			cache->entries[i].hdr = cache->entries[i].pending;
+	}
+}
+
+uint64_t psipe_cache_tag(const int *v, int n)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (int i = 0; i < n; ++i) {
+		for (int b = 0; b < 32; b += 8) {
+			h ^= (uint32_t)v[i] >> b & 0xff;
+			h *= 0x100000001b3ULL;
+		}
+	}
+	return h;
+}
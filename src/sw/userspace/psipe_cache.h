@@ -0,0 +1,42 @@
+/* psipe_cache.h - Buffers kept on the chiplets from one offload to the next
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// version of data that is never taken as resident
+#define PSIPE_CACHE_NOVER 0
+
+// what the master offers, and the chiplet holds, under a key. The tag tells
+// apart data of the same key and version laid out differently
+struct psipe_cache_hdr {
+	uint64_t key;
+	uint64_t version;
+	uint64_t tag;
+	uint64_t len;
+};
+
+struct psipe_cache;
+
+// master side: offer key at version to the chiplet at fd. Return 1 if it
+// already holds it, 0 if the len bytes must follow, -1 (errno)
+int psipe_cache_offer(int fd, uint64_t key, uint64_t version, uint64_t tag,
+		size_t len);
+
+// chiplet side
+struct psipe_cache *psipe_cache_create(void);
+void psipe_cache_destroy(struct psipe_cache *cache);
+// the other end of an offer: the buffer for it, already filled if *have
+void *psipe_cache_accept(struct psipe_cache *cache, int fd, bool *have,
+		size_t *len);
+// the data of the last offer of key has landed, it is resident from now on
+void psipe_cache_commit(struct psipe_cache *cache, uint64_t key);
+
+// FNV-1a of n ints, for tags
+uint64_t psipe_cache_tag(const int *v, int n);
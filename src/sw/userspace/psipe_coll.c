@@ -0,0 +1,272 @@
+/* psipe_coll.c - Collective operations over the psipe devices
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include <stdlib.h>
+#include "psipe_coll.h"
+
+extern struct psipe_devices *psipe_devs;
+
+// an op in flight, part of the range of device dev starting at pos
+struct psipe_coll_req {
+	int fd;
+	int dev;
+	long id;
+	size_t pos;
+	size_t len;
+};
+
+typedef int (*psipe_coll_fn)(int fd, void *addr, size_t len);
+
+static inline size_t psipe_coll_nchunks(size_t len)
+{
+	return (len + PSIPE_COLL_CHUNK - 1) / PSIPE_COLL_CHUNK;
+}
+
+static inline size_t psipe_coll_chunk_len(size_t len, size_t pos)
+{
+	return len - pos < PSIPE_COLL_CHUNK ? len - pos : PSIPE_COLL_CHUNK;
+}
+
+static int psipe_coll_wait_all(struct psipe_coll_req *reqs, int n)
+{
+	int rv = 0;
+
+	for (int i = 0; i < n; ++i) {
+		if (psipe_wait(reqs[i].fd, reqs[i].id) < 0)
+			rv = -1;
+	}
+	return rv;
+}
+
+/*
+ * Post the range of every device in chunks, going round the devices chunk by
+ * chunk. All links get work from the start instead of one device after the
+ * other, and the first chunks can be consumed while the rest is in flight.
+ * Returns the number of requests, in posting order.
+ */
+static int psipe_coll_post(psipe_coll_fn fn, char *buf, const size_t *lens,
+		const size_t *ofs, struct psipe_coll_req **out)
+{
+	int num = psipe_num_devs(), n = 0, total = 0;
+	size_t c, max = 0, pos;
+	struct psipe_coll_req *reqs;
+	long id;
+
+	for (int d = 0; d < num; ++d) {
+		total += psipe_coll_nchunks(lens[d]);
+		if (psipe_coll_nchunks(lens[d]) > max)
+			max = psipe_coll_nchunks(lens[d]);
+	}
+
+	reqs = malloc((total ? total : 1) * sizeof(*reqs));
+	if (!reqs)
+		return -1;
+
+	for (c = 0; c < max; ++c) {
+		for (int d = 0; d < num; ++d) {
+			if (c >= psipe_coll_nchunks(lens[d]))
+				continue;
+			pos = c * PSIPE_COLL_CHUNK;
+			reqs[n].fd = psipe_fd(d);
+			reqs[n].dev = d;
+			reqs[n].pos = pos;
+			reqs[n].len = psipe_coll_chunk_len(lens[d], pos);
+			id = fn(reqs[n].fd, buf + ofs[d] + pos, reqs[n].len);
+			if (id < 0) {
+				psipe_coll_wait_all(reqs, n);
+				free(reqs);
+				return -1;
+			}
+			reqs[n++].id = id;
+		}
+	}
+
+	*out = reqs;
+	return n;
+}
+
+static int psipe_coll_run(psipe_coll_fn fn, void *buf, const size_t *counts,
+		const size_t *displs, size_t size)
+{
+	int num = psipe_num_devs(), n, rv;
+	size_t lens[num], ofs[num];
+	struct psipe_coll_req *reqs;
+
+	for (int d = 0; d < num; ++d) {
+		lens[d] = counts[d] * size;
+		ofs[d] = displs[d] * size;
+	}
+
+	n = psipe_coll_post(fn, buf, lens, ofs, &reqs);
+	if (n < 0)
+		return -1;
+
+	rv = psipe_coll_wait_all(reqs, n);
+	free(reqs);
+	return rv;
+}
+
+static int psipe_coll_recv_sum(int fd, void *addr, size_t len)
+{
+	return psipe_recv_red(fd, addr, len, PSIPE_REDUCE_SUM);
+}
+
+static int psipe_coll_recv_max(int fd, void *addr, size_t len)
+{
+	return psipe_recv_red(fd, addr, len, PSIPE_REDUCE_MAX);
+}
+
+/* ============================================================================
+ * Master side
+ * ============================================================================
+ */
+
+/*
+ * The device group reads each chunk once and fans it out to every peer.
+ */
+int psipe_bcast(void *buf, size_t len)
+{
+	int num = psipe_num_devs(), fd = psipe_fd(0), n = 0, rv = 0;
+	size_t nchunks = psipe_coll_nchunks(len), pos;
+	long ids[nchunks ? nchunks : 1];
+
+	for (size_t c = 0; c < nchunks; ++c) {
+		pos = c * PSIPE_COLL_CHUNK;
+		ids[n] = psipe_send_bcast(psipe_devs->fds, num,
+				(char *)buf + pos, psipe_coll_chunk_len(len, pos));
+		if (ids[n] < 0) {
+			rv = -1;
+			break;
+		}
+		++n;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		if (psipe_wait(fd, ids[i]) < 0)
+			rv = -1;
+	}
+	return rv;
+}
+
+int psipe_scatterv(void *buf, const size_t *counts, const size_t *displs,
+		size_t size)
+{
+	return psipe_coll_run(psipe_send, buf, counts, displs, size);
+}
+
+int psipe_gatherv(void *buf, const size_t *counts, const size_t *displs,
+		size_t size)
+{
+	return psipe_coll_run(psipe_recv, buf, counts, displs, size);
+}
+
+/*
+ * Every device folds its contribution straight into buf as it lands, so
+ * there is no staging copy and nothing left for the CPU to combine.
+ */
+int psipe_reduce(double *buf, size_t n, enum psipe_reduce_op op)
+{
+	int num = psipe_num_devs(), nreqs, rv;
+	size_t lens[num], ofs[num];
+	struct psipe_coll_req *reqs;
+	psipe_coll_fn fn;
+
+	switch (op) {
+	case PSIPE_REDUCE_SUM:
+		fn = psipe_coll_recv_sum;
+		break;
+	case PSIPE_REDUCE_MAX:
+		fn = psipe_coll_recv_max;
+		break;
+	default:
+		return -1;
+	}
+
+	for (int d = 0; d < num; ++d) {
+		lens[d] = n * sizeof(double);
+		ofs[d] = 0;
+	}
+
+	nreqs = psipe_coll_post(fn, (char *)buf, lens, ofs, &reqs);
+	if (nreqs < 0)
+		return -1;
+
+	rv = psipe_coll_wait_all(reqs, nreqs);
+	free(reqs);
+	return rv;
+}
+
+/* ============================================================================
+ * Chiplet side
+ * ============================================================================
+ */
+
+static int psipe_coll_leaf(psipe_coll_fn fn, int fd, void *buf, size_t len)
+{
+	size_t nchunks = psipe_coll_nchunks(len), pos;
+	long ids[nchunks ? nchunks : 1];
+	int n = 0, rv = 0;
+
+	for (size_t c = 0; c < nchunks; ++c) {
+		pos = c * PSIPE_COLL_CHUNK;
+		ids[n] = fn(fd, (char *)buf + pos,
+				psipe_coll_chunk_len(len, pos));
+		if (ids[n] < 0) {
+			rv = -1;
+			break;
+		}
+		++n;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		if (psipe_wait(fd, ids[i]) < 0)
+			rv = -1;
+	}
+	return rv;
+}
+
+int psipe_coll_recv(int fd, void *buf, size_t len)
+{
+	return psipe_coll_leaf(psipe_recv, fd, buf, len);
+}
+
+int psipe_coll_send(int fd, void *buf, size_t len)
+{
+	return psipe_coll_leaf(psipe_send, fd, buf, len);
+}
+
+/*
+ * Chunk by chunk, a send and a receive of the same length. Both ends call
+ * it, so both send at once and the devices settle who goes first.
+ */
+int psipe_coll_sendrecv(int fd, void *sbuf, void *rbuf, size_t len)
+{
+	size_t nchunks = psipe_coll_nchunks(len), pos, clen;
+	long ids[2 * nchunks + 1];
+	int n = 0, rv = 0;
+
+	for (size_t c = 0; c < nchunks; ++c) {
+		pos = c * PSIPE_COLL_CHUNK;
+		clen = psipe_coll_chunk_len(len, pos);
+		ids[n] = psipe_send(fd, (char *)sbuf + pos, clen);
+		if (ids[n] < 0) {
+			rv = -1;
+			break;
+		}
+		ids[++n] = psipe_recv(fd, (char *)rbuf + pos, clen);
+		if (ids[n] < 0) {
+			rv = -1;
+			break;
+		}
+		++n;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		if (psipe_wait(fd, ids[i]) < 0)
+			rv = -1;
+	}
+	return rv;
+}
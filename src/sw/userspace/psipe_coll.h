@@ -0,0 +1,34 @@
+/* psipe_coll.h - Collective operations over the psipe devices
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include "psipe_wrappers.h"
+
+// transfers are cut in chunks of this many bytes, both ends must agree
+#define PSIPE_COLL_CHUNK (128 * 1024)
+
+enum psipe_reduce_op {
+	PSIPE_REDUCE_SUM = PSIPE_RED_SUM_F64,
+	PSIPE_REDUCE_MAX = PSIPE_RED_MAX_F64,
+};
+
+// master side, over every device from psipe_open_devs(). counts and displs
+// are in elements of the given size, one per device. Return 0 or -1 (errno)
+int psipe_bcast(void *buf, size_t len);
+int psipe_scatterv(void *buf, const size_t *counts, const size_t *displs,
+		size_t size);
+int psipe_gatherv(void *buf, const size_t *counts, const size_t *displs,
+		size_t size);
+// buf = buf op (n doubles from each device)
+int psipe_reduce(double *buf, size_t n, enum psipe_reduce_op op);
+
+// chiplet side: the other end of one device's part of the above
+int psipe_coll_recv(int fd, void *buf, size_t len);
+int psipe_coll_send(int fd, void *buf, size_t len);
+// a send and a receive at once, both ends call it
+int psipe_coll_sendrecv(int fd, void *sbuf, void *rbuf, size_t len);
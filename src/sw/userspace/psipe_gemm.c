@@ -0,0 +1,402 @@
+/* psipe_gemm.c - Blocked matrix multiplication for the chiplets
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "psipe_gemm.h"
+#include "psipe_sched.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__riscv)
+#include <sys/auxv.h>
+#define PSIPE_HWCAP_V (1UL << ('V' - 'A'))
+// psipe_gemm_rvv.c, built for the vector extension. NULL if it could not be
+const struct psipe_gemm_kernel *psipe_gemm_rvv(void);
+#endif
+
+#define MR PSIPE_GEMM_MR
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define ROUND_UP(a, b) (((a) + (b) - 1) / (b) * (b))
+
+/* ============================================================================
+ * Micro-kernels
+ * ============================================================================
+ */
+
+/*
+ * Each accumulator takes one multiply-add per k, in order, so every kernel
+ * gives the same bits as the plain loop built for the same target. The SIMD
+ * ones use fused multiply-adds, which is what the compiler contracts the
+ * plain loop to on targets that have them.
+ */
+static void psipe_gemm_ukr_generic(int kc, const double *a, const double *b,
+		double *c, long ldc)
+{
+	double acc[MR][4];
+
+	for (int r = 0; r < MR; ++r)
+		for (int j = 0; j < 4; ++j)
+			acc[r][j] = c[r * ldc + j];
+
+	for (int k = 0; k < kc; ++k, a += MR, b += 4)
+		for (int r = 0; r < MR; ++r)
+			for (int j = 0; j < 4; ++j)
+				acc[r][j] += a[r] * b[j];
+
+	for (int r = 0; r < MR; ++r)
+		for (int j = 0; j < 4; ++j)
+			c[r * ldc + j] = acc[r][j];
+}
+
+static const struct psipe_gemm_kernel psipe_gemm_generic = {
+	.name = "generic",
+	.nr = 4,
+	.fn = psipe_gemm_ukr_generic,
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma")))
+static void psipe_gemm_ukr_avx2(int kc, const double *a, const double *b,
+		double *c, long ldc)
+{
+	__m256d c00, c01, c10, c11, c20, c21, c30, c31, b0, b1, ar;
+
+	c00 = _mm256_loadu_pd(c);
+	c01 = _mm256_loadu_pd(c + 4);
+	c10 = _mm256_loadu_pd(c + ldc);
+	c11 = _mm256_loadu_pd(c + ldc + 4);
+	c20 = _mm256_loadu_pd(c + 2 * ldc);
+	c21 = _mm256_loadu_pd(c + 2 * ldc + 4);
+	c30 = _mm256_loadu_pd(c + 3 * ldc);
+	c31 = _mm256_loadu_pd(c + 3 * ldc + 4);
+
+	for (int k = 0; k < kc; ++k, a += MR, b += 8) {
+		b0 = _mm256_loadu_pd(b);
+		b1 = _mm256_loadu_pd(b + 4);
+		ar = _mm256_broadcast_sd(a);
+		c00 = _mm256_fmadd_pd(ar, b0, c00);
+		c01 = _mm256_fmadd_pd(ar, b1, c01);
+		ar = _mm256_broadcast_sd(a + 1);
+		c10 = _mm256_fmadd_pd(ar, b0, c10);
+		c11 = _mm256_fmadd_pd(ar, b1, c11);
+		ar = _mm256_broadcast_sd(a + 2);
+		c20 = _mm256_fmadd_pd(ar, b0, c20);
+		c21 = _mm256_fmadd_pd(ar, b1, c21);
+		ar = _mm256_broadcast_sd(a + 3);
+		c30 = _mm256_fmadd_pd(ar, b0, c30);
+		c31 = _mm256_fmadd_pd(ar, b1, c31);
+	}
+
+	_mm256_storeu_pd(c, c00);
+	_mm256_storeu_pd(c + 4, c01);
+	_mm256_storeu_pd(c + ldc, c10);
+	_mm256_storeu_pd(c + ldc + 4, c11);
+	_mm256_storeu_pd(c + 2 * ldc, c20);
+	_mm256_storeu_pd(c + 2 * ldc + 4, c21);
+	_mm256_storeu_pd(c + 3 * ldc, c30);
+	_mm256_storeu_pd(c + 3 * ldc + 4, c31);
+}
+
+static const struct psipe_gemm_kernel psipe_gemm_avx2 = {
+	.name = "avx2",
+	.nr = 8,
+	.fn = psipe_gemm_ukr_avx2,
+};
+#endif
+
+#if defined(__aarch64__)
+static void psipe_gemm_ukr_neon(int kc, const double *a, const double *b,
+		double *c, long ldc)
+{
+	float64x2_t c00, c01, c10, c11, c20, c21, c30, c31, b0, b1;
+
+	c00 = vld1q_f64(c);
+	c01 = vld1q_f64(c + 2);
+	c10 = vld1q_f64(c + ldc);
+	c11 = vld1q_f64(c + ldc + 2);
+	c20 = vld1q_f64(c + 2 * ldc);
+	c21 = vld1q_f64(c + 2 * ldc + 2);
+	c30 = vld1q_f64(c + 3 * ldc);
+	c31 = vld1q_f64(c + 3 * ldc + 2);
+
+	for (int k = 0; k < kc; ++k, a += MR, b += 4) {
+		b0 = vld1q_f64(b);
+		b1 = vld1q_f64(b + 2);
+		c00 = vfmaq_n_f64(c00, b0, a[0]);
+		c01 = vfmaq_n_f64(c01, b1, a[0]);
+		c10 = vfmaq_n_f64(c10, b0, a[1]);
+		c11 = vfmaq_n_f64(c11, b1, a[1]);
+		c20 = vfmaq_n_f64(c20, b0, a[2]);
+		c21 = vfmaq_n_f64(c21, b1, a[2]);
+		c30 = vfmaq_n_f64(c30, b0, a[3]);
+		c31 = vfmaq_n_f64(c31, b1, a[3]);
+	}
+
+	vst1q_f64(c, c00);
+	vst1q_f64(c + 2, c01);
+	vst1q_f64(c + ldc, c10);
+	vst1q_f64(c + ldc + 2, c11);
+	vst1q_f64(c + 2 * ldc, c20);
+	vst1q_f64(c + 2 * ldc + 2, c21);
+	vst1q_f64(c + 3 * ldc, c30);
+	vst1q_f64(c + 3 * ldc + 2, c31);
+}
+
+static const struct psipe_gemm_kernel psipe_gemm_neon = {
+	.name = "neon",
+	.nr = 4,
+	.fn = psipe_gemm_ukr_neon,
+};
+#endif
+
+static const struct psipe_gemm_kernel *psipe_gemm_selected;
+
+static void psipe_gemm_select(void)
+{
+	const char *env = getenv("PSIPE_GEMM");
+
+	psipe_gemm_selected = &psipe_gemm_generic;
+	if (env && !strcmp(env, "generic"))
+		return;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		psipe_gemm_selected = &psipe_gemm_avx2;
+#elif defined(__aarch64__)
+	psipe_gemm_selected = &psipe_gemm_neon; /* always there on aarch64 */
+#elif defined(__riscv)
+	if ((getauxval(AT_HWCAP) & PSIPE_HWCAP_V) && psipe_gemm_rvv())
+		psipe_gemm_selected = psipe_gemm_rvv();
+#endif
+}
+
+const struct psipe_gemm_kernel *psipe_gemm_kernel(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, psipe_gemm_select);
+	return psipe_gemm_selected;
+}
+
+/* ============================================================================
+ * Packing
+ * ============================================================================
+ */
+
+// mc rows of A in strips of MR, each as kc columns of MR (zero padded)
+static void psipe_gemm_pack_a(int mc, int kc, const double *A, long lda,
+		double *pa)
+{
+	for (int ir = 0; ir < mc; ir += MR) {
+		int h = MIN(MR, mc - ir);
+		double *dst = pa + (long)ir * kc;
+
+		for (int k = 0; k < kc; ++k)
+			for (int r = 0; r < MR; ++r)
+				dst[k * MR + r] = r < h ?
+					A[(long)(ir + r) * lda + k] : 0.0;
+	}
+}
+
+// nc columns of B in strips of nr, each as kc rows of nr (zero padded)
+static void psipe_gemm_pack_b(int kc, int nc, int nr, const double *B,
+		long ldb, double *pb)
+{
+	for (int jr = 0; jr < nc; jr += nr) {
+		int w = MIN(nr, nc - jr);
+		double *dst = pb + (long)jr * kc;
+
+		for (int k = 0; k < kc; ++k) {
+			const double *src = B + k * ldb + jr;
+
+			memcpy(dst + k * nr, src, w * sizeof(double));
+			for (int j = w; j < nr; ++j)
+				dst[k * nr + j] = 0.0;
+		}
+	}
+}
+
+/* ============================================================================
+ * Public
+ * ============================================================================
+ */
+
+// one packed block of A against one packed panel of B
+static void psipe_gemm_block(const struct psipe_gemm_kernel *ker, int mc,
+		int nc, int kc, const double *pa, const double *pb, double *C,
+		long ldc)
+{
+	double tile[MR * PSIPE_GEMM_NR_MAX];
+	int nr = ker->nr;
+
+	for (int jr = 0; jr < nc; jr += nr) {
+		int w = MIN(nr, nc - jr);
+
+		for (int ir = 0; ir < mc; ir += MR) {
+			int h = MIN(MR, mc - ir);
+			const double *a = pa + (long)ir * kc;
+			const double *b = pb + (long)jr * kc;
+			double *c = C + ir * ldc + jr;
+
+			if (h == MR && w == nr) {
+				ker->fn(kc, a, b, c, ldc);
+				continue;
+			}
+
+			/* edges go through a full tile */
+			memset(tile, 0, sizeof(tile));
+			for (int r = 0; r < h; ++r)
+				memcpy(tile + r * nr, c + r * ldc,
+						w * sizeof(double));
+			ker->fn(kc, a, b, tile, nr);
+			for (int r = 0; r < h; ++r)
+				memcpy(c + r * ldc, tile + r * nr,
+						w * sizeof(double));
+		}
+	}
+}
+
+/*
+ * The usual three levels of blocking: a KC x NC panel of B stays in the
+ * outer cache, an MC x KC block of A in the inner one, and the micro-kernel
+ * keeps an MR x nr tile of C in registers. Both are packed so the kernel
+ * reads them in order. K blocks go in ascending order.
+ */
+int psipe_gemm(int n, int t, int m, const double *A, long lda,
+		const double *B, long ldb, double *C, long ldc)
+{
+	const struct psipe_gemm_kernel *ker = psipe_gemm_kernel();
+	double *pa = NULL, *pb = NULL;
+	int mc, nc, kc, rv;
+	size_t sz_pa, sz_pb;
+
+	if (n <= 0 || t <= 0 || m <= 0)
+		return 0;
+
+	/* no bigger than the product needs, small ones are common */
+	kc = MIN(PSIPE_GEMM_KC, t);
+	sz_pa = (size_t)ROUND_UP(MIN(PSIPE_GEMM_MC, n), MR) * kc;
+	sz_pb = (size_t)ROUND_UP(MIN(PSIPE_GEMM_NC, m), ker->nr) * kc;
+
+	rv = posix_memalign((void **)&pa, 64, sz_pa * sizeof(double));
+	if (rv)
+		goto fail;
+	rv = posix_memalign((void **)&pb, 64, sz_pb * sizeof(double));
+	if (rv)
+		goto fail;
+
+	for (int jc = 0; jc < m; jc += PSIPE_GEMM_NC) {
+		nc = MIN(PSIPE_GEMM_NC, m - jc);
+		for (int pc = 0; pc < t; pc += PSIPE_GEMM_KC) {
+			kc = MIN(PSIPE_GEMM_KC, t - pc);
+			psipe_gemm_pack_b(kc, nc, ker->nr, B + pc * ldb + jc,
+					ldb, pb);
+			for (int ic = 0; ic < n; ic += PSIPE_GEMM_MC) {
+				mc = MIN(PSIPE_GEMM_MC, n - ic);
+				psipe_gemm_pack_a(mc, kc, A + ic * lda + pc,
+						lda, pa);
+				psipe_gemm_block(ker, mc, nc, kc, pa, pb,
+						C + ic * ldc + jc, ldc);
+			}
+		}
+	}
+
+	free(pa);
+	free(pb);
+	return 0;
+
+fail:
+	free(pa);
+	errno = rv;
+	return -1;
+}
+
+/*
+ * A partition may start and end in the middle of a row: those rows are done
+ * on their own, the full rows between them as one product.
+ */
+int psipe_gemm_part(const struct psipe_gemm_part *p)
+{
+	long pos = p->g_ofs, end = p->g_ofs + p->g_len, i, j, w, lo, hi, rows;
+	int m = p->sz_m;
+
+	while (pos < end) {
+		i = pos / m;
+		j = pos % m;
+		if (j || end - pos < m) {
+			w = MIN(m - j, end - pos);
+			lo = j > p->j0 ? j : p->j0;
+			hi = MIN(j + w, p->j1);
+			if (lo < hi && psipe_gemm(1, p->sz_t, hi - lo,
+						p->A + (i - p->row0) * p->lda, p->lda,
+						p->B + lo - p->j0, p->ldb,
+						p->C + pos - p->g_ofs + lo - j,
+						m) < 0)
+				return -1;
+			pos += w;
+		} else {
+			rows = (end - pos) / m;
+			if (psipe_gemm(rows, p->sz_t, p->j1 - p->j0,
+						p->A + (i - p->row0) * p->lda, p->lda,
+						p->B, p->ldb,
+						p->C + pos - p->g_ofs + p->j0,
+						m) < 0)
+				return -1;
+			pos += rows * m;
+		}
+	}
+	return 0;
+}
+
+struct psipe_gemm_tiles {
+	const struct psipe_gemm_part *part;
+	long tile_len;
+};
+
+static int psipe_gemm_tile(void *arg, long tile)
+{
+	struct psipe_gemm_tiles *tiles = arg;
+	struct psipe_gemm_part p = *tiles->part;
+	long lo = tile * tiles->tile_len;
+
+	p.C += lo;
+	p.g_ofs += lo;
+	p.g_len = MIN(tiles->tile_len, p.g_len - lo);
+	return psipe_gemm_part(&p);
+}
+
+/*
+ * Tiles are whole rows of C, a few per thread so stealing has something to
+ * balance with, and at least PSIPE_GEMM_TILE_ROWS so that packing B stays
+ * cheap next to the product. The range ends need not fall on a row.
+ */
+int psipe_gemm_part_sched(struct psipe_sched *sched,
+		const struct psipe_gemm_part *p)
+{
+	int nthreads = psipe_sched_nthreads(sched);
+	struct psipe_gemm_tiles tiles = { .part = p };
+	long rows = (p->g_len + p->sz_m - 1) / p->sz_m, tile_rows;
+
+	if (p->g_len <= 0)
+		return 0;
+
+	tile_rows = rows / (PSIPE_GEMM_TILES_PER_THREAD * nthreads);
+	if (tile_rows < PSIPE_GEMM_TILE_ROWS)
+		tile_rows = PSIPE_GEMM_TILE_ROWS;
+	if (tile_rows > PSIPE_GEMM_MC)
+		tile_rows = PSIPE_GEMM_MC;
+	tiles.tile_len = tile_rows * p->sz_m;
+
+	return psipe_sched_run(sched,
+			(p->g_len + tiles.tile_len - 1) / tiles.tile_len,
+			psipe_gemm_tile, &tiles);
+}
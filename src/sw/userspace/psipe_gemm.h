@@ -0,0 +1,64 @@
+/* psipe_gemm.h - Blocked matrix multiplication for the chiplets
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+// rows of the register tile, the same for every kernel
+#define PSIPE_GEMM_MR 4
+// widest register tile of any kernel
+#define PSIPE_GEMM_NR_MAX 8
+
+// cache blocking: a KC x NC panel of B, an MC x KC block of A
+#define PSIPE_GEMM_KC 256
+#define PSIPE_GEMM_MC 64
+#define PSIPE_GEMM_NC 2048
+
+// psipe_gemm_part_sched tiles: rows at least, and tiles per thread at most
+#define PSIPE_GEMM_TILE_ROWS 8
+#define PSIPE_GEMM_TILES_PER_THREAD 4
+
+struct psipe_sched;
+
+// a micro-kernel: c[MR][nr] (row stride ldc) += a x b over kc, with a packed
+// as kc columns of MR and b as kc rows of nr
+struct psipe_gemm_kernel {
+	const char *name;
+	int nr;
+	void (*fn)(int kc, const double *a, const double *b, double *c,
+			long ldc);
+};
+
+// the fastest kernel this cpu runs, PSIPE_GEMM=generic forces the plain one
+const struct psipe_gemm_kernel *psipe_gemm_kernel(void);
+
+// C (n x m, row stride ldc) += A (n x t, lda) x B (t x m, ldb).
+// Every element sums its products in ascending k, as the plain triple loop.
+// Return 0 or -1 (errno)
+int psipe_gemm(int n, int t, int m, const double *A, long lda,
+		const double *B, long ldb, double *C, long ldc);
+
+// g_len elements of C = A x B (sz_m columns) from element g_ofs on, in
+// row-major order, stored contiguously (element g at C[g - g_ofs]). Only
+// columns j0..j1-1 are computed. Row i of A is at A + (i - row0) * lda,
+// column j of B at B + j - j0 with row stride ldb
+struct psipe_gemm_part {
+	int sz_t, sz_m;
+	const double *A;
+	long lda;
+	int row0; // first row held in A
+	const double *B;
+	long ldb;
+	int j0, j1;
+	double *C;
+	long g_ofs, g_len;
+};
+
+int psipe_gemm_part(const struct psipe_gemm_part *p);
+// the same, in row tiles run by the threads of sched
+int psipe_gemm_part_sched(struct psipe_sched *sched,
+		const struct psipe_gemm_part *p);
@@ -0,0 +1,60 @@
+/* psipe_gemm_rvv.c - RISC-V vector micro-kernel for psipe_gemm
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include <stddef.h>
+#include "psipe_gemm.h"
+
+/*
+ * Built with the vector extension enabled, apart from the rest so nothing
+ * else ends up using it on harts without it. psipe_gemm only calls in here
+ * once the kernel reports V.
+ */
+
+#if defined(__riscv_vector)
+#include <riscv_vector.h>
+
+// 8 doubles fit in an LMUL=4 group from VLEN=128 up
+static void psipe_gemm_ukr_rvv(int kc, const double *a, const double *b,
+		double *c, long ldc)
+{
+	size_t vl = __riscv_vsetvl_e64m4(8);
+	vfloat64m4_t c0, c1, c2, c3, bk;
+
+	c0 = __riscv_vle64_v_f64m4(c, vl);
+	c1 = __riscv_vle64_v_f64m4(c + ldc, vl);
+	c2 = __riscv_vle64_v_f64m4(c + 2 * ldc, vl);
+	c3 = __riscv_vle64_v_f64m4(c + 3 * ldc, vl);
+
+	for (int k = 0; k < kc; ++k, a += PSIPE_GEMM_MR, b += 8) {
+		bk = __riscv_vle64_v_f64m4(b, vl);
+		c0 = __riscv_vfmacc_vf_f64m4(c0, a[0], bk, vl);
+		c1 = __riscv_vfmacc_vf_f64m4(c1, a[1], bk, vl);
+		c2 = __riscv_vfmacc_vf_f64m4(c2, a[2], bk, vl);
+		c3 = __riscv_vfmacc_vf_f64m4(c3, a[3], bk, vl);
+	}
+
+	__riscv_vse64_v_f64m4(c, c0, vl);
+	__riscv_vse64_v_f64m4(c + ldc, c1, vl);
+	__riscv_vse64_v_f64m4(c + 2 * ldc, c2, vl);
+	__riscv_vse64_v_f64m4(c + 3 * ldc, c3, vl);
+}
+
+static const struct psipe_gemm_kernel psipe_gemm_rvv_kernel = {
+	.name = "rvv",
+	.nr = 8,
+	.fn = psipe_gemm_ukr_rvv,
+};
+
+const struct psipe_gemm_kernel *psipe_gemm_rvv(void)
+{
+	return &psipe_gemm_rvv_kernel;
+}
+#else
+const struct psipe_gemm_kernel *psipe_gemm_rvv(void)
+{
+	return NULL;
+}
+#endif
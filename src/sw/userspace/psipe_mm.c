@@ -0,0 +1,982 @@
+/* psipe_mm.c - Pipelined matrix multiplication offload
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include "psipe_mm.h"
+#include "psipe_cache.h"
+#include "psipe_coll.h"
+#include "psipe_gemm.h"
+
+/*
+ * Instead of the whole operands followed by the whole result, a part moves
+ * as row blocks of A, column panels of B and blocks of C, in this order:
+ *
+ *	Cin A0 B0 .. Bp-1 A1 C0 A2 C1 .. Ab-1 Cb-2 Cb-1
+ *
+ * The chiplet works on tile (block, panel) as soon as both have landed, and
+ * sends a block of C as soon as all its panels are done, while what follows
+ * is still in flight. A device runs its ops in order, so both ends post
+ * them in this same order.
+ */
+
+#define DIV_ROUND_UP(a, b) (((a) + (b) - 1) / (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// psipe_cache keys of the operands
+#define PSIPE_MM_KEY_A 0x41
+#define PSIPE_MM_KEY_B 0x42
+
+// the ops of one step, it may take several chunks
+struct psipe_mm_xfer {
+	long *ids;
+	int n;
+};
+
+// first of the len / n pieces of len that piece i gets, see PART_FOR_DEV
+static inline int psipe_mm_part_ofs(int i, int len, int n)
+{
+	return i * (len / n) + MIN(i, len % n);
+}
+
+/*
+ * In 2D the devices form a pr x pc grid, each with a block of C. A chiplet
+ * then needs n / pr rows of A and m / pc columns of B, the grid shape being
+ * the one that moves the least of them.
+ */
+static int psipe_mm_grid_rows(int num, int sz_n, int sz_m)
+{
+	long best = -1, cost;
+	int pr = 1;
+
+	for (int r = 1; r <= num; ++r) {
+		if (num % r)
+			continue;
+		cost = (long)DIV_ROUND_UP(sz_n, r) + DIV_ROUND_UP(sz_m, num / r);
+		if (best < 0 || cost < best) {
+			best = cost;
+			pr = r;
+		}
+	}
+	return pr;
+}
+
+void psipe_mm_partition(struct psipe_mm_args *args, int num, int sz_n,
+		int sz_t, int sz_m, enum psipe_mm_layout layout)
+{
+	int pr = psipe_mm_grid_rows(num, sz_n, sz_m), pc = num / pr, r, c;
+	long total = (long)sz_n * sz_m, ofs = 0;
+
+	for (int d = 0; d < num; ++d) {
+		memset(&args[d], 0, sizeof(args[d]));
+		args[d].sz_n = sz_n;
+		args[d].sz_t = sz_t;
+		args[d].sz_m = sz_m;
+
+		args[d].layout = layout;
+		if (layout == PSIPE_MM_DYN)
+			continue;
+		if (layout == PSIPE_MM_LINEAR) {
+			args[d].g_ofs = ofs;
+			args[d].g_len = PART_FOR_DEV(d, total, num);
+			ofs += args[d].g_len;
+			continue;
+		}
+
+		r = d / pc;
+		c = d % pc;
+		args[d].row0 = psipe_mm_part_ofs(r, sz_n, pr);
+		args[d].nrows = PART_FOR_DEV(r, sz_n, pr);
+		args[d].col0 = psipe_mm_part_ofs(c, sz_m, pc);
+		args[d].ncols = PART_FOR_DEV(c, sz_m, pc);
+	}
+}
+
+int psipe_mm_plan_init(struct psipe_mm_plan *plan,
+		const struct psipe_mm_args *args)
+{
+	int s = 0;
+
+	memset(plan, 0, sizeof(*plan));
+	plan->sz_n = args->sz_n;
+	plan->sz_t = args->sz_t;
+	plan->sz_m = args->sz_m;
+	plan->rect = args->layout == PSIPE_MM_2D;
+	plan->a_ver = args->a_ver;
+	plan->b_ver = args->b_ver;
+
+	if (plan->rect) {
+		plan->row0 = args->row0;
+		plan->nrows = args->nrows;
+		plan->col0 = args->col0;
+		plan->ncols = args->ncols;
+		plan->g_len = (long)plan->nrows * plan->ncols;
+		if (plan->g_len <= 0)
+			return 0;
+	} else {
+		plan->g_ofs = args->g_ofs;
+		plan->g_len = args->g_len;
+		if (plan->g_len <= 0)
+			return 0;
+
+		plan->row0 = plan->g_ofs / plan->sz_m;
+		plan->nrows = (plan->g_ofs + plan->g_len - 1) / plan->sz_m -
+			plan->row0 + 1;
+		/* a part within one row needs only some columns, any other
+		 * all */
+		plan->col0 = plan->nrows == 1 ? plan->g_ofs % plan->sz_m : 0;
+		plan->ncols = plan->nrows == 1 ? plan->g_len : plan->sz_m;
+	}
+
+	plan->block_rows = DIV_ROUND_UP(plan->nrows, PSIPE_MM_BLOCKS);
+	plan->nblocks = DIV_ROUND_UP(plan->nrows, plan->block_rows);
+
+	/* whole register tiles, so only the last panel has an edge */
+	plan->panel_cols = DIV_ROUND_UP(plan->ncols, PSIPE_MM_PANELS);
+	plan->panel_cols = DIV_ROUND_UP(plan->panel_cols, PSIPE_GEMM_NR_MAX) *
+		PSIPE_GEMM_NR_MAX;
+	plan->panel_cols = MIN(plan->panel_cols, plan->ncols);
+	plan->npanels = DIV_ROUND_UP(plan->ncols, plan->panel_cols);
+
+	plan->nsteps = 1 + 2 * plan->nblocks + plan->npanels;
+	plan->steps = calloc(plan->nsteps, sizeof(*plan->steps));
+	if (!plan->steps)
+		return -1;
+
+	plan->steps[s++] = (struct psipe_mm_step){ PSIPE_MM_CIN, 0 };
+	plan->steps[s++] = (struct psipe_mm_step){ PSIPE_MM_A, 0 };
+	for (int p = 0; p < plan->npanels; ++p)
+		plan->steps[s++] = (struct psipe_mm_step){ PSIPE_MM_B, p };
+	for (int b = 1; b < plan->nblocks; ++b) {
+		plan->steps[s++] = (struct psipe_mm_step){ PSIPE_MM_A, b };
+		plan->steps[s++] = (struct psipe_mm_step){ PSIPE_MM_C, b - 1 };
+	}
+	plan->steps[s++] = (struct psipe_mm_step){ PSIPE_MM_C,
+		plan->nblocks - 1 };
+
+	return 0;
+}
+
+void psipe_mm_plan_fini(struct psipe_mm_plan *plan)
+{
+	free(plan->steps);
+	plan->steps = NULL;
+}
+
+// the steps without those of what the chiplet holds
+static void psipe_mm_plan_resident(struct psipe_mm_plan *plan, bool a, bool b)
+{
+	int n = 0;
+
+	plan->have_a = a;
+	plan->have_b = b;
+	for (int s = 0; s < plan->nsteps; ++s) {
+		if ((a && plan->steps[s].kind == PSIPE_MM_A) ||
+				(b && plan->steps[s].kind == PSIPE_MM_B))
+			continue;
+		plan->steps[n++] = plan->steps[s];
+	}
+	plan->nsteps = n;
+}
+
+// what tells apart the A and the B of parts of the same version
+static void psipe_mm_tags(const struct psipe_mm_plan *plan, uint64_t *a,
+		uint64_t *b)
+{
+	int ta[] = { plan->row0, plan->nrows, plan->sz_t };
+	int tb[] = { plan->col0, plan->ncols, plan->sz_t, plan->panel_cols };
+
+	*a = psipe_cache_tag(ta, 3);
+	*b = psipe_cache_tag(tb, 4);
+}
+
+int psipe_mm_offer(struct psipe_mm_plan *plans, int num)
+{
+	uint64_t ta, tb;
+	int a, b;
+
+	for (int d = 0; d < num; ++d) {
+		if (!plans[d].g_len)
+			continue;
+		psipe_mm_tags(&plans[d], &ta, &tb);
+		a = b = 0;
+		if (plans[d].a_ver != PSIPE_CACHE_NOVER)
+			a = psipe_cache_offer(psipe_fd(d), PSIPE_MM_KEY_A,
+					plans[d].a_ver, ta, (size_t)plans[d].nrows *
+					plans[d].sz_t * sizeof(double));
+		if (a >= 0 && plans[d].b_ver != PSIPE_CACHE_NOVER)
+			b = psipe_cache_offer(psipe_fd(d), PSIPE_MM_KEY_B,
+					plans[d].b_ver, tb, (size_t)plans[d].sz_t *
+					plans[d].ncols * sizeof(double));
+		if (a < 0 || b < 0)
+			return -1;
+		psipe_mm_plan_resident(&plans[d], a, b);
+	}
+	return 0;
+}
+
+int psipe_mm_accept(int fd, struct psipe_mm_ws *ws,
+		struct psipe_mm_plan *plan, double **A, double **Bp)
+{
+	size_t la = (size_t)plan->nrows * plan->sz_t * sizeof(double);
+	size_t lb = (size_t)plan->sz_t * plan->ncols * sizeof(double), len;
+	bool a = false, b = false;
+	uint64_t ta, tb;
+
+	if (!plan->g_len) {
+		*A = *Bp = NULL;
+		return 0;
+	}
+	if ((plan->a_ver != PSIPE_CACHE_NOVER ||
+				plan->b_ver != PSIPE_CACHE_NOVER) && !ws->cache) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	psipe_mm_tags(plan, &ta, &tb);
+	*A = plan->a_ver != PSIPE_CACHE_NOVER ?
+		psipe_cache_accept(ws->cache, fd, &a, &len) :
+		psipe_mm_ws_get(ws, PSIPE_MM_WS_A, la);
+	if (!*A)
+		return -1;
+	*Bp = plan->b_ver != PSIPE_CACHE_NOVER ?
+		psipe_cache_accept(ws->cache, fd, &b, &len) :
+		psipe_mm_ws_get(ws, PSIPE_MM_WS_B, lb);
+	if (!*Bp)
+		return -1;
+
+	psipe_mm_plan_resident(plan, a, b);
+	return 0;
+}
+
+void psipe_mm_landed(struct psipe_mm_ws *ws, const struct psipe_mm_plan *plan)
+{
+	if (!plan->g_len)
+		return;
+	if (plan->a_ver != PSIPE_CACHE_NOVER)
+		psipe_cache_commit(ws->cache, PSIPE_MM_KEY_A);
+	if (plan->b_ver != PSIPE_CACHE_NOVER)
+		psipe_cache_commit(ws->cache, PSIPE_MM_KEY_B);
+}
+
+static void psipe_mm_block_rows(const struct psipe_mm_plan *plan, int b,
+		int *lo, int *hi)
+{
+	*lo = plan->row0 + b * plan->block_rows;
+	*hi = MIN(*lo + plan->block_rows, plan->row0 + plan->nrows);
+}
+
+// elements of the part in block b, in the same terms as g_ofs and g_len
+static void psipe_mm_block_range(const struct psipe_mm_plan *plan, int b,
+		long *lo, long *hi)
+{
+	int r_lo, r_hi;
+
+	psipe_mm_block_rows(plan, b, &r_lo, &r_hi);
+	if (plan->rect) {
+		*lo = (long)(r_lo - plan->row0) * plan->ncols;
+		*hi = (long)(r_hi - plan->row0) * plan->ncols;
+		return;
+	}
+	*lo = MAX(plan->g_ofs, (long)r_lo * plan->sz_m);
+	*hi = MIN(plan->g_ofs + plan->g_len, (long)r_hi * plan->sz_m);
+}
+
+static void psipe_mm_panel_cols(const struct psipe_mm_plan *plan, int p,
+		int *j0, int *j1)
+{
+	*j0 = plan->col0 + p * plan->panel_cols;
+	*j1 = MIN(*j0 + plan->panel_cols, plan->col0 + plan->ncols);
+}
+
+// the columns of B a part needs, panel after panel, each t x panel width
+static double *psipe_mm_pack_b(const struct psipe_mm_plan *plan,
+		const double *B)
+{
+	int t = plan->sz_t, m = plan->sz_m, j0, j1;
+	double *Bp = malloc((size_t)t * plan->ncols * sizeof(double) + 1);
+
+	if (!Bp)
+		return NULL;
+
+	for (int p = 0; p < plan->npanels; ++p) {
+		psipe_mm_panel_cols(plan, p, &j0, &j1);
+		for (int k = 0; k < t; ++k)
+			memcpy(Bp + (long)t * (j0 - plan->col0) +
+					(long)k * (j1 - j0),
+					B + (long)k * m + j0,
+					(j1 - j0) * sizeof(double));
+	}
+	return Bp;
+}
+
+/*
+ * The memory of a step. A holds rows from arow0 on, Bp is packed for the
+ * plan, and C is the part when cbase is g_ofs, else all of it (a linear
+ * part) or the rectangle packed (a 2D one).
+ */
+static void psipe_mm_step_buf(const struct psipe_mm_plan *plan,
+		const struct psipe_mm_step *step, const double *A, int arow0,
+		const double *Bp, double *C, long cbase, void **buf, size_t *len)
+{
+	int lo, hi;
+	long g_lo, g_hi;
+
+	switch (step->kind) {
+	case PSIPE_MM_CIN:
+		*buf = C + plan->g_ofs - cbase;
+		*len = plan->g_len * sizeof(double);
+		break;
+	case PSIPE_MM_A:
+		psipe_mm_block_rows(plan, step->idx, &lo, &hi);
+		*buf = (void *)(A + (long)(lo - arow0) * plan->sz_t);
+		*len = (size_t)(hi - lo) * plan->sz_t * sizeof(double);
+		break;
+	case PSIPE_MM_B:
+		psipe_mm_panel_cols(plan, step->idx, &lo, &hi);
+		*buf = (void *)(Bp + (long)(lo - plan->col0) * plan->sz_t);
+		*len = (size_t)(hi - lo) * plan->sz_t * sizeof(double);
+		break;
+	case PSIPE_MM_C:
+		psipe_mm_block_range(plan, step->idx, &g_lo, &g_hi);
+		*buf = C + g_lo - cbase;
+		*len = (g_hi - g_lo) * sizeof(double);
+		break;
+	}
+}
+
+static int psipe_mm_post(int fd, bool send, char *buf, size_t len,
+		struct psipe_mm_xfer *x)
+{
+	size_t pos, chunk;
+	long id;
+
+	x->ids = malloc(DIV_ROUND_UP(len, PSIPE_COLL_CHUNK) * sizeof(long) + 1);
+	x->n = 0;
+	if (!x->ids)
+		return -1;
+
+	for (pos = 0; pos < len; pos += chunk) {
+		chunk = MIN(len - pos, PSIPE_COLL_CHUNK);
+		id = send ? psipe_send(fd, buf + pos, chunk) :
+			psipe_recv(fd, buf + pos, chunk);
+		if (id < 0)
+			return -1;
+		x->ids[x->n++] = id;
+	}
+	return 0;
+}
+
+static int psipe_mm_wait(int fd, struct psipe_mm_xfer *x)
+{
+	int rv = 0;
+
+	for (int i = 0; i < x->n; ++i) {
+		if (psipe_wait(fd, x->ids[i]) < 0)
+			rv = -1;
+	}
+	free(x->ids);
+	x->ids = NULL;
+	return rv;
+}
+
+double *psipe_mm_ws_get(struct psipe_mm_ws *ws, enum psipe_mm_ws_buf i,
+		size_t len)
+{
+	void *p;
+	int err;
+
+	if (len <= ws->cap[i] && ws->buf[i])
+		return ws->buf[i];
+
+	/* what was there is not kept */
+	err = posix_memalign(&p, 64, len ? len : 1);
+	if (err) {
+		errno = err;
+		return NULL;
+	}
+	free(ws->buf[i]);
+	ws->buf[i] = p;
+	ws->cap[i] = len;
+	return p;
+}
+
+void psipe_mm_ws_fini(struct psipe_mm_ws *ws)
+{
+	for (int i = 0; i < PSIPE_MM_WS_NUM; ++i)
+		free(ws->buf[i]);
+	psipe_cache_destroy(ws->cache);
+	memset(ws, 0, sizeof(*ws));
+}
+
+/* ============================================================================
+ * Master side
+ * ============================================================================
+ */
+
+// the rectangle of a 2D part between C and a packed copy of it
+static void psipe_mm_copy_rect(const struct psipe_mm_plan *plan, double *C,
+		double *R, bool to_c)
+{
+	double *c;
+
+	for (int i = 0; i < plan->nrows; ++i) {
+		c = C + (long)(plan->row0 + i) * plan->sz_m + plan->col0;
+		if (to_c)
+			memcpy(c, R + (long)i * plan->ncols,
+					plan->ncols * sizeof(double));
+		else
+			memcpy(R + (long)i * plan->ncols, c,
+					plan->ncols * sizeof(double));
+	}
+}
+
+/*
+ * Every step of every device is posted up front, going round the devices so
+ * all links start at once. A device only runs them in order anyway. A 2D
+ * part travels as a packed copy, put back into C once it is all in.
+ */
+int psipe_mm_master(struct psipe_mm_plan *plans, int num, const double *A,
+		const double *B, double *C)
+{
+	struct psipe_mm_xfer *xfers[num];
+	int posted[num], maxsteps = 0, rv = 0;
+	struct psipe_mm_step *step;
+	double *Bp[num], *Cr[num];
+	size_t len;
+	void *buf;
+
+	for (int d = 0; d < num; ++d) {
+		posted[d] = 0;
+		xfers[d] = calloc(plans[d].nsteps + 1, sizeof(**xfers));
+		Bp[d] = plans[d].have_b ? NULL : psipe_mm_pack_b(&plans[d], B);
+		Cr[d] = plans[d].rect ?
+			malloc(plans[d].g_len * sizeof(double) + 1) : C;
+		if (!xfers[d] || (!Bp[d] && !plans[d].have_b) || !Cr[d])
+			rv = -1;
+		else if (plans[d].rect)
+			psipe_mm_copy_rect(&plans[d], C, Cr[d], false);
+		maxsteps = MAX(maxsteps, plans[d].nsteps);
+	}
+
+	for (int s = 0; s < maxsteps && !rv; ++s) {
+		for (int d = 0; d < num && !rv; ++d) {
+			if (s >= plans[d].nsteps)
+				continue;
+			step = &plans[d].steps[s];
+			psipe_mm_step_buf(&plans[d], step, A, 0, Bp[d], Cr[d],
+					0, &buf, &len);
+			rv = psipe_mm_post(psipe_fd(d),
+					step->kind != PSIPE_MM_C, buf, len,
+					&xfers[d][s]);
+			++posted[d];
+		}
+	}
+
+	for (int d = 0; d < num; ++d) {
+		for (int s = 0; s < posted[d]; ++s) {
+			if (psipe_mm_wait(psipe_fd(d), &xfers[d][s]) < 0)
+				rv = -1;
+		}
+		if (plans[d].rect && Cr[d]) {
+			if (!rv)
+				psipe_mm_copy_rect(&plans[d], C, Cr[d], true);
+			free(Cr[d]);
+		}
+		free(xfers[d]);
+		free(Bp[d]);
+	}
+	return rv;
+}
+
+/* ============================================================================
+ * Chiplet side
+ * ============================================================================
+ */
+
+struct psipe_mm_chiplet {
+	int fd;
+	struct psipe_sched *sched;
+	struct psipe_mm_plan *plan;
+	double *A, *Bp, *C;
+	struct psipe_mm_xfer *xfers;
+	bool *a_done, *b_done;
+	int *c_left; // panels block b still misses
+	int posted;
+};
+
+static int psipe_mm_tile(struct psipe_mm_chiplet *ch, int b, int p)
+{
+	struct psipe_mm_plan *plan = ch->plan;
+	struct psipe_gemm_part part;
+	long lo, hi;
+	int j0, j1;
+
+	psipe_mm_block_range(plan, b, &lo, &hi);
+	psipe_mm_panel_cols(plan, p, &j0, &j1);
+	part = (struct psipe_gemm_part){
+		.sz_t = plan->sz_t, .sz_m = plan->sz_m,
+		.A = ch->A, .lda = plan->sz_t, .row0 = plan->row0,
+		.B = ch->Bp + (long)(j0 - plan->col0) * plan->sz_t,
+		.ldb = j1 - j0,
+		.j0 = j0, .j1 = j1,
+		.C = ch->C + lo - plan->g_ofs,
+		.g_ofs = lo, .g_len = hi - lo,
+	};
+	/* a rectangle is a product of its own, nrows x ncols */
+	if (plan->rect) {
+		part.sz_m = plan->ncols;
+		part.row0 = 0;
+		part.j0 -= plan->col0;
+		part.j1 -= plan->col0;
+	}
+
+	--ch->c_left[b];
+	return psipe_gemm_part_sched(ch->sched, &part);
+}
+
+// post in order up to the first block of C that is not done yet
+static int psipe_mm_advance(struct psipe_mm_chiplet *ch)
+{
+	struct psipe_mm_plan *plan = ch->plan;
+	struct psipe_mm_step *step;
+	size_t len;
+	void *buf;
+
+	while (ch->posted < plan->nsteps) {
+		step = &plan->steps[ch->posted];
+		if (step->kind == PSIPE_MM_C && ch->c_left[step->idx])
+			break;
+		psipe_mm_step_buf(plan, step, ch->A, plan->row0, ch->Bp,
+				ch->C, plan->g_ofs, &buf, &len);
+		if (psipe_mm_post(ch->fd, step->kind == PSIPE_MM_C, buf, len,
+					&ch->xfers[ch->posted++]) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+// a step has landed, do the tiles it completes
+static int psipe_mm_arrived(struct psipe_mm_chiplet *ch,
+		const struct psipe_mm_step *step)
+{
+	struct psipe_mm_plan *plan = ch->plan;
+
+	switch (step->kind) {
+	case PSIPE_MM_CIN:
+		/* C is in, what is resident can go */
+		for (int b = 0; b < plan->nblocks; ++b) {
+			for (int p = 0; p < plan->npanels; ++p) {
+				if (ch->a_done[b] && ch->b_done[p] &&
+						psipe_mm_tile(ch, b, p) < 0)
+					return -1;
+			}
+		}
+		break;
+	case PSIPE_MM_A:
+		ch->a_done[step->idx] = true;
+		for (int p = 0; p < plan->npanels; ++p) {
+			if (ch->b_done[p] && psipe_mm_tile(ch, step->idx, p) < 0)
+				return -1;
+		}
+		break;
+	case PSIPE_MM_B:
+		ch->b_done[step->idx] = true;
+		for (int b = 0; b < plan->nblocks; ++b) {
+			if (ch->a_done[b] && psipe_mm_tile(ch, b, step->idx) < 0)
+				return -1;
+		}
+		break;
+	case PSIPE_MM_C:
+		break;
+	}
+	return 0;
+}
+
+int psipe_mm_chiplet(int fd, struct psipe_sched *sched,
+		struct psipe_mm_plan *plan, double *A, double *Bp, double *C)
+{
+	struct psipe_mm_chiplet ch = {
+		.fd = fd, .sched = sched, .plan = plan,
+		.A = A, .Bp = Bp, .C = C,
+	};
+	int rv = -1;
+
+	ch.xfers = calloc(plan->nsteps + 1, sizeof(*ch.xfers));
+	ch.a_done = calloc(plan->nblocks + 1, sizeof(*ch.a_done));
+	ch.b_done = calloc(plan->npanels + 1, sizeof(*ch.b_done));
+	ch.c_left = calloc(plan->nblocks + 1, sizeof(*ch.c_left));
+	if (!ch.xfers || !ch.a_done || !ch.b_done || !ch.c_left)
+		goto out;
+	for (int b = 0; b < plan->nblocks; ++b) {
+		ch.c_left[b] = plan->npanels;
+		ch.a_done[b] = plan->have_a;
+	}
+	for (int p = 0; p < plan->npanels; ++p)
+		ch.b_done[p] = plan->have_b;
+
+	if (psipe_mm_advance(&ch) < 0)
+		goto out;
+
+	/* a block of C is posted before its turn comes, see advance */
+	for (int s = 0; s < plan->nsteps; ++s) {
+		if (psipe_mm_wait(fd, &ch.xfers[s]) < 0 ||
+				psipe_mm_arrived(&ch, &plan->steps[s]) < 0 ||
+				psipe_mm_advance(&ch) < 0)
+			goto out;
+	}
+	rv = 0;
+
+out:
+	if (ch.xfers) {
+		for (int s = 0; s < plan->nsteps; ++s)
+			free(ch.xfers[s].ids);
+	}
+	free(ch.xfers);
+	free(ch.a_done);
+	free(ch.b_done);
+	free(ch.c_left);
+	return rv;
+}
+
+/* ============================================================================
+ * Dynamic
+ * ============================================================================
+ */
+
+/*
+ * After B, a chiplet asks for chunk k+1 as soon as chunk k is in, so the
+ * next one lands while it computes. Each link then goes
+ *
+ *	B  req0 grant0 A0 C0in  req1 grant1 A1 C1in C0  req2 grant2 ..  C1 ..
+ *
+ * and ends with a grant of no rows and the last C. The master sees a
+ * request as the fd polling readable, which it only does once the ops
+ * before it are done. A chunk is a share of the rows left, in proportion
+ * to how fast the chiplet computed its last ones (guided self-scheduling).
+ */
+
+// chiplet to master: how long the last chunk took
+struct psipe_mm_req {
+	long rows;
+	long ns;
+};
+
+// master to chiplet: the next chunk, no rows for none
+struct psipe_mm_grant {
+	int row0;
+	int nrows;
+};
+
+// what the master knows of a chiplet
+struct psipe_mm_dyn {
+	struct psipe_mm_xfer xfers[5];
+	int nxfers;
+	struct psipe_mm_req req;
+	struct psipe_mm_grant grant;
+	struct psipe_mm_grant prev; // the chunk whose C comes back next
+	double rate; // rows per ns, 0 while unknown
+	bool done;
+};
+
+static int psipe_mm_dyn_reap(int fd, struct psipe_mm_dyn *dev)
+{
+	int rv = 0;
+
+	for (int i = 0; i < dev->nxfers; ++i) {
+		if (psipe_mm_wait(fd, &dev->xfers[i]) < 0)
+			rv = -1;
+	}
+	dev->nxfers = 0;
+	return rv;
+}
+
+static int psipe_mm_dyn_chunk(const struct psipe_mm_dyn *devs, int num,
+		int d, int left)
+{
+	double known = 0, sum = 0, avg;
+	int nknown = 0;
+	long rows;
+
+	for (int i = 0; i < num; ++i) {
+		if (!devs[i].done && devs[i].rate > 0) {
+			known += devs[i].rate;
+			++nknown;
+		}
+	}
+	/* one not heard from yet counts as the average */
+	avg = nknown ? known / nknown : 1;
+	for (int i = 0; i < num; ++i) {
+		if (!devs[i].done)
+			sum += devs[i].rate > 0 ? devs[i].rate : avg;
+	}
+
+	rows = (long)(left * (devs[d].rate > 0 ? devs[d].rate : avg) /
+			(2 * sum) + 0.5);
+	rows = MAX(rows, PSIPE_MM_DYN_ROWS);
+	return MIN(rows, left);
+}
+
+static int psipe_mm_dyn_post(int fd, struct psipe_mm_dyn *dev, bool send,
+		const void *buf, size_t len)
+{
+	return psipe_mm_post(fd, send, (char *)buf, len,
+			&dev->xfers[dev->nxfers++]);
+}
+
+// all of B, whole
+static uint64_t psipe_mm_dyn_tag(const struct psipe_mm_args *args)
+{
+	int v[] = { -1, args->sz_t, args->sz_m };
+
+	return psipe_cache_tag(v, 3);
+}
+
+// device d asks for more: take its request, hand out the next chunk
+static int psipe_mm_dyn_serve(struct psipe_mm_dyn *devs, int num, int d,
+		const struct psipe_mm_args *args, const double *A, double *C,
+		int *next)
+{
+	struct psipe_mm_dyn *dev = &devs[d];
+	struct psipe_mm_grant *g = &dev->grant;
+	int fd = psipe_fd(d), t = args->sz_t, m = args->sz_m;
+	struct psipe_mm_xfer x;
+	double sample;
+
+	/* all it had posted is done, or it would not poll readable */
+	if (psipe_mm_dyn_reap(fd, dev) < 0)
+		return -1;
+	if (psipe_mm_post(fd, false, (char *)&dev->req, sizeof(dev->req),
+				&x) < 0 || psipe_mm_wait(fd, &x) < 0)
+		return -1;
+
+	if (dev->req.rows > 0 && dev->req.ns > 0) {
+		sample = (double)dev->req.rows / dev->req.ns;
+		dev->rate = dev->rate > 0 ? (dev->rate + sample) / 2 : sample;
+	}
+
+	g->row0 = *next;
+	g->nrows = *next < args->sz_n ?
+		psipe_mm_dyn_chunk(devs, num, d, args->sz_n - *next) : 0;
+	*next += g->nrows;
+
+	if (psipe_mm_dyn_post(fd, dev, true, g, sizeof(*g)) < 0)
+		return -1;
+	if (g->nrows && (psipe_mm_dyn_post(fd, dev, true,
+				A + (long)g->row0 * t,
+				(size_t)g->nrows * t * sizeof(double)) < 0 ||
+			psipe_mm_dyn_post(fd, dev, true,
+				C + (long)g->row0 * m,
+				(size_t)g->nrows * m * sizeof(double)) < 0))
+		return -1;
+	if (dev->prev.nrows && psipe_mm_dyn_post(fd, dev, false,
+				C + (long)dev->prev.row0 * m,
+				(size_t)dev->prev.nrows * m * sizeof(double)) < 0)
+		return -1;
+
+	dev->prev = *g;
+	dev->done = !g->nrows;
+	return 0;
+}
+
+int psipe_mm_dyn_master(int num, const struct psipe_mm_args *args,
+		const double *A, const double *B, double *C)
+{
+	struct psipe_mm_dyn *devs = calloc(num + 1, sizeof(*devs));
+	struct pollfd *pfds = calloc(num + 1, sizeof(*pfds));
+	size_t blen = (size_t)args->sz_t * args->sz_m * sizeof(double);
+	int next = 0, left = num, rv = -1, have, d;
+
+	if (!devs || !pfds)
+		goto out;
+
+	for (d = 0; d < num; ++d) {
+		pfds[d].fd = psipe_fd(d);
+		pfds[d].events = POLLIN;
+		have = args->b_ver != PSIPE_CACHE_NOVER ?
+			psipe_cache_offer(pfds[d].fd, PSIPE_MM_KEY_B,
+					args->b_ver, psipe_mm_dyn_tag(args),
+					blen) : 0;
+		if (have < 0 || (!have && psipe_mm_dyn_post(pfds[d].fd,
+						&devs[d], true, B, blen) < 0))
+			goto out;
+	}
+
+	while (left) {
+		if (poll(pfds, num, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			goto out;
+		}
+		for (d = 0; d < num; ++d) {
+			if (pfds[d].revents & (POLLERR | POLLNVAL)) {
+				errno = EIO;
+				goto out;
+			}
+			if (!(pfds[d].revents & POLLIN))
+				continue;
+			if (psipe_mm_dyn_serve(devs, num, d, args, A, C,
+						&next) < 0)
+				goto out;
+			if (devs[d].done) {
+				pfds[d].fd = -1;
+				--left;
+			}
+		}
+	}
+	rv = 0;
+
+out:
+	if (devs) {
+		for (d = 0; d < num; ++d) {
+			if (psipe_mm_dyn_reap(psipe_fd(d), &devs[d]) < 0)
+				rv = -1;
+		}
+	}
+	free(devs);
+	free(pfds);
+	return rv;
+}
+
+// ask the master for a chunk, and wait for the answer
+static int psipe_mm_dyn_ask(int fd, struct psipe_mm_req *req,
+		struct psipe_mm_grant *grant)
+{
+	struct psipe_mm_xfer x[2];
+	int rv;
+
+	if (psipe_mm_post(fd, true, (char *)req, sizeof(*req), &x[0]) < 0)
+		return -1;
+	if (psipe_mm_post(fd, false, (char *)grant, sizeof(*grant),
+				&x[1]) < 0) {
+		psipe_mm_wait(fd, &x[0]);
+		return -1;
+	}
+	rv = psipe_mm_wait(fd, &x[0]);
+	if (psipe_mm_wait(fd, &x[1]) < 0)
+		rv = -1;
+	return rv;
+}
+
+static long psipe_mm_dyn_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// room for the rows of A and C of a chunk, in buffers a or b of ws
+static int psipe_mm_dyn_fit(struct psipe_mm_ws *ws, int b, int rows, int t,
+		int m, double **A, double **C)
+{
+	*A = psipe_mm_ws_get(ws, b ? PSIPE_MM_WS_A2 : PSIPE_MM_WS_A,
+			(size_t)rows * t * sizeof(double));
+	*C = psipe_mm_ws_get(ws, b ? PSIPE_MM_WS_C2 : PSIPE_MM_WS_C,
+			(size_t)rows * m * sizeof(double));
+	return *A && *C ? 0 : -1;
+}
+
+int psipe_mm_dyn_chiplet(int fd, struct psipe_sched *sched,
+		struct psipe_mm_ws *ws, const struct psipe_mm_args *args)
+{
+	int t = args->sz_t, m = args->sz_m, cur = 0, nxt;
+	struct psipe_mm_xfer x[3] = { 0 };
+	struct psipe_mm_req req = { 0 };
+	struct psipe_mm_grant grant[2];
+	double *B, *A[2], *C[2];
+	struct psipe_gemm_part part;
+	size_t blen = (size_t)t * m * sizeof(double);
+	int nx = 0, rv = -1;
+	bool have = false;
+	long t0;
+
+	if (args->b_ver != PSIPE_CACHE_NOVER) {
+		if (!ws->cache) {
+			errno = EINVAL;
+			return -1;
+		}
+		B = psipe_cache_accept(ws->cache, fd, &have, &blen);
+	} else {
+		B = psipe_mm_ws_get(ws, PSIPE_MM_WS_B, blen);
+	}
+	if (!B)
+		return -1;
+	if (!have && (psipe_mm_post(fd, false, (char *)B, blen, &x[0]) < 0 ||
+				psipe_mm_wait(fd, &x[0]) < 0))
+		return -1;
+	if (args->b_ver != PSIPE_CACHE_NOVER)
+		psipe_cache_commit(ws->cache, PSIPE_MM_KEY_B);
+
+	/* the first chunk, then each next one while on the current */
+	if (psipe_mm_dyn_ask(fd, &req, &grant[cur]) < 0)
+		return -1;
+	if (grant[cur].nrows && (psipe_mm_dyn_fit(ws, cur, grant[cur].nrows,
+				t, m, &A[cur], &C[cur]) < 0 ||
+			psipe_mm_post(fd, false, (char *)A[cur],
+				(size_t)grant[cur].nrows * t * sizeof(double),
+				&x[nx++]) < 0 ||
+			psipe_mm_post(fd, false, (char *)C[cur],
+				(size_t)grant[cur].nrows * m * sizeof(double),
+				&x[nx++]) < 0))
+		goto wait;
+
+	while (grant[cur].nrows) {
+		for (int i = 0; i < nx; ++i) {
+			if (psipe_mm_wait(fd, &x[i]) < 0)
+				return -1;
+		}
+		nx = 0;
+
+		nxt = !cur;
+		if (psipe_mm_dyn_ask(fd, &req, &grant[nxt]) < 0)
+			return -1;
+		if (grant[nxt].nrows && (psipe_mm_dyn_fit(ws, nxt,
+					grant[nxt].nrows, t, m, &A[nxt],
+					&C[nxt]) < 0 ||
+				psipe_mm_post(fd, false, (char *)A[nxt],
+					(size_t)grant[nxt].nrows * t *
+					sizeof(double), &x[nx++]) < 0 ||
+				psipe_mm_post(fd, false, (char *)C[nxt],
+					(size_t)grant[nxt].nrows * m *
+					sizeof(double), &x[nx++]) < 0))
+			goto wait;
+
+		part = (struct psipe_gemm_part){
+			.sz_t = t, .sz_m = m,
+			.A = A[cur], .lda = t, .row0 = grant[cur].row0,
+			.B = B, .ldb = m,
+			.j0 = 0, .j1 = m,
+			.C = C[cur],
+			.g_ofs = (long)grant[cur].row0 * m,
+			.g_len = (long)grant[cur].nrows * m,
+		};
+		t0 = psipe_mm_dyn_ns();
+		if (psipe_gemm_part_sched(sched, &part) < 0)
+			goto wait;
+		req.rows = grant[cur].nrows;
+		req.ns = psipe_mm_dyn_ns() - t0;
+
+		if (psipe_mm_post(fd, true, (char *)C[cur],
+					(size_t)grant[cur].nrows * m *
+					sizeof(double), &x[nx++]) < 0)
+			goto wait;
+		cur = nxt;
+	}
+	rv = 0;
+
+wait:
+	for (int i = 0; i < nx; ++i) {
+		if (psipe_mm_wait(fd, &x[i]) < 0)
+			rv = -1;
+	}
+	return rv;
+}
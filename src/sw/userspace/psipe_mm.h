@@ -0,0 +1,124 @@
+/* psipe_mm.h - Pipelined matrix multiplication offload
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "psipe_wrappers.h"
+
+struct psipe_sched;
+struct psipe_cache;
+
+// a partition is cut in about this many row blocks, and B in column panels
+#define PSIPE_MM_BLOCKS 4
+#define PSIPE_MM_PANELS 4
+// a dynamic chunk is at least this many rows of C
+#define PSIPE_MM_DYN_ROWS 4
+
+enum psipe_mm_kind {
+	PSIPE_MM_CIN, // the part of C to add to, master to chiplet
+	PSIPE_MM_A, // a row block of A, master to chiplet
+	PSIPE_MM_B, // a column panel of B, master to chiplet
+	PSIPE_MM_C, // a finished block of C, chiplet to master
+};
+
+struct psipe_mm_step {
+	enum psipe_mm_kind kind;
+	int idx;
+};
+
+enum psipe_mm_layout {
+	PSIPE_MM_LINEAR, // C split by flattened index
+	PSIPE_MM_2D, // C split in blocks over a grid of devices
+	PSIPE_MM_DYN, // rows of C handed out as the chiplets ask for them
+};
+
+// what a chiplet is told about its part of C = A x B (n x t x m), sent
+// ahead of everything else
+struct psipe_mm_args {
+	int sz_n, sz_t, sz_m;
+	int layout; // an enum psipe_mm_layout
+	long g_ofs, g_len;
+	int row0, nrows, col0, ncols;
+	// versions of A and B, the chiplet keeps them for the next job with
+	// the same. PSIPE_CACHE_NOVER for data sent every time
+	uint64_t a_ver, b_ver;
+};
+
+// buffers a chiplet keeps from job to job, only grown for a bigger one
+enum psipe_mm_ws_buf {
+	PSIPE_MM_WS_A,
+	PSIPE_MM_WS_B,
+	PSIPE_MM_WS_C,
+	PSIPE_MM_WS_A2, // the chunk in flight, PSIPE_MM_DYN
+	PSIPE_MM_WS_C2,
+	PSIPE_MM_WS_NUM,
+};
+
+struct psipe_mm_ws {
+	double *buf[PSIPE_MM_WS_NUM];
+	size_t cap[PSIPE_MM_WS_NUM]; // in bytes
+	struct psipe_cache *cache; // where versioned A and B stay
+};
+
+// buffer i with room for len bytes at least, NULL (errno) if it cannot be
+double *psipe_mm_ws_get(struct psipe_mm_ws *ws, enum psipe_mm_ws_buf i,
+		size_t len);
+void psipe_mm_ws_fini(struct psipe_mm_ws *ws);
+
+// how a part travels. Both ends build it from the same arguments and go
+// through the same steps
+struct psipe_mm_plan {
+	int sz_n, sz_t, sz_m;
+	bool rect;
+	// a linear part is g_ofs..g_ofs+g_len-1 of C. A rectangle is stored
+	// nrows x ncols, which is 0..g_len-1 of that smaller product
+	long g_ofs, g_len;
+	int row0, nrows; // rows of C the part touches, so of A it needs
+	int col0, ncols; // columns of C it touches, so of B it needs
+	uint64_t a_ver, b_ver;
+	bool have_a, have_b; // already on the chiplet, no steps for them
+	int block_rows, nblocks;
+	int panel_cols, npanels;
+	int nsteps;
+	struct psipe_mm_step *steps;
+};
+
+// split C = A x B over num devices, args[d] for device d
+void psipe_mm_partition(struct psipe_mm_args *args, int num, int sz_n,
+		int sz_t, int sz_m, enum psipe_mm_layout layout);
+
+int psipe_mm_plan_init(struct psipe_mm_plan *plan,
+		const struct psipe_mm_args *args);
+void psipe_mm_plan_fini(struct psipe_mm_plan *plan);
+
+// master side: offer the versioned A and B of each plan to its chiplet,
+// and leave out the steps of what it holds already. Return 0 or -1 (errno)
+int psipe_mm_offer(struct psipe_mm_plan *plans, int num);
+// chiplet side: the other end. *A and *Bp are in ws->cache if versioned
+int psipe_mm_accept(int fd, struct psipe_mm_ws *ws,
+		struct psipe_mm_plan *plan, double **A, double **Bp);
+// once psipe_mm_chiplet is done: what was accepted stays resident
+void psipe_mm_landed(struct psipe_mm_ws *ws, const struct psipe_mm_plan *plan);
+
+// master side: plans[d] for device d, A, B and C the whole matrices. Each
+// chiplet gets only the rows of A and the columns of B its part needs, and
+// the part of C to add to. Return 0 or -1 (errno)
+int psipe_mm_master(struct psipe_mm_plan *plans, int num, const double *A,
+		const double *B, double *C);
+
+// chiplet side: A holds rows row0..row0+nrows-1 (plan->nrows * sz_t), Bp
+// columns col0..col0+ncols-1 (sz_t * plan->ncols), C the part (g_len)
+int psipe_mm_chiplet(int fd, struct psipe_sched *sched,
+		struct psipe_mm_plan *plan, double *A, double *Bp, double *C);
+
+// PSIPE_MM_DYN: every chiplet gets all of B, then asks for chunks of rows of
+// C until none are left. A chunk is sized by how fast the chiplet has been
+int psipe_mm_dyn_master(int num, const struct psipe_mm_args *args,
+		const double *A, const double *B, double *C);
+int psipe_mm_dyn_chiplet(int fd, struct psipe_sched *sched,
+		struct psipe_mm_ws *ws, const struct psipe_mm_args *args);
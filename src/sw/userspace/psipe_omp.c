@@ -0,0 +1,463 @@
+/* psipe_omp.c - libomptarget plugin over the psipe devices
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <elf.h>
+#include <pthread.h>
+#include "psipe_omp.h"
+#include "psipe_coll.h"
+
+/*
+ * Every device is an OpenMP device, run by the chiplet-omp at its other end.
+ * Target images are ELF shared objects for the chiplets, which chiplet-omp
+ * loads, and target pointers are chiplet addresses. The _async calls only
+ * post their ops and leave them in the queue of the __tgt_async_info, so
+ * the host maps the next data while the chiplet runs a region.
+ *
+ * This is the C interface of the plugins (omptargetplugin.h), the types
+ * below are the ones it passes.
+ */
+
+#define OFFLOAD_SUCCESS 0
+#define OFFLOAD_FAIL (~0)
+
+// built with -fvisibility=hidden, so only the entry points leave the plugin
+#define PSIPE_OMP_EXPORT __attribute__((visibility("default")))
+
+struct __tgt_offload_entry {
+	void *addr;
+	char *name;
+	size_t size;
+	int32_t flags;
+	int32_t reserved;
+};
+
+struct __tgt_device_image {
+	void *ImageStart;
+	void *ImageEnd;
+	struct __tgt_offload_entry *EntriesBegin;
+	struct __tgt_offload_entry *EntriesEnd;
+};
+
+struct __tgt_target_table {
+	struct __tgt_offload_entry *EntriesBegin;
+	struct __tgt_offload_entry *EntriesEnd;
+};
+
+struct __tgt_async_info {
+	void *Queue;
+};
+
+// hidden: the program loading the plugin may have its own
+struct psipe_devices *psipe_devs;
+
+// a command on its way: its ops, and what it sends and gets back
+struct psipe_omp_pending {
+	struct psipe_omp_pending *next;
+	int dev;
+	struct psipe_omp_cmd cmd;
+	struct psipe_omp_reply reply;
+	bool has_reply;
+	int nids;
+	long ids[];
+};
+
+// the queue of a __tgt_async_info, waited for by __tgt_rtl_synchronize
+struct psipe_omp_queue {
+	struct psipe_omp_pending *head;
+	struct psipe_omp_pending **tail;
+};
+
+struct psipe_omp_table {
+	struct psipe_omp_table *next;
+	struct __tgt_target_table table;
+	struct __tgt_offload_entry entries[];
+};
+
+struct psipe_omp_dev {
+	pthread_mutex_t lock; // the ops of a command go out together
+	struct psipe_omp_table *tables;
+};
+
+static pthread_once_t psipe_omp_once = PTHREAD_ONCE_INIT;
+static struct psipe_omp_dev *psipe_omp_devs;
+static int psipe_omp_ndevs;
+
+static void psipe_omp_open(void)
+{
+	if (psipe_open_devs() < 0)
+		return;
+
+	psipe_omp_devs = calloc(psipe_num_devs(), sizeof(*psipe_omp_devs));
+	if (!psipe_omp_devs) {
+		psipe_close_devs();
+		return;
+	}
+	for (int i = 0; i < psipe_num_devs(); ++i)
+		pthread_mutex_init(&psipe_omp_devs[i].lock, NULL);
+	psipe_omp_ndevs = psipe_num_devs();
+}
+
+static inline size_t psipe_omp_nchunks(size_t len)
+{
+	return (len + PSIPE_COLL_CHUNK - 1) / PSIPE_COLL_CHUNK;
+}
+
+static int psipe_omp_finish(struct psipe_omp_pending *p)
+{
+	int fd = psipe_fd(p->dev), rv = 0;
+
+	for (int i = 0; i < p->nids; ++i) {
+		if (psipe_wait(fd, p->ids[i]) < 0)
+			rv = -1;
+	}
+	if (!rv && p->has_reply && p->reply.rv < 0) {
+		errno = -p->reply.rv;
+		rv = -1;
+	}
+	return rv;
+}
+
+/*
+ * Post cmd, then its len bytes of data (to the chiplet if send) and then
+ * the reply if there is one. Nothing is waited for.
+ */
+static struct psipe_omp_pending *psipe_omp_post(int dev,
+		const struct psipe_omp_cmd *cmd, void *data, bool send,
+		bool reply)
+{
+	size_t nchunks = data ? psipe_omp_nchunks(cmd->len) : 0, pos, len;
+	struct psipe_omp_pending *p;
+	int fd = psipe_fd(dev);
+	long id;
+
+	p = calloc(1, sizeof(*p) + (nchunks + 2) * sizeof(long));
+	if (!p)
+		return NULL;
+	p->dev = dev;
+	p->cmd = *cmd;
+	p->has_reply = reply;
+
+	pthread_mutex_lock(&psipe_omp_devs[dev].lock);
+	id = psipe_send(fd, &p->cmd, sizeof(p->cmd));
+	if (id < 0)
+		goto fail;
+	p->ids[p->nids++] = id;
+
+	for (size_t c = 0; c < nchunks; ++c) {
+		pos = c * PSIPE_COLL_CHUNK;
+		len = cmd->len - pos < PSIPE_COLL_CHUNK ?
+			cmd->len - pos : PSIPE_COLL_CHUNK;
+		id = send ? psipe_send(fd, (char *)data + pos, len) :
+			psipe_recv(fd, (char *)data + pos, len);
+		if (id < 0)
+			goto fail;
+		p->ids[p->nids++] = id;
+	}
+
+	if (reply) {
+		id = psipe_recv(fd, &p->reply, sizeof(p->reply));
+		if (id < 0)
+			goto fail;
+		p->ids[p->nids++] = id;
+	}
+	pthread_mutex_unlock(&psipe_omp_devs[dev].lock);
+	return p;
+
+fail:
+	/* the chiplet is now out of step, there is no going on */
+	pthread_mutex_unlock(&psipe_omp_devs[dev].lock);
+	p->has_reply = false;
+	psipe_omp_finish(p);
+	free(p);
+	return NULL;
+}
+
+// the whole command, with its reply in *reply if not NULL
+static int psipe_omp_call(int dev, const struct psipe_omp_cmd *cmd,
+		void *data, bool send, struct psipe_omp_reply *reply)
+{
+	struct psipe_omp_pending *p;
+	int rv;
+
+	p = psipe_omp_post(dev, cmd, data, send, reply != NULL);
+	if (!p)
+		return OFFLOAD_FAIL;
+	rv = psipe_omp_finish(p);
+	if (reply)
+		*reply = p->reply;
+	free(p);
+	return rv < 0 ? OFFLOAD_FAIL : OFFLOAD_SUCCESS;
+}
+
+// the command in the queue of async, or done now if there is none
+static int psipe_omp_queue(int dev, const struct psipe_omp_cmd *cmd,
+		void *data, bool send, bool reply,
+		struct __tgt_async_info *async)
+{
+	struct psipe_omp_pending *p;
+	struct psipe_omp_queue *q;
+
+	if (!async) {
+		struct psipe_omp_reply r;
+
+		return psipe_omp_call(dev, cmd, data, send, reply ? &r : NULL);
+	}
+
+	q = async->Queue;
+	if (!q) {
+		q = calloc(1, sizeof(*q));
+		if (!q)
+			return OFFLOAD_FAIL;
+		q->tail = &q->head;
+		async->Queue = q;
+	}
+
+	p = psipe_omp_post(dev, cmd, data, send, reply);
+	if (!p)
+		return OFFLOAD_FAIL;
+	*q->tail = p;
+	q->tail = &p->next;
+	return OFFLOAD_SUCCESS;
+}
+
+static bool psipe_omp_valid(int32_t id)
+{
+	pthread_once(&psipe_omp_once, psipe_omp_open);
+	return id >= 0 && id < psipe_omp_ndevs;
+}
+
+/* ============================================================================
+ * Plugin interface
+ * ============================================================================
+ */
+
+PSIPE_OMP_EXPORT
+int32_t __tgt_rtl_is_valid_binary(struct __tgt_device_image *image)
+{
+	size_t len = (char *)image->ImageEnd - (char *)image->ImageStart;
+	const Elf64_Ehdr *eh = image->ImageStart;
+
+	/* what the chiplets run */
+	return len >= sizeof(*eh) && !memcmp(eh->e_ident, ELFMAG, SELFMAG) &&
+		eh->e_ident[EI_CLASS] == ELFCLASS64 &&
+		eh->e_type == ET_DYN && eh->e_machine == EM_RISCV;
+}
+
+PSIPE_OMP_EXPORT
+int32_t __tgt_rtl_number_of_devices(void)
+{
+	pthread_once(&psipe_omp_once, psipe_omp_open);
+	return psipe_omp_ndevs;
+}
+
+PSIPE_OMP_EXPORT
+int64_t __tgt_rtl_init_requires(int64_t flags)
+{
+	return flags;
+}
+
+PSIPE_OMP_EXPORT
+int32_t __tgt_rtl_init_device(int32_t id)
+{
+	return psipe_omp_valid(id) ? OFFLOAD_SUCCESS : OFFLOAD_FAIL;
+}
+
+PSIPE_OMP_EXPORT
+int32_t __tgt_rtl_deinit_device(int32_t id)
+{
+	struct psipe_omp_cmd cmd = { .op = PSIPE_OMP_END };
+	struct psipe_omp_table *t;
+	int rv;
+
+	if (!psipe_omp_valid(id))
+		return OFFLOAD_FAIL;
+
+	rv = psipe_omp_call(id, &cmd, NULL, false, NULL);
+	while ((t = psipe_omp_devs[id].tables)) {
+		psipe_omp_devs[id].tables = t->next;
+		free(t);
+	}
+	return rv;
+}
+
+PSIPE_OMP_EXPORT
+struct __tgt_target_table *__tgt_rtl_load_binary(int32_t id,
+		struct __tgt_device_image *image)
+{
+	struct psipe_omp_cmd cmd = { .op = PSIPE_OMP_LOAD };
+	int n = image->EntriesEnd - image->EntriesBegin;
+	struct psipe_omp_reply reply;
+	struct psipe_omp_table *t;
+
+	if (!psipe_omp_valid(id))
+		return NULL;
+
+	cmd.len = (char *)image->ImageEnd - (char *)image->ImageStart;
+	if (psipe_omp_call(id, &cmd, image->ImageStart, true, &reply))
+		return NULL;
+
+	t = malloc(sizeof(*t) + (n + 1) * sizeof(*t->entries));
+	if (!t)
+		return NULL;
+
+	/* kernels and globals, at their chiplet addresses */
+	for (int i = 0; i < n; ++i) {
+		t->entries[i] = image->EntriesBegin[i];
+		cmd = (struct psipe_omp_cmd){ .op = PSIPE_OMP_SYM };
+		if (strlen(t->entries[i].name) >= PSIPE_OMP_NAME)
+			goto free_table;
+		strcpy(cmd.name, t->entries[i].name);
+		if (psipe_omp_call(id, &cmd, NULL, false, &reply))
+			goto free_table;
+		t->entries[i].addr = (void *)(uintptr_t)reply.addr;
+	}
+
+	t->table.EntriesBegin = t->entries;
+	t->table.EntriesEnd = t->entries + n;
+	t->next = psipe_omp_devs[id].tables;
+	psipe_omp_devs[id].tables = t;
+	return &t->table;
+
+free_table:
+	free(t);
+	return NULL;
+}
+
+PSIPE_OMP_EXPORT
+void *__tgt_rtl_data_alloc(int32_t id, int64_t size, void *hst_ptr,
+		int32_t kind)
+{
+	struct psipe_omp_cmd cmd = { .op = PSIPE_OMP_ALLOC, .len = size };
+	struct psipe_omp_reply reply;
+
+	if (!psipe_omp_valid(id) ||
+			psipe_omp_call(id, &cmd, NULL, false, &reply))
+		return NULL;
+	return (void *)(uintptr_t)reply.addr;
+}
+
+PSIPE_OMP_EXPORT
+int32_t __tgt_rtl_data_delete(int32_t id, void *tgt_ptr, int32_t kind)
+{
+	struct psipe_omp_cmd cmd = {
+		.op = PSIPE_OMP_FREE, .addr = (uintptr_t)tgt_ptr,
+	};
+
+	if (!psipe_omp_valid(id))
+		return OFFLOAD_FAIL;
+	return psipe_omp_call(id, &cmd, NULL, false, NULL);
+}
+
+PSIPE_OMP_EXPORT
+int32_t __tgt_rtl_data_submit_async(int32_t id, void *tgt_ptr, void *hst_ptr,
+		int64_t size, struct __tgt_async_info *async)
+{
+	struct psipe_omp_cmd cmd = {
+		.op = PSIPE_OMP_SUBMIT, .addr = (uintptr_t)tgt_ptr, .len = size,
+	};
+
+	if (!psipe_omp_valid(id))
+		return OFFLOAD_FAIL;
+	return psipe_omp_queue(id, &cmd, hst_ptr, true, false, async);
+}
+
+PSIPE_OMP_EXPORT
+int32_t __tgt_rtl_data_submit(int32_t id, void *tgt_ptr, void *hst_ptr,
+		int64_t size)
+{
+	return __tgt_rtl_data_submit_async(id, tgt_ptr, hst_ptr, size, NULL);
+}
+
+PSIPE_OMP_EXPORT
+int32_t __tgt_rtl_data_retrieve_async(int32_t id, void *hst_ptr,
+		void *tgt_ptr, int64_t size, struct __tgt_async_info *async)
+{
+	struct psipe_omp_cmd cmd = {
+		.op = PSIPE_OMP_RETRIEVE, .addr = (uintptr_t)tgt_ptr,
+		.len = size,
+	};
+
+	if (!psipe_omp_valid(id))
+		return OFFLOAD_FAIL;
+	return psipe_omp_queue(id, &cmd, hst_ptr, false, false, async);
+}
+
+PSIPE_OMP_EXPORT
+int32_t __tgt_rtl_data_retrieve(int32_t id, void *hst_ptr, void *tgt_ptr,
+		int64_t size)
+{
+	return __tgt_rtl_data_retrieve_async(id, hst_ptr, tgt_ptr, size, NULL);
+}
+
+PSIPE_OMP_EXPORT
+int32_t __tgt_rtl_run_target_region_async(int32_t id, void *entry,
+		void **args, ptrdiff_t *offsets, int32_t nargs,
+		struct __tgt_async_info *async)
+{
+	struct psipe_omp_cmd cmd = {
+		.op = PSIPE_OMP_RUN, .addr = (uintptr_t)entry, .nargs = nargs,
+	};
+
+	if (!psipe_omp_valid(id) || nargs > PSIPE_OMP_MAX_ARGS)
+		return OFFLOAD_FAIL;
+	for (int i = 0; i < nargs; ++i)
+		cmd.args[i] = (uintptr_t)((char *)args[i] + offsets[i]);
+	return psipe_omp_queue(id, &cmd, NULL, false, true, async);
+}
+
+PSIPE_OMP_EXPORT
+int32_t __tgt_rtl_run_target_region(int32_t id, void *entry, void **args,
+		ptrdiff_t *offsets, int32_t nargs)
+{
+	return __tgt_rtl_run_target_region_async(id, entry, args, offsets,
+			nargs, NULL);
+}
+
+// a chiplet is one team, how many threads it uses is up to the region
+PSIPE_OMP_EXPORT
+int32_t __tgt_rtl_run_target_team_region_async(int32_t id, void *entry,
+		void **args, ptrdiff_t *offsets, int32_t nargs,
+		int32_t num_teams, int32_t thread_limit,
+		uint64_t loop_tripcount, struct __tgt_async_info *async)
+{
+	return __tgt_rtl_run_target_region_async(id, entry, args, offsets,
+			nargs, async);
+}
+
+PSIPE_OMP_EXPORT
+int32_t __tgt_rtl_run_target_team_region(int32_t id, void *entry,
+		void **args, ptrdiff_t *offsets, int32_t nargs,
+		int32_t num_teams, int32_t thread_limit,
+		uint64_t loop_tripcount)
+{
+	return __tgt_rtl_run_target_region_async(id, entry, args, offsets,
+			nargs, NULL);
+}
+
+PSIPE_OMP_EXPORT
+int32_t __tgt_rtl_synchronize(int32_t id, struct __tgt_async_info *async)
+{
+	struct psipe_omp_queue *q = async->Queue;
+	struct psipe_omp_pending *p;
+	int rv = OFFLOAD_SUCCESS;
+
+	if (!q)
+		return OFFLOAD_SUCCESS;
+
+	while ((p = q->head)) {
+		q->head = p->next;
+		if (psipe_omp_finish(p) < 0)
+			rv = OFFLOAD_FAIL;
+		free(p);
+	}
+	free(q);
+	async->Queue = NULL;
+	return rv;
+}
@@ -0,0 +1,45 @@
+/* psipe_omp.h - OpenMP offloading over the psipe devices
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * What the libomptarget plugin (psipe_omp.c) asks chiplet-omp, one command
+ * at a time over each device. A command is followed by its data, if any,
+ * and then the reply, if any, both ends posting the same ops in the same
+ * order. Data moves in chunks of PSIPE_COLL_CHUNK.
+ */
+
+#define PSIPE_OMP_NAME 128
+// arguments of a target region, pointers on the chiplet
+#define PSIPE_OMP_MAX_ARGS 16
+
+enum psipe_omp_op {
+	PSIPE_OMP_LOAD, // len bytes of ELF image follow, reply
+	PSIPE_OMP_SYM, // address of name in the last image, reply
+	PSIPE_OMP_ALLOC, // len bytes of chiplet memory, reply
+	PSIPE_OMP_FREE, // addr
+	PSIPE_OMP_SUBMIT, // len bytes follow, into addr
+	PSIPE_OMP_RETRIEVE, // len bytes from addr come back
+	PSIPE_OMP_RUN, // call addr with args, reply
+	PSIPE_OMP_END, // drop the images and memory of this session
+};
+
+struct psipe_omp_cmd {
+	int32_t op;
+	int32_t nargs;
+	uint64_t addr;
+	uint64_t len;
+	uint64_t args[PSIPE_OMP_MAX_ARGS];
+	char name[PSIPE_OMP_NAME];
+};
+
+struct psipe_omp_reply {
+	int64_t rv; // 0 or -errno
+	uint64_t addr;
+};
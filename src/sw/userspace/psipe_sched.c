@@ -0,0 +1,259 @@
+/* psipe_sched.c - Work-stealing thread pool for the chiplet programs
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "psipe_sched.h"
+
+/*
+ * Every worker starts a run with an even share of the tiles and takes them
+ * from the front. One that runs dry steals the back half of another's share,
+ * so ragged ends balance out without a shared counter on the fast path.
+ */
+
+// tiles [head, tail) still to run, one per worker
+struct psipe_sched_queue {
+	pthread_mutex_t lock;
+	long head;
+	long tail;
+} __attribute__((aligned(64)));
+
+struct psipe_sched_worker {
+	struct psipe_sched *sched;
+	int id;
+};
+
+struct psipe_sched {
+	int nthreads;
+	pthread_t *threads; // nthreads - 1, the caller is worker 0
+	struct psipe_sched_worker *workers;
+	struct psipe_sched_queue *queues;
+
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned long gen; // bumped by every run
+	int busy; // workers still in the current run
+	bool quit;
+
+	psipe_sched_fn fn;
+	void *arg;
+	int err; // errno of the first failed tile
+};
+
+static bool psipe_sched_take(struct psipe_sched_queue *q, long *tile)
+{
+	bool ok;
+
+	pthread_mutex_lock(&q->lock);
+	ok = q->head < q->tail;
+	if (ok)
+		*tile = q->head++;
+	pthread_mutex_unlock(&q->lock);
+	return ok;
+}
+
+// move the back half of victim's tiles to own, which is empty
+static bool psipe_sched_steal(struct psipe_sched_queue *victim,
+		struct psipe_sched_queue *own)
+{
+	long lo, hi;
+
+	pthread_mutex_lock(&victim->lock);
+	hi = victim->tail;
+	lo = hi - (hi - victim->head + 1) / 2;
+	victim->tail = lo;
+	pthread_mutex_unlock(&victim->lock);
+
+	if (lo >= hi)
+		return false;
+
+	pthread_mutex_lock(&own->lock);
+	own->head = lo;
+	own->tail = hi;
+	pthread_mutex_unlock(&own->lock);
+	return true;
+}
+
+static void psipe_sched_work(struct psipe_sched *sched, int id)
+{
+	struct psipe_sched_queue *own = &sched->queues[id];
+	int n = sched->nthreads, v;
+	long tile;
+
+	for (;;) {
+		while (psipe_sched_take(own, &tile)) {
+			if (sched->fn(sched->arg, tile) < 0) {
+				pthread_mutex_lock(&sched->lock);
+				if (!sched->err)
+					sched->err = errno ? errno : EIO;
+				pthread_mutex_unlock(&sched->lock);
+			}
+		}
+
+		for (v = 1; v < n; ++v) {
+			if (psipe_sched_steal(&sched->queues[(id + v) % n],
+						own))
+				break;
+		}
+		if (v == n)
+			return;
+	}
+}
+
+static void *psipe_sched_thread(void *data)
+{
+	struct psipe_sched_worker *w = data;
+	struct psipe_sched *sched = w->sched;
+	unsigned long gen = 0;
+
+	pthread_mutex_lock(&sched->lock);
+	for (;;) {
+		while (sched->gen == gen && !sched->quit)
+			pthread_cond_wait(&sched->start, &sched->lock);
+		if (sched->quit)
+			break;
+		gen = sched->gen;
+		pthread_mutex_unlock(&sched->lock);
+
+		psipe_sched_work(sched, w->id);
+
+		pthread_mutex_lock(&sched->lock);
+		if (!--sched->busy)
+			pthread_cond_signal(&sched->done);
+	}
+	pthread_mutex_unlock(&sched->lock);
+
+	return NULL;
+}
+
+/* ============================================================================
+ * Public
+ * ============================================================================
+ */
+
+int psipe_sched_threads(void)
+{
+	const char *env = getenv("PSIPE_THREADS");
+	long n = env ? strtol(env, NULL, 0) : sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? (int)n : 1;
+}
+
+struct psipe_sched *psipe_sched_create(int nthreads)
+{
+	struct psipe_sched *sched;
+	int i, rv;
+
+	if (nthreads < 1)
+		nthreads = 1;
+
+	sched = calloc(1, sizeof(*sched));
+	if (!sched)
+		return NULL;
+
+	sched->nthreads = nthreads;
+	sched->threads = calloc(nthreads, sizeof(*sched->threads));
+	sched->workers = calloc(nthreads, sizeof(*sched->workers));
+	rv = posix_memalign((void **)&sched->queues,
+			__alignof__(struct psipe_sched_queue),
+			nthreads * sizeof(*sched->queues));
+	if (!sched->threads || !sched->workers || rv)
+		goto free_sched;
+
+	pthread_mutex_init(&sched->lock, NULL);
+	pthread_cond_init(&sched->start, NULL);
+	pthread_cond_init(&sched->done, NULL);
+	for (i = 0; i < nthreads; ++i) {
+		pthread_mutex_init(&sched->queues[i].lock, NULL);
+		sched->queues[i].head = sched->queues[i].tail = 0;
+		sched->workers[i].sched = sched;
+		sched->workers[i].id = i;
+	}
+
+	for (i = 1; i < nthreads; ++i) {
+		rv = pthread_create(&sched->threads[i], NULL,
+				psipe_sched_thread, &sched->workers[i]);
+		if (rv) {
+			/* run with the ones there are */
+			sched->nthreads = i;
+			break;
+		}
+	}
+
+	return sched;
+
+free_sched:
+	free(sched->queues);
+	free(sched->workers);
+	free(sched->threads);
+	free(sched);
+	return NULL;
+}
+
+void psipe_sched_destroy(struct psipe_sched *sched)
+{
+	if (!sched)
+		return;
+
+	pthread_mutex_lock(&sched->lock);
+	sched->quit = true;
+	pthread_cond_broadcast(&sched->start);
+	pthread_mutex_unlock(&sched->lock);
+
+	for (int i = 1; i < sched->nthreads; ++i)
+		pthread_join(sched->threads[i], NULL);
+
+	free(sched->queues);
+	free(sched->workers);
+	free(sched->threads);
+	free(sched);
+}
+
+int psipe_sched_nthreads(struct psipe_sched *sched)
+{
+	return sched->nthreads;
+}
+
+int psipe_sched_run(struct psipe_sched *sched, long ntiles, psipe_sched_fn fn,
+		void *arg)
+{
+	int n = sched->nthreads;
+
+	if (ntiles <= 0)
+		return 0;
+
+	/* workers are all parked, no need for the queue locks */
+	for (int i = 0; i < n; ++i) {
+		sched->queues[i].head = ntiles * i / n;
+		sched->queues[i].tail = ntiles * (i + 1) / n;
+	}
+
+	pthread_mutex_lock(&sched->lock);
+	sched->fn = fn;
+	sched->arg = arg;
+	sched->err = 0;
+	sched->busy = n - 1;
+	++sched->gen;
+	pthread_cond_broadcast(&sched->start);
+	pthread_mutex_unlock(&sched->lock);
+
+	psipe_sched_work(sched, 0);
+
+	pthread_mutex_lock(&sched->lock);
+	while (sched->busy)
+		pthread_cond_wait(&sched->done, &sched->lock);
+	pthread_mutex_unlock(&sched->lock);
+
+	if (sched->err) {
+		errno = sched->err;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,25 @@
+/* psipe_sched.h - Work-stealing thread pool for the chiplet programs
+ *
+ * Author: David Cañadas López <dcanadas@bsc.es>
+ *
+ */
+
+#pragma once
+
+// runs tile number tile of a psipe_sched_run, returns 0 or -1 (errno)
+typedef int (*psipe_sched_fn)(void *arg, long tile);
+
+struct psipe_sched;
+
+// PSIPE_THREADS if set, or the number of online cpus
+int psipe_sched_threads(void);
+
+// nthreads workers, the caller of psipe_sched_run being one of them
+struct psipe_sched *psipe_sched_create(int nthreads);
+void psipe_sched_destroy(struct psipe_sched *sched);
+int psipe_sched_nthreads(struct psipe_sched *sched);
+
+// run fn on tiles 0..ntiles-1 and return when all are done. Return 0 or -1
+// (errno of the first tile that failed)
+int psipe_sched_run(struct psipe_sched *sched, long ntiles, psipe_sched_fn fn,
+		void *arg);
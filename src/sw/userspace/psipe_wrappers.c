@@ -1,7 +1,9 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include "psipe_wrappers.h"
@@ -98,6 +100,128 @@ int psipe_recv(int fd, void *addr, size_t len)
 	return ioctl(fd, PSIPE_IOCTL_RECV, &data);
 }
 
+int psipe_recv_red(int fd, void *addr, size_t len, int op)
+{
+	struct psipe_red_data data = {
+		.addr = (unsigned long)addr,
+		.len = (unsigned long)len,
+		.op = (unsigned long)op,
+	};
+	return ioctl(fd, PSIPE_IOCTL_RECV_RED, &data);
+}
+
+int psipe_dev_id(int fd)
+{
+	return ioctl(fd, PSIPE_IOCTL_DEV_ID);
+}
+
+int psipe_send_bcast(int *fds, int nfds, void *addr, size_t len)
+{
+	struct psipe_bcast_data data = {
+		.addr = (unsigned long)addr,
+		.len = (unsigned long)len,
+		.group = 0,
+	};
+	int id;
+
+	for (int i = 0; i < nfds; ++i) {
+		id = psipe_dev_id(fds[i]);
+		if (id < 0)
+			return -1;
+		data.group |= 1UL << id;
+	}
+	return ioctl(fds[0], PSIPE_IOCTL_BCAST, &data);
+}
+
+void *psipe_buf_alloc(int fd, size_t size)
+{
+	void *buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return buf == MAP_FAILED ? NULL : buf;
+}
+
+int psipe_buf_free(void *buf, size_t size)
+{
+	return munmap(buf, size);
+}
+
+int psipe_send_buf(int fd, void *buf, size_t ofs, size_t len)
+{
+	struct psipe_buf_data data = {
+		.buf = (unsigned long)buf,
+		.ofs = (unsigned long)ofs,
+		.len = (unsigned long)len,
+	};
+	return ioctl(fd, PSIPE_IOCTL_SEND_BUF, &data);
+}
+
+int psipe_recv_buf(int fd, void *buf, size_t ofs, size_t len)
+{
+	struct psipe_buf_data data = {
+		.buf = (unsigned long)buf,
+		.ofs = (unsigned long)ofs,
+		.len = (unsigned long)len,
+	};
+	return ioctl(fd, PSIPE_IOCTL_RECV_BUF, &data);
+}
+
+int psipe_buf_export(int fd, void *buf)
+{
+	return ioctl(fd, PSIPE_IOCTL_BUF_EXPORT, (unsigned long)buf);
+}
+
+int psipe_send_dmabuf(int fd, int dmabuf_fd, size_t ofs, size_t len)
+{
+	struct psipe_dmabuf_data data = {
+		.fd = dmabuf_fd,
+		.ofs = (unsigned long)ofs,
+		.len = (unsigned long)len,
+	};
+	return ioctl(fd, PSIPE_IOCTL_SEND_DMABUF, &data);
+}
+
+int psipe_recv_dmabuf(int fd, int dmabuf_fd, size_t ofs, size_t len)
+{
+	struct psipe_dmabuf_data data = {
+		.fd = dmabuf_fd,
+		.ofs = (unsigned long)ofs,
+		.len = (unsigned long)len,
+	};
+	return ioctl(fd, PSIPE_IOCTL_RECV_DMABUF, &data);
+}
+
+static void psipe_prep_cmd(struct io_uring_sqe *sqe, int fd, unsigned int cmd,
+		const void *arg, size_t size)
+{
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = fd;
+	sqe->cmd_op = cmd;
+	memcpy(sqe->cmd, arg, size);
+}
+
+void psipe_prep_send(struct io_uring_sqe *sqe, int fd, void *addr, size_t len)
+{
+	struct psipe_data data = {
+		.addr = (unsigned long)addr,
+		.len = (unsigned long)len,
+	};
+	psipe_prep_cmd(sqe, fd, PSIPE_IOCTL_SEND, &data, sizeof(data));
+}
+
+void psipe_prep_recv(struct io_uring_sqe *sqe, int fd, void *addr, size_t len)
+{
+	struct psipe_data data = {
+		.addr = (unsigned long)addr,
+		.len = (unsigned long)len,
+	};
+	psipe_prep_cmd(sqe, fd, PSIPE_IOCTL_RECV, &data, sizeof(data));
+}
+
+void psipe_prep_wait(struct io_uring_sqe *sqe, int fd, psipe_handle_t id)
+{
+	psipe_prep_cmd(sqe, fd, PSIPE_IOCTL_WAIT, &id, sizeof(id));
+}
+
 int psipe_wait(int fd, psipe_handle_t id)
 {
 	return ioctl(fd, PSIPE_IOCTL_WAIT, id);
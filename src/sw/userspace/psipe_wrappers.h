@@ -1,3 +1,7 @@
+#pragma once
+
+#include <stddef.h>
+#include <linux/io_uring.h>
 #include "sw/module/psipe_ioctl.h"
 
 #define WAIT_ALL_OPS 0
@@ -20,5 +24,29 @@ int psipe_flush(int fd);
 // these return a handle if return value is non-negative
 int psipe_send(int fd, void *addr, size_t len);
 int psipe_recv(int fd, void *addr, size_t len);
+// the device folds what arrives into addr (op is a PSIPE_RED_*)
+int psipe_recv_red(int fd, void *addr, size_t len, int op);
+
+// same data to the peers of all fds, read from memory once; queued on fds[0]
+int psipe_send_bcast(int *fds, int nfds, void *addr, size_t len);
+int psipe_dev_id(int fd);
+
+// driver buffers: contiguous, no pinning, one DMA handle per op
+void *psipe_buf_alloc(int fd, size_t size);
+int psipe_buf_free(void *buf, size_t size);
+int psipe_send_buf(int fd, void *buf, size_t ofs, size_t len);
+int psipe_recv_buf(int fd, void *buf, size_t ofs, size_t len);
+
+// dma-bufs: share a driver buffer, or use one from another device
+int psipe_buf_export(int fd, void *buf);
+int psipe_send_dmabuf(int fd, int dmabuf_fd, size_t ofs, size_t len);
+int psipe_recv_dmabuf(int fd, int dmabuf_fd, size_t ofs, size_t len);
+
+// io_uring: fill an sqe from the application's ring, the cqe res is what
+// psipe_wait would return. Use IOSQE_IO_LINK where the order matters.
+void psipe_prep_send(struct io_uring_sqe *sqe, int fd, void *addr, size_t len);
+void psipe_prep_recv(struct io_uring_sqe *sqe, int fd, void *addr, size_t len);
+void psipe_prep_wait(struct io_uring_sqe *sqe, int fd, psipe_handle_t id);
+
 int psipe_send_args(int fd, int sz_n, int sz_t, int sz_m, int len, int ofs);
 int psipe_recv_args(int fd, int *sz_n, int *sz_t, int *sz_m, int *len, int *ofs);
@@ -10,13 +10,14 @@ instances=1
 server=off
 port_base=9990
 debug_dev=off
+codec=none
 
 # disk params
 disk="vda.img"
 ronly=on
 lock=off
 
-while getopts "Ddsp:n:mMu" opt; do
+while getopts "Ddsp:n:z:t:mMu" opt; do
 	case "$opt" in
 		D) # DEBUG QEMU
 			debug_qemu="-s"
@@ -44,6 +45,12 @@ while getopts "Ddsp:n:mMu" opt; do
 				exit 1
 			fi
 			;;
+		z) # COMPRESS PAGES SENT (none, xor, zstd)
+			codec=$OPTARG
+			;;
+		t) # ENABLE TRACE EVENTS (e.g. "psipe_*")
+			trace="--trace $OPTARG -msg timestamp=on"
+			;;
 		m) # USE QEMU MONITOR
 			monitor="stdio"
 			;;
@@ -68,7 +75,7 @@ shift $((OPTIND-1))
 args=""
 for i in $(seq 1 $instances); do
 	port=$((port_base + i))
-	args="$args -device psipe,server_mode=$server,port=$port"
+	args="$args -device psipe,server_mode=$server,port=$port,compress=$codec"
 done
 
 #qemu-system-riscv64 \
@@ -84,4 +91,5 @@ exec ../qemu/build/qemu-system-riscv64 \
 	-monitor $monitor \
 	-name "$name - PSIPE[$instances:$mode]" \
 	$args \
+	$trace \
 	$debug_qemu